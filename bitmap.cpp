@@ -117,6 +117,7 @@ FsBitmap::markBlockUsed(uint32_t block_idx)
     bb.markDirty();
     // mark AG dirty
     this->ag_free_extents[block_idx / this->ag_size].need_update = true;
+    this->ag_free_extents[block_idx / this->ag_size].change_count ++;
 }
 
 void
@@ -133,6 +134,7 @@ FsBitmap::markBlockFree(uint32_t block_idx)
     bb.markDirty();
     // mark AG dirty
     this->ag_free_extents[block_idx / this->ag_size].need_update = true;
+    this->ag_free_extents[block_idx / this->ag_size].change_count ++;
 }
 
 void
@@ -178,6 +180,10 @@ FsBitmap::setAGSize(uint32_t size)
     uint32_t ag_count = (this->sizeInBlocks() - 1) / size + 1;
     this->ag_free_extents.clear();
     this->ag_free_extents.resize(ag_count);
+    for (uint32_t ag = 0; ag < ag_count; ag ++) {
+        this->ag_free_extents[ag].max_extent_when_empty =
+            this->largestUnreservedRun(this->AGBegin(ag), this->AGEnd(ag));
+    }
     // AG configuration changed, need to rescan for free extents
     this->updateAGFreeExtents();
 }
@@ -206,38 +212,96 @@ FsBitmap::allocateFreeExtent(uint32_t &ag, uint32_t required_size,
             ag = (ag + 1) % this->AGCount();    // next
             continue;
         }
-        ag_entry &fe = this->ag_free_extents[ag];
-        uint32_t k = 0;
-        while (k < fe.size() && fe[k].len >= required_size) k ++;
-        if (k > 0) {    // there was least one appropriate extent:
-            k --;       // previous, use it
-            assert1 (k < fe.size());   // k must point to some element in vector
-            assert2 ("extent should be large enough", fe[k].len >= required_size);
-            blocks.clear();
-            // fill blocks vector, decreasing extent
-            while (required_size > 0) {
-                blocks.push_back(fe[k].start);
-                fe[k].start ++;
-                fe[k].len --;
-                required_size --;
-            }
-            // length must stay non-negative
-            assert1 ((fe[k].len & 0x80000000) == 0);  // catch overflow, as .len unsigned
-            // if we used whole extent, its length is zero, and it should be removed
-            if (0 == fe[k].len) {
-                fe.list.erase(fe.list.begin() + k);
-            }
-            // sort by length
-            std::sort (fe.list.begin(), fe.list.end(), compare_by_extent_length_obj);
-
+        if (RFSD_OK == this->allocateFreeExtentInAG(ag, required_size, blocks))
             return RFSD_OK;
-        }
         ag = (ag + 1) % this->AGCount();    // proceed with next, wrap is necessary
     } while (ag != start_ag);
 
     return RFSD_FAIL;
 }
 
+int
+FsBitmap::allocateFreeExtentInAG(uint32_t ag, uint32_t required_size,
+                                 std::vector<uint32_t> &blocks)
+{
+    ag_entry &fe = this->ag_free_extents[ag];
+    uint32_t k = 0;
+    while (k < fe.size() && fe[k].len >= required_size) k ++;
+    if (0 == k)     // there is no appropriate extent
+        return RFSD_FAIL;
+
+    k --;       // previous one is the shortest appropriate, use it
+    assert1 (k < fe.size());   // k must point to some element in vector
+    assert2 ("extent should be large enough", fe[k].len >= required_size);
+    blocks.clear();
+    // fill blocks vector, decreasing extent
+    while (required_size > 0) {
+        blocks.push_back(fe[k].start);
+        fe[k].start ++;
+        fe[k].len --;
+        required_size --;
+    }
+    // length must stay non-negative
+    assert1 ((fe[k].len & 0x80000000) == 0);  // catch overflow, as .len unsigned
+    // if we used whole extent, its length is zero, and it should be removed
+    if (0 == fe[k].len) {
+        fe.list.erase(fe.list.begin() + k);
+    }
+    // sort by length
+    std::sort (fe.list.begin(), fe.list.end(), compare_by_extent_length_obj);
+
+    return RFSD_OK;
+}
+
+void
+FsBitmap::releaseExtent(uint32_t start, uint32_t len)
+{
+    ag_entry &fe = this->ag_free_extents[this->AGOfBlock(start)];
+    assert2 ("extent must lie within one AG",
+             this->AGOfBlock(start) == this->AGOfBlock(start + len - 1));
+    // join with free neighbours, so allocating and releasing leaves list as it was
+    std::vector<extent_t>::iterator it = fe.list.begin();
+    while (it != fe.list.end()) {
+        if (it->start + it->len == start) {
+            start = it->start;
+            len += it->len;
+            it = fe.list.erase(it);
+        } else if (start + len == it->start) {
+            len += it->len;
+            it = fe.list.erase(it);
+        } else {
+            ++ it;
+        }
+    }
+    extent_t ex;
+    ex.start = start;
+    ex.len = len;
+    fe.push_back(ex);
+    std::sort (fe.list.begin(), fe.list.end(), compare_by_extent_length_obj);
+}
+
+int
+FsBitmap::reserveExtent(uint32_t start, uint32_t len)
+{
+    ag_entry &fe = this->ag_free_extents[this->AGOfBlock(start)];
+    for (uint32_t k = 0; k < fe.size(); k ++) {
+        if (fe[k].start > start or start + len > fe[k].start + fe[k].len)
+            continue;
+        // cut extent in two, any of them may be empty
+        extent_t tail;
+        tail.start = start + len;
+        tail.len = fe[k].start + fe[k].len - tail.start;
+        fe[k].len = start - fe[k].start;
+        if (0 == fe[k].len)
+            fe.list.erase(fe.list.begin() + k);
+        if (tail.len > 0)
+            fe.push_back(tail);
+        std::sort (fe.list.begin(), fe.list.end(), compare_by_extent_length_obj);
+        return RFSD_OK;
+    }
+    return RFSD_FAIL;
+}
+
 void
 FsBitmap::rescanAGForFreeExtents(uint32_t ag)
 {
@@ -278,19 +342,75 @@ FsBitmap::reservedBlockCount(uint32_t ag) const
     return this->reservedBlockCount(this->AGBegin(ag), this->AGEnd(ag));
 }
 
+void
+FsBitmap::getReservedIntervals(uint32_t from, uint32_t to,
+                               std::vector<std::pair<uint32_t, uint32_t> > &intervals) const
+{
+    // same areas blockReserved() checks, one by one
+    std::vector<std::pair<uint32_t, uint32_t> > areas;
+    areas.push_back(std::make_pair(0u, 65536/BLOCKSIZE - 1));
+    areas.push_back(std::make_pair(SUPERBLOCK_BLOCK, SUPERBLOCK_BLOCK));
+    areas.push_back(std::make_pair(FIRST_BITMAP_BLOCK, FIRST_BITMAP_BLOCK));
+    const uint32_t journal_start = this->sb->jp_journal_1st_block;
+    // journal has one additional block for its 'header'
+    areas.push_back(std::make_pair(journal_start, journal_start + this->sb->jp_journal_size));
+    for (uint64_t k = (from + BLOCKS_PER_BITMAP - 1) / BLOCKS_PER_BITMAP * BLOCKS_PER_BITMAP;
+         k <= to; k += BLOCKS_PER_BITMAP)
+    {
+        areas.push_back(std::make_pair(static_cast<uint32_t>(k), static_cast<uint32_t>(k)));
+    }
+    std::sort(areas.begin(), areas.end());
+
+    // clip to [from, to] and merge overlapping or adjacent ones
+    intervals.clear();
+    for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it = areas.begin();
+         it != areas.end(); ++ it)
+    {
+        if (it->second < from or it->first > to)
+            continue;
+        const uint32_t first = std::max(it->first, from);
+        const uint32_t last = std::min(it->second, to);
+        if (not intervals.empty() and first <= intervals.back().second + 1)
+            intervals.back().second = std::max(intervals.back().second, last);
+        else
+            intervals.push_back(std::make_pair(first, last));
+    }
+}
+
 uint32_t
 FsBitmap::reservedBlockCount(uint32_t from, uint32_t to) const
 {
-    // TODO: use interval arithmetics to speed up following code
+    std::vector<std::pair<uint32_t, uint32_t> > intervals;
+    this->getReservedIntervals(from, to, intervals);
     uint32_t rc = 0;
-    for (uint32_t k = from; k <= to; k ++) {
-        if (this->blockReserved(k))
-            rc ++;
+    for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it = intervals.begin();
+         it != intervals.end(); ++ it)
+    {
+        rc += it->second - it->first + 1;
     }
 
     return rc;
 }
 
+uint32_t
+FsBitmap::largestUnreservedRun(uint32_t from, uint32_t to) const
+{
+    std::vector<std::pair<uint32_t, uint32_t> > intervals;
+    this->getReservedIntervals(from, to, intervals);
+    // gaps between reserved intervals, including ones at segment ends
+    uint64_t gap_start = from;
+    uint32_t largest = 0;
+    for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it = intervals.begin();
+         it != intervals.end(); ++ it)
+    {
+        largest = std::max<uint32_t>(largest, it->first - gap_start);
+        gap_start = static_cast<uint64_t>(it->second) + 1;
+    }
+    largest = std::max<uint32_t>(largest, static_cast<uint64_t>(to) + 1 - gap_start);
+
+    return largest;
+}
+
 uint32_t
 FsBitmap::AGFreeBlockCount(uint32_t ag) const
 {
@@ -301,3 +421,13 @@ FsBitmap::AGFreeBlockCount(uint32_t ag) const
 
     return free_count;
 }
+
+uint32_t
+FsBitmap::AGLargestFreeExtent(uint32_t ag) const
+{
+    assert1 (ag < this->AGCount());
+    // extent list is kept sorted by length, largest first
+    if (0 == this->ag_free_extents[ag].size())
+        return 0;
+    return this->ag_free_extents[ag][0].len;
+}
@@ -148,3 +148,52 @@ Block::checkInternalNode() const
 
     // TODO: check that all pointers refer blocks inside fs
 }
+
+uint32_t
+Block::childIndexForKey(const key_t &key) const
+{
+    // child k covers [key(k-1), key(k)), so look for first key greater than the one sought
+    const norm_key sought = key.normalized();
+    uint32_t lo = 0;
+    uint32_t hi = this->keyCount();
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (sought < this->key(mid).normalized())
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+uint32_t
+Block::lowerBoundItem(const key_t &key) const
+{
+    const norm_key sought = key.normalized();
+    uint32_t lo = 0;
+    uint32_t hi = this->itemCount();
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (this->itemHeader(mid).key.normalized() < sought)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+uint32_t
+Block::upperBoundItem(const key_t &key) const
+{
+    const norm_key sought = key.normalized();
+    uint32_t lo = 0;
+    uint32_t hi = this->itemCount();
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (sought < this->itemHeader(mid).key.normalized())
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
@@ -0,0 +1,51 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+#include <algorithm>
+
+/// pointers are range-checked in groups of that size, without branches inside a group
+static const uint32_t SCAN_CHUNK = 8;
+
+BlockFilter::BlockFilter()
+{
+    this->setRange(1, 0);
+}
+
+void
+BlockFilter::setRange(uint32_t lo, uint32_t hi)
+{
+    this->empty = (hi < lo);
+    this->lo = this->empty ? 0 : lo;
+    this->span = this->empty ? 0 : hi - lo;
+}
+
+uint32_t
+BlockFilter::nextCandidate(const uint32_t *refs, uint32_t count, uint32_t start) const
+{
+    if (this->empty)
+        return count;
+    uint32_t k = start;
+    while (k < count) {
+        if (k + SCAN_CHUNK <= count) {
+            // range check whole chunk at once. Loop has no branches and fixed trip count,
+            // so compiler is free to vectorize it
+            uint32_t in_range = 0;
+            for (uint32_t j = 0; j < SCAN_CHUNK; j ++)
+                in_range |= (refs[k + j] - this->lo <= this->span);
+            if (not in_range) {
+                k += SCAN_CHUNK;
+                continue;
+            }
+        }
+        const uint32_t chunk_end = std::min(k + SCAN_CHUNK, count);
+        for (; k < chunk_end; k ++)
+            if (this->mayContain(refs[k]))
+                return k;
+    }
+    return count;
+}
@@ -0,0 +1,163 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+#include <algorithm>
+
+static bool
+catalog_entry_less(const ReiserFs::catalog_entry &a, const ReiserFs::catalog_entry &b)
+{
+    return a.obj < b.obj;
+}
+
+static ReiserFs::catalog_entry
+catalog_probe(uint64_t obj)
+{
+    ReiserFs::catalog_entry probe;
+    probe.obj = obj;
+    return probe;
+}
+
+void
+ReiserFs::setObjectCatalog(std::vector<uint64_t> &objs)
+{
+    this->object_catalog.clear();
+    this->object_catalog.reserve(objs.size());
+    for (std::vector<uint64_t>::const_iterator it = objs.begin(); it != objs.end(); ++ it) {
+        catalog_entry entry;
+        entry.obj = *it;
+        entry.block_count = 0;
+        entry.fragment_count = 0;
+        entry.access_time = 0;
+        entry.dirty = true;     // never visited, nothing known
+        entry.settled = false;
+        this->object_catalog.push_back(entry);
+    }
+    std::vector<uint64_t>().swap(objs);
+    this->dirtied_objects.clear();
+    this->object_catalog_ready = true;
+}
+
+void
+ReiserFs::setObjectTimes(std::vector<std::pair<uint64_t, uint32_t> > &times)
+{
+    std::sort(times.begin(), times.end());
+    std::vector<catalog_entry>::iterator entry = this->object_catalog.begin();
+    for (std::vector<std::pair<uint64_t, uint32_t> >::const_iterator it = times.begin();
+         it != times.end(); ++ it)
+    {
+        while (entry != this->object_catalog.end() and entry->obj < it->first)
+            ++ entry;
+        if (entry != this->object_catalog.end() and entry->obj == it->first)
+            entry->access_time = it->second;
+    }
+    std::vector<std::pair<uint64_t, uint32_t> >().swap(times);
+}
+
+void
+ReiserFs::buildObjectCatalog()
+{
+    // items go in key order, so items of each object are adjacent
+    std::vector<uint64_t> objs;
+    std::vector<std::pair<uint64_t, uint32_t> > times;
+    this->cursor.seek(Block::zero_key);
+    do {
+        Block *block_obj = this->journal->readBlock(this->cursor.leaf());
+        block_obj->checkLeafNode();
+        for (uint32_t k = 0; k < block_obj->itemCount(); k ++) {
+            const Block::item_header &ih = block_obj->itemHeader(k);
+            const uint64_t obj = ih.key.normalized().hi;
+            if (objs.empty() or objs.back() != obj)
+                objs.push_back(obj);
+            if (KEY_TYPE_STAT == ih.type()) {
+                Block::stat_info info;
+                block_obj->statItemInfo(ih, info);
+                times.push_back(std::make_pair(obj, std::max(info.atime, info.mtime)));
+            }
+        }
+        this->journal->releaseBlock(block_obj);
+    } while (this->cursor.nextLeaf());
+    this->setObjectCatalog(objs);
+    this->setObjectTimes(times);
+}
+
+uint32_t
+ReiserFs::objectCount()
+{
+    if (not this->object_catalog_ready)
+        this->buildObjectCatalog();
+    return this->object_catalog.size();
+}
+
+const ReiserFs::catalog_entry *
+ReiserFs::findCatalogEntry(const Block::key_t &key) const
+{
+    const uint64_t obj = key.normalized().hi;
+    std::vector<catalog_entry>::const_iterator it = std::lower_bound(
+        this->object_catalog.begin(), this->object_catalog.end(), catalog_probe(obj),
+        catalog_entry_less);
+    if (it == this->object_catalog.end() or it->obj != obj)
+        return NULL;
+    return &*it;
+}
+
+void
+ReiserFs::updateCatalogEntry(uint32_t idx, uint32_t block_count, uint32_t fragment_count,
+                             bool settled)
+{
+    catalog_entry &entry = this->object_catalog[idx];
+    entry.block_count = block_count;
+    entry.fragment_count = fragment_count;
+    entry.settled = settled;
+    entry.dirty = false;
+}
+
+void
+ReiserFs::markAllObjectsDirty()
+{
+    for (std::vector<catalog_entry>::iterator it = this->object_catalog.begin();
+         it != this->object_catalog.end(); ++ it)
+    {
+        it->dirty = true;
+    }
+    this->dirtied_objects.clear();
+}
+
+void
+ReiserFs::markObjectDirty(uint64_t obj)
+{
+    std::vector<catalog_entry>::iterator it = std::lower_bound(
+        this->object_catalog.begin(), this->object_catalog.end(), catalog_probe(obj),
+        catalog_entry_less);
+    if (it != this->object_catalog.end() and it->obj == obj and not it->dirty) {
+        it->dirty = true;
+        this->dirtied_objects.push_back(it - this->object_catalog.begin());
+    }
+}
+
+void
+ReiserFs::takeDirtiedObjects(std::vector<uint32_t> &objs)
+{
+    objs.clear();
+    objs.swap(this->dirtied_objects);
+}
+
+void
+ReiserFs::markLeafObjectsDirty(uint32_t leaf_idx)
+{
+    if (this->object_catalog.empty())
+        return;
+    Block *block_obj = this->journal->readBlock(leaf_idx);
+    uint64_t prev_obj = 0;
+    for (uint32_t k = 0; k < block_obj->itemCount(); k ++) {
+        const uint64_t obj = block_obj->itemHeader(k).key.normalized().hi;
+        if (0 == k or obj != prev_obj)
+            this->markObjectDirty(obj);
+        prev_obj = obj;
+    }
+    this->journal->releaseBlock(block_obj);
+}
@@ -8,14 +8,30 @@
 #include "reiserfs.hpp"
 #include <stdlib.h>
 #include <iostream>
+#include <iomanip>
+#include <algorithm>
 #include <vector>
 #include <set>
+#include <stdexcept>
+#include <pthread.h>
+
+/// planning does not start new thread for less than that many tasks
+static const uint32_t PLAN_MIN_SHARE = 16;
+/// tree-through plans whole layout at once only for that many used blocks, or less
+static const uint32_t GLOBAL_LAYOUT_MAX_BLOCKS = 32 * 1024 * 1024;
+/// leaves are read in chunks of that size while layout is planned
+static const uint32_t GLOBAL_LAYOUT_CHUNK = 1000;
+/// leaves that close to their data are not moved by near-data placement
+static const uint32_t LEAF_NEAR_DISTANCE = 16;
+/// directory defrag packs files up to that size. Larger ones are read sequentially anyway
+static const uint64_t DIRECTORY_SMALL_FILE_SIZE = 1024 * 1024;
 
 
 Defrag::Defrag(ReiserFs &fs) : fs(fs)
 {
     this->desired_extent_length = 2048;
-    this->previous_obj_count = 0;
+    this->metadata_placement = METADATA_INTERLEAVED;
+    this->worklist_valid = false;
 }
 
 int
@@ -40,6 +56,13 @@ Defrag::treeThroughDefrag(uint32_t batch_size)
         return RFSD_FAIL;
     }
 
+    // whole layout is planned at once, if it fits in memory. Otherwise, or if there is not
+    // enough free space to carry it out, batches are used
+    if (RFSD_OK == this->treeThroughGlobalLayout())
+        return RFSD_OK;
+    if (ReiserFs::userAskedForTermination())
+        return RFSD_FAIL;
+
     // pack internal nodes first
     do {
         Progress progress_internal_nodes;
@@ -56,10 +79,11 @@ Defrag::treeThroughDefrag(uint32_t batch_size)
         {
             uint32_t int_node_idx = it->idx;
             if (int_node_idx !=  free_idx)
-                movemap[int_node_idx] = free_idx;
+                movemap.insert(int_node_idx, free_idx);
             free_idx = this->nextTargetBlock(free_idx);
             assert1 (free_idx != 0);
         }
+        movemap.normalize();
         if (movemap.size() == 0)    // don't need to cleanup if all internal nodes in their places
             break;                  // already
         this->fs.cleanupRegionMoveDataDown(old_free_idx, free_idx - 1);
@@ -74,7 +98,7 @@ Defrag::treeThroughDefrag(uint32_t batch_size)
         {
             uint32_t int_node_idx = it->idx;
             if (int_node_idx !=  free_idx)
-                movemap[int_node_idx] = free_idx;
+                movemap.insert(int_node_idx, free_idx);
             free_idx = this->nextTargetBlock(free_idx);
             assert1 (free_idx != 0);
         }
@@ -82,27 +106,34 @@ Defrag::treeThroughDefrag(uint32_t batch_size)
         progress_internal_nodes.show100();
     } while (0);
 
-    // estimate work amount
-    start_key = Block::zero_key;
+    // estimate work amount. Every leaf gets processed once, so it's just leaf count
     uint32_t work_amount = 0;
-    Progress estimation;
-    estimation.enableUnknownMode(true, 1000);
-    estimation.setName("[estimate]");
-    while (1) {
-        this->fs.enumerateLeaves(start_key, batch_size, leaves, last_key);
-        if (leaves.size() == 0)     // nothing left
-            break;
-        start_key = last_key;
-        work_amount += leaves.size();
-        estimation.update(work_amount);
-        if (ReiserFs::userAskedForTermination()) {
-            estimation.abort();
-            return RFSD_FAIL;
+    do {
+        std::vector<ReiserFs::tree_element> tree;
+        this->fs.enumerateTree(tree);
+        for (std::vector<ReiserFs::tree_element>::const_iterator it = tree.begin();
+             it != tree.end(); ++ it)
+        {
+            if (BLOCKTYPE_LEAF == it->type)
+                work_amount ++;
         }
+    } while (0);
+
+    // with zone placement leaves get area of their own right after internal nodes, and data
+    // goes after it. Otherwise leaf precedes its data, which is near-data placement as well
+    uint32_t leaf_free_idx = free_idx;
+    uint32_t *leaf_cursor = NULL;
+    if (METADATA_ZONE == this->metadata_placement) {
+        leaf_cursor = &leaf_free_idx;
+        free_idx = this->skipTargetBlocks(free_idx, work_amount);
     }
 
-    // process leaves and unformatted blocks
+    // process leaves and unformatted blocks. Every batch is enumerated once, and its blocks
+    // go straight to their places. Blocks in the way are evicted to the far end of
+    // the disk, where packing front won't reach them again before their own turn. They are
+    // moved once more then, as batch doesn't know their places in advance
     start_key = Block::zero_key;
+    uint32_t evict_idx = this->fs.sizeInBlocks();
     Progress progress;
     progress.setMaxValue(work_amount);
     progress.setName("[treethrough]");
@@ -112,19 +143,29 @@ Defrag::treeThroughDefrag(uint32_t batch_size)
         if (leaves.size() == 0)     // nothing left
             break;
         uint32_t old_free_idx = free_idx;
-        this->createMovemapFromListOfLeaves(movemap, leaves, free_idx);
-        if (movemap.size() == 0) {
-            start_key = last_key;
-            continue;
+        uint32_t old_leaf_free_idx = leaf_free_idx;
+        this->createMovemapFromListOfLeaves(movemap, leaves, free_idx, leaf_cursor);
+        if (movemap.size() > 0) {
+            if (RFSD_OK == this->evictBlocksInTheWay(movemap, free_idx - 1, evict_idx)) {
+                if (RFSD_OK != this->fs.movePermutation(movemap)) {
+                    progress.abort();
+                    return RFSD_FAIL;
+                }
+            } else {
+                // free space is too close to packed area. Move whole region down, then
+                // enumerate batch again, as its blocks may be moved too
+                if (NULL != leaf_cursor)
+                    this->fs.cleanupRegionMoveDataDown(old_leaf_free_idx, leaf_free_idx - 1);
+                this->fs.cleanupRegionMoveDataDown(old_free_idx, free_idx - 1);
+                free_idx = old_free_idx;
+                leaf_free_idx = old_leaf_free_idx;
+                this->fs.enumerateLeaves(start_key, batch_size, leaves, last_key);
+                if (leaves.size() == 0)     // nothing left
+                    break;
+                this->createMovemapFromListOfLeaves(movemap, leaves, free_idx, leaf_cursor);
+                this->fs.moveBlocks(movemap);
+            }
         }
-        this->fs.cleanupRegionMoveDataDown(old_free_idx, free_idx - 1);
-
-        free_idx = old_free_idx;
-        this->fs.enumerateLeaves(start_key, batch_size, leaves, last_key);
-        if (leaves.size() == 0)     // nothing left
-            break;
-        this->createMovemapFromListOfLeaves(movemap, leaves, free_idx);
-        this->fs.moveBlocks(movemap);
         start_key = last_key;
         if (ReiserFs::userAskedForTermination()) {
             progress.abort();
@@ -137,17 +178,240 @@ Defrag::treeThroughDefrag(uint32_t batch_size)
     return RFSD_OK;
 }
 
+int
+Defrag::treeThroughGlobalLayout()
+{
+    const uint32_t used_count = this->fs.sizeInBlocks() - this->fs.freeBlockCount();
+    if (used_count > GLOBAL_LAYOUT_MAX_BLOCKS)
+        return RFSD_FAIL;
+
+    std::vector<ReiserFs::tree_element> tree;
+    this->fs.enumerateTree(tree);
+    std::vector<uint32_t> leaves;
+    for (std::vector<ReiserFs::tree_element>::const_iterator it = tree.begin();
+         it != tree.end(); ++ it)
+    {
+        if (BLOCKTYPE_LEAF == it->type)
+            leaves.push_back(it->idx);
+    }
+
+    // same layout batches produce: internal nodes first, then leaves interleaved with data,
+    // or leaves and then data for zone placement, everything in key order
+    movemap_t movemap;
+    uint32_t free_idx = this->nextTargetBlock(0);
+    assert1 (free_idx != 0);
+    for (std::vector<ReiserFs::tree_element>::const_iterator it = tree.begin();
+         it != tree.end(); ++ it)
+    {
+        if (BLOCKTYPE_INTERNAL != it->type)
+            continue;
+        if (it->idx != free_idx)
+            movemap.insert(it->idx, free_idx);
+        free_idx = this->nextTargetBlock(free_idx);
+        assert1 (free_idx != 0);
+    }
+    movemap.normalize();
+    std::vector<ReiserFs::tree_element>().swap(tree);    // not needed anymore
+    uint32_t leaf_free_idx = free_idx;
+    uint32_t *leaf_cursor = NULL;
+    if (METADATA_ZONE == this->metadata_placement) {
+        leaf_cursor = &leaf_free_idx;
+        free_idx = this->skipTargetBlocks(free_idx, leaves.size());
+    }
+
+    Progress progress(leaves.size());
+    progress.setName("[layout]");
+    movemap_t leaf_movemap;
+    std::vector<uint32_t> chunk;
+    for (uint32_t k = 0; k < leaves.size(); k += GLOBAL_LAYOUT_CHUNK) {
+        chunk.assign(leaves.begin() + k,
+                     leaves.begin() + std::min<uint32_t>(k + GLOBAL_LAYOUT_CHUNK, leaves.size()));
+        this->createMovemapFromListOfLeaves(leaf_movemap, chunk, free_idx, leaf_cursor);
+        this->mergeMovemap(movemap, leaf_movemap);
+        progress.inc(chunk.size());
+        if (ReiserFs::userAskedForTermination()) {
+            progress.abort();
+            return RFSD_FAIL;
+        }
+    }
+    progress.show100();
+    if (movemap.size() == 0)
+        return RFSD_OK;     // everything is in place already
+
+    // blocks outside of tree, if any, make room too
+    uint32_t evict_idx = this->fs.sizeInBlocks();
+    if (RFSD_OK != this->evictBlocksInTheWay(movemap, free_idx - 1, evict_idx))
+        return RFSD_FAIL;
+
+    // moves are scheduled in conflict-free waves, so most blocks are moved once. Free space
+    // is only needed to break cycles and overly long chains
+    std::cout << "layout planned, " << movemap.size() << " block(s) to move" << std::endl;
+    return this->fs.movePermutation(movemap);
+}
+
+int
+Defrag::metadataDefrag()
+{
+    std::vector<ReiserFs::tree_element> tree;
+    this->fs.enumerateTree(tree);
+
+    // internal nodes first, then leaves, both in key order
+    std::vector<uint32_t> order;
+    order.reserve(tree.size());
+    for (std::vector<ReiserFs::tree_element>::const_iterator it = tree.begin();
+         it != tree.end(); ++ it)
+    {
+        if (BLOCKTYPE_INTERNAL == it->type)
+            order.push_back(it->idx);
+    }
+    uint32_t internal_count = order.size();
+    for (std::vector<ReiserFs::tree_element>::const_iterator it = tree.begin();
+         it != tree.end(); ++ it)
+    {
+        if (BLOCKTYPE_LEAF == it->type)
+            order.push_back(it->idx);
+    }
+    std::vector<ReiserFs::tree_element>().swap(tree);    // not needed anymore
+
+    std::vector<uint32_t> nodes(order);
+    std::sort(nodes.begin(), nodes.end());
+    std::vector<uint32_t> targets;
+    if (RFSD_OK != this->findMetadataRegion(nodes, order.size(), targets)) {
+        std::cout << "error: not enough room for " << order.size() << " tree nodes" << std::endl;
+        return RFSD_FAIL;
+    }
+    std::cout << "metadata region: " << targets.front() << "-" << targets.back() << ", "
+        << internal_count << " internal nodes, " << order.size() - internal_count
+        << " leaves" << std::endl;
+
+    // every occupied target holds a tree node, which moves too, so map is a permutation
+    // of tree nodes over region and free blocks
+    movemap_t movemap;
+    for (uint32_t k = 0; k < order.size(); k ++) {
+        if (order[k] != targets[k])
+            movemap.insert(order[k], targets[k]);
+    }
+    movemap.normalize();
+    if (movemap.size() == 0) {
+        std::cout << "tree nodes are in place already" << std::endl;
+        return RFSD_OK;
+    }
+    std::cout << movemap.size() << " tree node(s) to move" << std::endl;
+    return this->fs.movePermutation(movemap);
+}
+
+int
+Defrag::findMetadataRegion(const std::vector<uint32_t> &nodes, uint32_t count,
+                           std::vector<uint32_t> &targets)
+{
+    targets.clear();
+    if (0 == count)
+        return RFSD_FAIL;
+
+    // slide window of \a count suitable blocks over the fs, looking for the narrowest one.
+    // Contiguous run, if there is any, is the narrowest
+    const uint32_t fs_size = this->fs.sizeInBlocks();
+    std::vector<uint32_t> window(count);     // ring buffer of last suitable blocks
+    std::vector<bool> window_node(count);   // whether they are tree nodes
+    uint32_t seen = 0;
+    uint32_t node_count = 0;                // tree nodes in window
+    uint32_t best_start = 0;
+    uint32_t best_span = fs_size;
+    uint32_t best_node_count = 0;
+    for (uint32_t idx = 0; idx < fs_size; idx ++) {
+        if (this->fs.blockReserved(idx))
+            continue;
+        const bool is_node = this->fs.blockUsed(idx);
+        if (is_node and not std::binary_search(nodes.begin(), nodes.end(), idx))
+            continue;
+        if (seen >= count and window_node[seen % count])
+            node_count --;
+        window[seen % count] = idx;
+        window_node[seen % count] = is_node;
+        if (is_node)
+            node_count ++;
+        seen ++;
+        if (seen < count)
+            continue;
+        // of equally narrow windows, one with more nodes in place already needs less moves
+        const uint32_t first = window[seen % count];
+        if (idx - first < best_span
+            or (idx - first == best_span and node_count > best_node_count))
+        {
+            best_span = idx - first;
+            best_start = first;
+            best_node_count = node_count;
+        }
+    }
+    if (seen < count)
+        return RFSD_FAIL;
+
+    for (uint32_t idx = best_start; targets.size() < count; idx ++) {
+        if (this->fs.blockReserved(idx))
+            continue;
+        if (this->fs.blockUsed(idx) and not std::binary_search(nodes.begin(), nodes.end(), idx))
+            continue;
+        targets.push_back(idx);
+    }
+    if (best_span + 1 > count) {
+        // there may be reserved blocks among them too, but they can't be avoided anyway
+        std::cout << "warning: no contiguous room for tree nodes, " << best_span + 1 - count
+            << " other block(s) will be interleaved" << std::endl;
+    }
+    return RFSD_OK;
+}
+
+int
+Defrag::evictBlocksInTheWay(movemap_t &movemap, uint32_t region_end, uint32_t &evict_idx)
+{
+    // occupied targets whose blocks are not moved by the map itself
+    std::vector<uint32_t> in_the_way;
+    movemap.normalize();
+    for (movemap_t::const_iterator it = movemap.begin(); it != movemap.end(); ++ it) {
+        if (this->fs.blockUsed(it->second) and 0 == movemap.count(it->second))
+            in_the_way.push_back(it->second);
+    }
+    std::sort(in_the_way.begin(), in_the_way.end());
+
+    // fill free blocks from disk end downwards, in reverse, so evicted blocks keep their
+    // relative order. When eviction area meets region, start from disk end once again, as
+    // some blocks there could be vacated since
+    movemap_t evictions;
+    for (uint32_t attempt = 0; attempt < 2; attempt ++) {
+        evictions.clear();
+        uint32_t idx = evict_idx;
+        std::vector<uint32_t>::const_reverse_iterator it = in_the_way.rbegin();
+        while (it != in_the_way.rend()) {
+            do { idx --; } while (idx > region_end
+                                  and (this->fs.blockUsed(idx) or this->fs.blockReserved(idx)));
+            if (idx <= region_end)
+                break;
+            evictions.insert(*it, idx);
+            ++ it;
+        }
+        if (it == in_the_way.rend()) {
+            evict_idx = idx;
+            evictions.normalize();
+            this->mergeMovemap(movemap, evictions);
+            return RFSD_OK;
+        }
+        evict_idx = this->fs.sizeInBlocks();
+    }
+    return RFSD_FAIL;
+}
+
 void
 Defrag::createMovemapFromListOfLeaves(movemap_t &movemap, const std::vector<uint32_t> &leaves,
-                                      uint32_t &free_idx)
+                                      uint32_t &free_idx, uint32_t *leaf_free_idx)
 {
+    uint32_t *leaf_target = (NULL != leaf_free_idx) ? leaf_free_idx : &free_idx;
     movemap.clear();
     for (std::vector<uint32_t>::const_iterator it = leaves.begin(); it != leaves.end(); ++ it) {
         uint32_t leaf_idx = *it;
-        if (leaf_idx != free_idx)
-            movemap[leaf_idx] = free_idx;
-        free_idx = this->nextTargetBlock(free_idx);
-        assert1 (free_idx != 0);
+        if (leaf_idx != *leaf_target)
+            movemap.insert(leaf_idx, *leaf_target);
+        *leaf_target = this->nextTargetBlock(*leaf_target);
+        assert1 (*leaf_target != 0);
         Block *block_obj = this->fs.readBlock(leaf_idx);
         block_obj->checkLeafNode();
         for (uint32_t item_idx = 0; item_idx < block_obj->itemCount(); item_idx ++) {
@@ -159,13 +423,14 @@ Defrag::createMovemapFromListOfLeaves(movemap_t &movemap, const std::vector<uint
                 if (0 == child_idx)     // sparse file
                     continue;
                 if (child_idx != free_idx)
-                    movemap[child_idx] = free_idx;
+                    movemap.insert(child_idx, free_idx);
                 free_idx = this->nextTargetBlock(free_idx);
                 assert1 (free_idx != 0);
             }
         }
         this->fs.releaseBlock(block_obj);
     }
+    movemap.normalize();
 }
 
 uint32_t
@@ -178,6 +443,17 @@ Defrag::nextTargetBlock(uint32_t previous)
     else return 0; // no one found
 }
 
+uint32_t
+Defrag::skipTargetBlocks(uint32_t first, uint32_t count)
+{
+    uint32_t idx = first;
+    for (uint32_t k = 0; k < count; k ++) {
+        idx = this->nextTargetBlock(idx);
+        assert1 (idx != 0);
+    }
+    return idx;
+}
+
 bool
 Defrag::objectIsSealed(const Block::key_t &k) const
 {
@@ -186,17 +462,18 @@ Defrag::objectIsSealed(const Block::key_t &k) const
 }
 
 int
-Defrag::prepareDefragTask(std::vector<uint32_t> &blocks, movemap_t &movemap)
+Defrag::planDefragTask(const std::vector<uint32_t> &blocks, movemap_t &movemap,
+                       bool own_ag_only)
 {
     movemap.clear();    // may not be empty, need to clear
     if (blocks.size() == 0) // zero-length file is defragmented already
-        return RFSD_OK;
+        return PLAN_IN_ORDER;
 
     std::vector<FsBitmap::extent_t> extents;
     this->convertBlocksToExtents(blocks, extents);
 
     if (extents.size() <= 1)    // no need to defragment file with only one extent
-        return RFSD_OK;
+        return PLAN_IN_ORDER;
 
     // get ideal extent distribution
     std::vector<uint32_t> lengths;
@@ -218,6 +495,7 @@ Defrag::prepareDefragTask(std::vector<uint32_t> &blocks, movemap_t &movemap)
     uint32_t c_end = 0;
 
     uint32_t ag = this->fs.bitmap->AGOfBlock(blocks[0]);
+    const uint32_t own_ag = ag;
 
     bool some_extents_failed = false;
     bool some_extents_succeeded = false;
@@ -229,11 +507,23 @@ Defrag::prepareDefragTask(std::vector<uint32_t> &blocks, movemap_t &movemap)
             // defragment if [c_begin, c_end-1] ⊈ [b_begin, b_end-1]
             if (b_begin > c_begin || c_end > b_end) {
                 const uint32_t c_len = c_end - c_begin;
-                if (RFSD_OK == this->fs.bitmap->allocateFreeExtent(ag, c_len, free_blocks)) {
+                int res;
+                if (own_ag_only)
+                    res = this->fs.bitmap->allocateFreeExtentInAG(own_ag, c_len, free_blocks);
+                else
+                    res = this->fs.bitmap->allocateFreeExtent(ag, c_len, free_blocks);
+                if (RFSD_OK == res) {
                     for (uint32_t k = c_begin; k < c_end; k ++) {
-                        movemap[blocks[k]] = free_blocks[k - c_begin];
+                        movemap.insert(blocks[k], free_blocks[k - c_begin]);
                     }
                     some_extents_succeeded = true;
+                } else if (own_ag_only) {
+                    // task needs other AGs. Give back what was taken, sequential planning
+                    // will do the task again
+                    movemap.normalize();
+                    this->releaseMovemapTargets(movemap);
+                    movemap.clear();
+                    return PLAN_DEFERRED;
                 } else {
                     some_extents_failed = true;
                 }
@@ -246,23 +536,139 @@ Defrag::prepareDefragTask(std::vector<uint32_t> &blocks, movemap_t &movemap)
             b_cur ++;
         }
     }
+    movemap.normalize();
 
     if (!some_extents_touched)      // all extents already defragmented
-        return RFSD_OK;
+        return PLAN_IN_ORDER;
+    if (some_extents_succeeded)
+        return some_extents_failed ? PLAN_PARTIAL : PLAN_SUCCESS;
+    return PLAN_FAILURE;
+}
+
+void
+Defrag::countPlanOutcome(int outcome)
+{
+    switch (outcome) {
+    case PLAN_SUCCESS:
+        this->defrag_statistics.success_count ++;
+        break;
+    case PLAN_PARTIAL:
+        this->defrag_statistics.partial_success_count ++;
+        break;
+    case PLAN_FAILURE:
+        this->defrag_statistics.failure_count ++;
+        break;
+    default:
+        return;     // nothing was attempted
+    }
+    this->defrag_statistics.total_count ++;
+}
 
-    if (some_extents_succeeded) {
-        if (some_extents_failed)
-            this->defrag_statistics.partial_success_count ++;
-        else
-            this->defrag_statistics.success_count ++;
+void
+Defrag::getMovemapTargetExtents(const movemap_t &movemap,
+                                std::vector<FsBitmap::extent_t> &extents)
+{
+    std::vector<uint32_t> targets;
+    targets.reserve(movemap.size());
+    for (movemap_t::const_iterator it = movemap.begin(); it != movemap.end(); ++ it)
+        targets.push_back(it->second);
+    std::sort(targets.begin(), targets.end());
 
-        this->defrag_statistics.total_count ++;
-        return RFSD_OK;
+    // contiguous runs, but never across AG boundary
+    extents.clear();
+    std::vector<uint32_t>::const_iterator it = targets.begin();
+    while (it != targets.end()) {
+        const uint32_t ag = this->fs.bitmap->AGOfBlock(*it);
+        std::vector<uint32_t>::const_iterator run_end = it + 1;
+        while (run_end != targets.end() and *run_end == *(run_end - 1) + 1
+               and this->fs.bitmap->AGOfBlock(*run_end) == ag)
+        {
+            ++ run_end;
+        }
+        FsBitmap::extent_t ex;
+        ex.start = *it;
+        ex.len = run_end - it;
+        extents.push_back(ex);
+        it = run_end;
     }
+}
 
-    this->defrag_statistics.failure_count ++;
-    this->defrag_statistics.total_count ++;
-    return RFSD_FAIL;
+void
+Defrag::releaseMovemapTargets(const movemap_t &movemap)
+{
+    std::vector<FsBitmap::extent_t> targets;
+    this->getMovemapTargetExtents(movemap, targets);
+    for (std::vector<FsBitmap::extent_t>::const_iterator it = targets.begin();
+         it != targets.end(); ++ it)
+    {
+        this->fs.bitmap->releaseExtent(it->start, it->len);
+    }
+}
+
+/// tasks whose own AGs fall to one planning thread
+struct plan_worker {
+    Defrag *defrag;
+    std::vector<Defrag::plan_unit *> units;
+    pthread_t thread;
+    bool started;
+    std::string error;
+};
+
+void *
+Defrag::planWorker(void *arg)
+{
+    plan_worker *worker = static_cast<plan_worker *>(arg);
+    try {
+        for (std::vector<plan_unit *>::iterator it = worker->units.begin();
+             it != worker->units.end(); ++ it)
+        {
+            (*it)->outcome = worker->defrag->planDefragTask((*it)->blocks, (*it)->movemap, true);
+        }
+    } catch (std::logic_error &e) {
+        worker->error = e.what();
+    }
+    return NULL;
+}
+
+void
+Defrag::planDefragTasks(std::vector<plan_unit> &units)
+{
+    // every AG is owned by exactly one thread, which plans tasks starting in that AG in their
+    // original order. Tasks that need to spill over to other AGs are deferred and planned
+    // afterwards, in order, on this thread. Result doesn't depend on thread count
+    const uint32_t worker_count = std::max(1u, std::min<uint32_t>(this->fs.threadCount(),
+                                                                  units.size() / PLAN_MIN_SHARE));
+    std::vector<plan_worker> workers(worker_count);
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        workers[k].defrag = this;
+        workers[k].started = false;
+    }
+    for (std::vector<plan_unit>::iterator it = units.begin(); it != units.end(); ++ it) {
+        const uint32_t ag = it->blocks.empty() ? 0 : this->fs.bitmap->AGOfBlock(it->blocks[0]);
+        workers[ag % worker_count].units.push_back(&*it);
+    }
+    for (uint32_t k = 1; k < worker_count; k ++) {
+        workers[k].started =
+            (0 == pthread_create(&workers[k].thread, NULL, Defrag::planWorker, &workers[k]));
+    }
+    // if thread can't be created, plan its part here
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (not workers[k].started)
+            Defrag::planWorker(&workers[k]);
+    }
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (workers[k].started)
+            pthread_join(workers[k].thread, NULL);
+    }
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (not workers[k].error.empty())
+            throw std::logic_error(workers[k].error);
+    }
+
+    for (std::vector<plan_unit>::iterator it = units.begin(); it != units.end(); ++ it) {
+        if (PLAN_DEFERRED == it->outcome)
+            it->outcome = this->planDefragTask(it->blocks, it->movemap, false);
+    }
 }
 
 uint32_t
@@ -329,18 +735,12 @@ Defrag::convertBlocksToExtents(const std::vector<uint32_t> &blocks,
 int
 Defrag::mergeMovemap(movemap_t &dest, const movemap_t &src)
 {
-    const uint32_t prev_dest_size = dest.size();
-
-    dest.insert(src.begin(), src.end());
-    // if new dest size equals to sum of previous dest and src sizes, there was
-    if (dest.size() == prev_dest_size + src.size())     // no intersections.
-        return RFSD_OK;
-    else
-        return RFSD_FAIL;   // Otherwise they was. And it's bad.
+    // fails if src and dest have common source blocks
+    return dest.merge(src);
 }
 
 int
-Defrag::moveObjectsUp(const std::vector<Block::key_t> &objs)
+Defrag::moveObjectsUp(const std::vector<Block::key_t> &objs, bool dry_run)
 {
     uint32_t next_ag = 0;
     uint32_t free_blocks_count = 0;
@@ -352,28 +752,10 @@ Defrag::moveObjectsUp(const std::vector<Block::key_t> &objs)
     movemap_t movemap;
 
     std::cout << "moving " << objs.size() << " file(s) up" << std::endl;
-    Progress estimation;
-    estimation.setName("[estimate]");
-    estimation.enableUnknownMode(true, 100);
-    for (std::vector<Block::key_t>::const_iterator it = objs.begin(); it != objs.end(); ++ it) {
-        uint32_t next_offset, start_offset = 0;
-        Block::key_t next_key, start_key = *it;
-        blocklist_t file_blocks;
-
-        do {
-            fs.getIndirectBlocksOfObject(start_key, start_offset, next_key, next_offset,
-                                         file_blocks, limit);
-            work_amount += file_blocks.size();
-            start_key = next_key;
-            start_offset = next_offset;
-        } while (it->sameObjectAs(next_key));
-
-        estimation.update(work_amount);
-        if (ReiserFs::userAskedForTermination()) {
-            estimation.abort();
-            return RFSD_FAIL;
-        }
-    }
+    if (RFSD_OK != this->countBlocksOfObjects(objs, work_amount))
+        return RFSD_FAIL;
+    if (dry_run)
+        return this->showPackingCost(work_amount, false);
 
     Progress moveup_progress(work_amount);
     moveup_progress.setName("[moving files up]");
@@ -399,7 +781,16 @@ Defrag::moveObjectsUp(const std::vector<Block::key_t> &objs)
                     return RFSD_FAIL;
                 }
 
-                fs.sweepOutAG(next_ag);
+                const uint32_t free_elsewhere = this->totalFreeBlockCount()
+                                                - fs.bitmap->AGFreeBlockCount(next_ag);
+                // there may be no room for blocks to be evacuated, then don't even try
+                if (fs.bitmap->AGUsedBlockCount(next_ag) > free_elsewhere
+                    or RFSD_OK != fs.sweepOutAG(next_ag))
+                {
+                    moveup_progress.abort();
+                    std::cout << "warning: insufficient free space for file packing" << std::endl;
+                    return RFSD_FAIL;
+                }
                 fs.sealAG(next_ag);
                 free_blocks_count += fs.bitmap->AGFreeBlockCount(next_ag);
                 next_ag ++;
@@ -421,13 +812,13 @@ Defrag::moveObjectsUp(const std::vector<Block::key_t> &objs)
             for (uint32_t k = 0; k < file_blocks.size(); k ++) {
                 free_idx = fs.findFreeBlockAfter(free_idx);
                 assert1(free_idx != 0);
-                movemap[file_blocks[k]] = free_idx;
+                movemap.insert(file_blocks[k], free_idx);
                 blocks_moved ++;
                 free_blocks_count --;
             }
             moveup_progress.inc(progress_update);
 
-            if (movemap.size() > 8000) {
+            if (movemap.entryCount() > 8000) {
                 fs.moveBlocks(movemap);
                 movemap.clear();
                 if (ReiserFs::userAskedForTermination()) {
@@ -449,39 +840,403 @@ Defrag::moveObjectsUp(const std::vector<Block::key_t> &objs)
 }
 
 int
-Defrag::freeOneAG()
+Defrag::moveObjectsDown(const std::vector<Block::key_t> &objs, bool dry_run)
 {
-    // select most freespace fragmented AG to sweep out.
-    // Additional random which gives a chance to low fragmented AG to be selected.
-    // It should be limited though, in order to heavily fragmented AG to cleared first
-    uint32_t max_score = 0;
-    uint32_t selected_ag = ~0u;
+    uint32_t next_ag = fs.bitmap->AGCount() - 1;
+    uint32_t free_blocks_count = 0;
+    uint32_t blocks_moved = 0;
+    uint32_t files_moved = 0;
+    uint32_t free_idx = fs.sizeInBlocks();
+    uint32_t work_amount = 0;
+    movemap_t movemap;
 
-    for (uint32_t ag = 0; ag < fs.bitmap->AGCount(); ag ++) {
-        if (!fs.AGSealed(ag)) {
-            selected_ag = ag;
-            break;
+    std::cout << "moving " << objs.size() << " file(s) down" << std::endl;
+    if (RFSD_OK != this->countBlocksOfObjects(objs, work_amount))
+        return RFSD_FAIL;
+    if (dry_run)
+        return this->showPackingCost(work_amount, true);
+
+    // AGs are swept from the last one, same way moveObjectsUp does from the first. Every
+    // file is put right below previous one, so they are walked in reverse to end up in
+    // key order
+    Progress movedown_progress(work_amount);
+    movedown_progress.setName("[moving files down]");
+    movedown_progress.update(0);
+    for (std::vector<Block::key_t>::const_reverse_iterator it = objs.rbegin();
+         it != objs.rend(); ++ it)
+    {
+        blocklist_t file_blocks;
+        this->getAllBlocksOfObject(*it, file_blocks);
+        const uint32_t progress_update = file_blocks.size();
+        this->filterOutSparseBlocks(file_blocks);
+        while (file_blocks.size() > free_blocks_count) {
+            // no space for current file, let's free some. But before we must flush movemap
+            fs.moveBlocks(movemap);
+            movemap.clear();
+            if (ReiserFs::userAskedForTermination()) {
+                movedown_progress.abort();
+                return RFSD_FAIL;
+            }
+
+            const uint32_t free_elsewhere = this->totalFreeBlockCount()
+                                            - fs.bitmap->AGFreeBlockCount(next_ag);
+            if (fs.AGSealed(next_ag) or fs.bitmap->AGUsedBlockCount(next_ag) > free_elsewhere
+                or RFSD_OK != fs.sweepOutAG(next_ag))
+            {
+                movedown_progress.abort();
+                std::cout << "warning: insufficient free space for file packing" << std::endl;
+                return RFSD_FAIL;
+            }
+            fs.sealAG(next_ag);
+            free_blocks_count += fs.bitmap->AGFreeBlockCount(next_ag);
+            if (0 == next_ag) {
+                movedown_progress.abort();
+                std::cout << "warning: insufficient free space for file packing" << std::endl;
+                return RFSD_FAIL;
+            }
+            next_ag --;
+            // need get blocks again as sweep could change their positions
+            this->getAllBlocksOfObject(*it, file_blocks);
+            this->filterOutSparseBlocks(file_blocks);
+        }
+
+        // take free blocks downwards, then fill them upwards, so file stays in order
+        std::vector<uint32_t> targets(file_blocks.size());
+        for (uint32_t k = file_blocks.size(); k > 0; k --) {
+            free_idx = fs.findFreeBlockBefore(free_idx);
+            assert1 (free_idx != 0);
+            targets[k - 1] = free_idx;
+        }
+        for (uint32_t k = 0; k < file_blocks.size(); k ++)
+            movemap.insert(file_blocks[k], targets[k]);
+        blocks_moved += file_blocks.size();
+        free_blocks_count -= file_blocks.size();
+        movedown_progress.inc(progress_update);
+
+        if (movemap.entryCount() > 8000) {
+            fs.moveBlocks(movemap);
+            movemap.clear();
+            if (ReiserFs::userAskedForTermination()) {
+                movedown_progress.abort();
+                return RFSD_FAIL;
+            }
         }
+        if (file_blocks.size() > 0) files_moved ++;
     }
 
-    if (~0u == selected_ag)      // every AG sealed, can not do anything with it. Give up.
-        return RFSD_FAIL;
+    // move remaining
+    fs.moveBlocks(movemap);
+    movemap.clear();
+    movedown_progress.show100();
+    std::cout << blocks_moved << " block(s) of " << files_moved << " file(s) moved down"
+        << std::endl;
+    return RFSD_OK;
+}
+
+void
+Defrag::getAllBlocksOfObject(const Block::key_t &obj, blocklist_t &blocks)
+{
+    uint32_t next_offset, start_offset = 0;
+    Block::key_t next_key, start_key = obj;
+    blocklist_t part_blocks;
 
+    blocks.clear();
+    do {
+        fs.getIndirectBlocksOfObject(start_key, start_offset, next_key, next_offset,
+                                     part_blocks, 15*2048);
+        blocks.insert(blocks.end(), part_blocks.begin(), part_blocks.end());
+        start_key = next_key;
+        start_offset = next_offset;
+    } while (obj.sameObjectAs(next_key));
+}
+
+int
+Defrag::countBlocksOfObjects(const std::vector<Block::key_t> &objs, uint32_t &work_amount)
+{
+    uint32_t limit = 15*2048;   // limit block count for getIndirectBlocksOfObject
+    Progress estimation;
+    estimation.setName("[estimate]");
+    estimation.enableUnknownMode(true, 100);
+    work_amount = 0;
+    for (std::vector<Block::key_t>::const_iterator it = objs.begin(); it != objs.end(); ++ it) {
+        uint32_t next_offset, start_offset = 0;
+        Block::key_t next_key, start_key = *it;
+        blocklist_t file_blocks;
+
+        do {
+            fs.getIndirectBlocksOfObject(start_key, start_offset, next_key, next_offset,
+                                         file_blocks, limit);
+            work_amount += file_blocks.size();
+            start_key = next_key;
+            start_offset = next_offset;
+        } while (it->sameObjectAs(next_key));
+
+        estimation.update(work_amount);
+        if (ReiserFs::userAskedForTermination()) {
+            estimation.abort();
+            return RFSD_FAIL;
+        }
+    }
+    return RFSD_OK;
+}
+
+int
+Defrag::showPackingCost(uint32_t work_amount, bool at_end)
+{
+    std::cout << std::endl;
+    // AGs are swept in order, starting from the first one, or from the last one, until there
+    // is enough room for all files. Predict how much it will cost.
+    const uint32_t ag_count = fs.bitmap->AGCount();
+    uint32_t free_total = this->totalFreeBlockCount();
+    uint32_t room = 0;
+    uint64_t total_io = work_amount;
+    std::cout << "moving files " << (at_end ? "down" : "up") << " requires " << work_amount
+        << " block(s)" << std::endl;
+    std::cout << "      ag     blocks     leaves" << std::endl;
+    for (uint32_t k = 0; k < ag_count && room < work_amount; k ++) {
+        const uint32_t ag = at_end ? ag_count - 1 - k : k;
+        sweep_cost cost;
+        const uint32_t ag_free = fs.bitmap->AGFreeBlockCount(ag);
+        free_total -= ag_free;
+        this->estimateSweepCost(ag, free_total, cost);
+        if (cost.blocks_to_move > free_total) {
+            std::cout << "warning: insufficient free space for file packing" << std::endl;
+            return RFSD_FAIL;
+        }
+        // cost estimation omits leaves for useless sweeps, so count them here
+        if (SWEEP_SCORE_INFEASIBLE == cost.score)
+            cost.leaves_to_rewrite = this->AGLeafCount(ag);
+        std::cout << std::setw(8) << ag << std::setw(11) << cost.blocks_to_move
+            << std::setw(11) << cost.leaves_to_rewrite << std::endl;
+        total_io += cost.blocks_to_move + cost.leaves_to_rewrite;
+        free_total -= cost.blocks_to_move;
+        room += ag_free + cost.blocks_to_move;
+    }
+    std::cout << "predicted I/O: " << total_io << " block(s) moved or rewritten" << std::endl;
+    return RFSD_OK;
+}
+
+void
+Defrag::selectObjectsByAccessTime(uint64_t block_limit, bool hottest,
+                                  const std::vector<Block::key_t> &exclude,
+                                  std::vector<Block::key_t> &objs)
+{
+    std::set<uint64_t> excluded;
+    for (std::vector<Block::key_t>::const_iterator it = exclude.begin(); it != exclude.end();
+         ++ it)
+    {
+        excluded.insert(it->normalized().hi);
+    }
+
+    // rank by access time. Objects without stat item can't be ranked
+    std::vector<std::pair<uint32_t, uint32_t> > ranked;     // (access time, catalog index)
+    const uint32_t obj_count = fs.objectCount();
+    for (uint32_t obj_idx = 0; obj_idx < obj_count; obj_idx ++) {
+        const ReiserFs::catalog_entry &entry = fs.catalogEntry(obj_idx);
+        if (0 != entry.access_time and 0 == excluded.count(entry.obj))
+            ranked.push_back(std::make_pair(entry.access_time, obj_idx));
+    }
+    if (hottest)
+        std::sort(ranked.rbegin(), ranked.rend());
+    else
+        std::sort(ranked.begin(), ranked.end());
+
+    // take regular files until their size reaches limit
+    std::vector<uint32_t> chosen;
+    uint64_t block_count = 0;
+    for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it = ranked.begin();
+         it != ranked.end() and block_count < block_limit; ++ it)
+    {
+        const Block::key_t obj_key = fs.catalogEntry(it->second).key();
+        Block::stat_info info;
+        if (RFSD_OK != fs.getObjectStat(obj_key, info) or not S_ISREG(info.mode)
+            or 0 == info.size)
+        {
+            continue;
+        }
+        chosen.push_back(it->second);
+        block_count += (info.size + BLOCKSIZE - 1) / BLOCKSIZE;
+    }
+
+    // packed in key order, catalog is sorted by key already
+    std::sort(chosen.begin(), chosen.end());
+    objs.clear();
+    for (std::vector<uint32_t>::const_iterator it = chosen.begin(); it != chosen.end(); ++ it)
+        objs.push_back(fs.catalogEntry(*it).key());
+}
+
+int
+Defrag::directoryDefrag()
+{
+    // depth-first walk. Files of directory go in readdir order, then its subdirectories,
+    // in the same order. Object reachable by several names is taken once
+    std::vector<Block::key_t> objs;
+    std::set<uint64_t> visited;
+    std::vector<Block::key_t> dir_stack;
+    const Block::key_t root_dir(KEY_V1, 1, 2, 0, 0);
+    dir_stack.push_back(root_dir);
+    visited.insert(root_dir.normalized().hi);
+
+    std::vector<ReiserFs::dir_entry> entries;
+    std::vector<Block::key_t> subdirs;
+    uint32_t dir_count = 0;
+    Progress progress;
+    progress.setName("[directories]");
+    progress.enableUnknownMode(true, 100);
+    while (not dir_stack.empty()) {
+        const Block::key_t dir = dir_stack.back();
+        dir_stack.pop_back();
+        this->fs.readDirectory(dir, entries);
+        subdirs.clear();
+        for (std::vector<ReiserFs::dir_entry>::const_iterator it = entries.begin();
+             it != entries.end(); ++ it)
+        {
+            if (it->name == "." or it->name == "..")
+                continue;
+            if (not visited.insert(it->key.normalized().hi).second)
+                continue;
+            Block::stat_info info;
+            if (RFSD_OK != this->fs.getObjectStat(it->key, info))
+                continue;
+            if (S_ISDIR(info.mode))
+                subdirs.push_back(it->key);
+            else if (S_ISREG(info.mode) and info.size > 0
+                     and info.size <= DIRECTORY_SMALL_FILE_SIZE)
+            {
+                objs.push_back(it->key);
+            }
+        }
+        // last pushed is walked first, so subdirectories go in reverse
+        dir_stack.insert(dir_stack.end(), subdirs.rbegin(), subdirs.rend());
+        dir_count ++;
+        progress.update(dir_count);
+        if (ReiserFs::userAskedForTermination()) {
+            progress.abort();
+            return RFSD_FAIL;
+        }
+    }
+    progress.show100();
+
+    std::cout << objs.size() << " small file(s) in " << dir_count << " directories" << std::endl;
+    if (objs.empty())
+        return RFSD_OK;
+    return this->moveObjectsUp(objs);
+}
+
+uint32_t
+Defrag::totalFreeBlockCount()
+{
+    uint32_t free_count = 0;
+    for (uint32_t ag = 0; ag < fs.bitmap->AGCount(); ag ++)
+        free_count += fs.bitmap->AGFreeBlockCount(ag);
+    return free_count;
+}
+
+uint32_t
+Defrag::AGLeafCount(uint32_t ag)
+{
+    // AG count changes only if AG size does, start over then
+    if (this->leaf_count_cache.size() != fs.bitmap->AGCount()) {
+        ag_leaf_count unknown;
+        unknown.change_count = 0;
+        unknown.leaves = 0;
+        unknown.valid = false;
+        this->leaf_count_cache.assign(fs.bitmap->AGCount(), unknown);
+    }
+
+    // leaves referring AG change only when its blocks are moved in or out, which marks
+    // them used or free
+    ag_leaf_count &cached = this->leaf_count_cache[ag];
+    const uint32_t change_count = fs.bitmap->AGChangeCount(ag);
+    if (not cached.valid or cached.change_count != change_count) {
+        cached.leaves = fs.leafCountForBlockRange(fs.bitmap->AGBegin(ag), fs.bitmap->AGEnd(ag));
+        cached.change_count = change_count;
+        cached.valid = true;
+    }
+    return cached.leaves;
+}
+
+void
+Defrag::estimateSweepCost(uint32_t ag, uint32_t free_elsewhere, sweep_cost &cost)
+{
+    cost.ag = ag;
+    cost.blocks_to_move = fs.bitmap->AGUsedBlockCount(ag);
+    cost.leaves_to_rewrite = 0;
+    cost.extent_before = fs.bitmap->AGLargestFreeExtent(ag);
+    cost.extent_after = fs.bitmap->AGLargestExtentWhenEmpty(ag);
+    cost.score = SWEEP_SCORE_INFEASIBLE;
+
+    // sweep is pointless if it can't enlarge largest free extent, and impossible if
+    // there is no room for evacuated blocks
+    if (cost.extent_after <= cost.extent_before || cost.blocks_to_move > free_elsewhere)
+        return;
+
+    cost.leaves_to_rewrite = this->AGLeafCount(ag);
+    // every moved block is read and written once, every affected leaf is read and written
+    // (at least) once. Cost is normalized by contiguous space gained
+    const uint64_t io_cost = static_cast<uint64_t>(cost.blocks_to_move) + cost.leaves_to_rewrite;
+    const uint64_t gain = cost.extent_after - cost.extent_before;
+    cost.score = (io_cost * 1024 + gain - 1) / gain;
+}
+
+void
+Defrag::rankSweepCandidates(std::vector<sweep_cost> &costs)
+{
+    const uint32_t free_total = this->totalFreeBlockCount();
+
+    costs.clear();
     for (uint32_t ag = 0; ag < fs.bitmap->AGCount(); ag ++) {
         if (fs.AGSealed(ag))    // skip sealed AGs
             continue;
-        const uint32_t score = 128 * fs.bitmap->AGExtentCount(ag) + rand() % 1024;
-        if (score > max_score) {
-            max_score = score;
-            selected_ag = ag;
-        }
+        sweep_cost cost;
+        this->estimateSweepCost(ag, free_total - fs.bitmap->AGFreeBlockCount(ag), cost);
+        costs.push_back(cost);
     }
+    std::sort(costs.begin(), costs.end());
+}
 
-    if (RFSD_FAIL == fs.sweepOutAG(selected_ag))
+int
+Defrag::freeOneAG()
+{
+    // select AG which gives largest gain of contiguous free space per block moved.
+    // Selection is deterministic. There is no need in random component to avoid
+    // sweeping same AG again and again, as freshly swept AG gains nothing from another sweep
+    std::vector<sweep_cost> costs;
+    this->rankSweepCandidates(costs);
+
+    // every AG is either sealed or not worth sweeping. Give up.
+    if (costs.size() == 0 || SWEEP_SCORE_INFEASIBLE == costs[0].score)
+        return RFSD_FAIL;
+
+    if (RFSD_FAIL == fs.sweepOutAG(costs[0].ag))
         return RFSD_FAIL;
     return RFSD_OK;
 }
 
+void
+Defrag::showSweepCosts()
+{
+    std::vector<sweep_cost> costs;
+    this->rankSweepCandidates(costs);
+
+    uint32_t infeasible_count = 0;
+    std::cout << "AG sweep cost estimation (lower score is better):" << std::endl;
+    std::cout << "      ag     blocks     leaves  extent now extent after      score" << std::endl;
+    for (std::vector<sweep_cost>::const_iterator it = costs.begin(); it != costs.end(); ++ it) {
+        if (SWEEP_SCORE_INFEASIBLE == it->score) {
+            infeasible_count ++;
+            continue;
+        }
+        std::cout << std::setw(8) << it->ag << std::setw(11) << it->blocks_to_move
+            << std::setw(11) << it->leaves_to_rewrite << std::setw(12) << it->extent_before
+            << std::setw(13) << it->extent_after << std::setw(11) << it->score << std::endl;
+    }
+    std::cout << infeasible_count << " AG(s) not worth sweeping, ";
+    std::cout << fs.bitmap->AGCount() - costs.size() << " AG(s) sealed" << std::endl;
+    if (costs.size() > 0 && SWEEP_SCORE_INFEASIBLE != costs[0].score)
+        std::cout << "next sweep would clear AG " << costs[0].ag << std::endl;
+}
+
 int
 Defrag::squeezeAllAGsWithThreshold(uint32_t threshold)
 {
@@ -511,68 +1266,196 @@ Defrag::squeezeAllAGsWithThreshold(uint32_t threshold)
 }
 
 int
-Defrag::incrementalDefrag(uint32_t batch_size, bool use_previous_estimation)
+Defrag::collectPlanUnits(object_walk &walk, uint32_t batch_size, std::vector<plan_unit> &units)
 {
-    Block::key_t start_key = Block::zero_key;
+    const uint32_t limit = 15*2048;
     Block::key_t next_key;
-    blocklist_t file_blocks;
-    movemap_t movemap;
-    uint32_t start_offset;
     uint32_t next_offset;
-    uint32_t limit = 15*2048;
-    uint32_t obj_count = 0;
+    uint32_t batch_blocks = 0;
+
+    units.clear();
+    while (batch_blocks <= batch_size) {
+        if (not walk.obj_open) {
+            if (walk.obj_it == walk.last)
+                break;
+            if (ReiserFs::userAskedForTermination())
+                return RFSD_FAIL;
+            const ReiserFs::catalog_entry &entry = fs.catalogEntry(*walk.obj_it);
+            walk.obj_key = entry.key();
+            if ((not entry.dirty and entry.settled) or this->objectIsSealed(walk.obj_key)) {
+                ++ walk.obj_it;
+                continue;
+            }
+            walk.start_key = walk.obj_key;
+            walk.start_offset = 0;
+            walk.obj_open = true;
+        }
+        units.push_back(plan_unit());
+        plan_unit &unit = units.back();
+        unit.obj_it = walk.obj_it;
+        unit.start_key = walk.start_key;
+        unit.start_offset = walk.start_offset;
+        fs.getIndirectBlocksOfObject(walk.start_key, walk.start_offset, next_key, next_offset,
+                                     unit.blocks, limit);
+        unit.raw_count = unit.blocks.size();
+        this->filterOutSparseBlocks(unit.blocks);
+        batch_blocks += unit.blocks.size();
+        // part shorter than limit means object is over
+        unit.last = (unit.raw_count + 1 < limit or not walk.obj_key.sameObjectAs(next_key));
+        if (unit.last) {
+            walk.obj_open = false;
+            ++ walk.obj_it;
+        } else {
+            walk.start_key = next_key;
+            walk.start_offset = next_offset;
+        }
+    }
+    return RFSD_OK;
+}
 
+/// batch planned by separate thread
+struct plan_ahead_task {
+    Defrag *defrag;
+    std::vector<Defrag::plan_unit> *units;
+    std::string error;
+};
 
-    if (use_previous_estimation && (0 != this->previous_obj_count)) {
-        obj_count = this->previous_obj_count;
-    } else {
-        // estimate run time
-        Progress estimation;
-        estimation.enableUnknownMode(true, 10000);
-        estimation.setName("[estimate]");
+void *
+Defrag::planAheadWorker(void *arg)
+{
+    plan_ahead_task *task = static_cast<plan_ahead_task *>(arg);
+    try {
+        task->defrag->planDefragTasks(*task->units);
+    } catch (std::logic_error &e) {
+        task->error = e.what();
+    }
+    return NULL;
+}
 
-        start_offset = 0;
-        while (1) {
-            fs.getIndirectBlocksOfObject(start_key, start_offset, next_key, next_offset,
-                                         file_blocks, limit);
-            if (next_key.sameObjectAs(start_key) && (next_offset == 0)) break;
-            obj_count ++;
-            start_key = next_key;
-            start_offset = next_offset;
-            estimation.inc();
-            if (ReiserFs::userAskedForTermination()) {
-                estimation.abort();
-                return RFSD_FAIL;
-            }
+void
+Defrag::requestPlannedTargetsRescan(const std::vector<plan_unit> &units)
+{
+    for (std::vector<plan_unit>::const_iterator unit = units.begin(); unit != units.end();
+         ++ unit)
+    {
+        std::vector<FsBitmap::extent_t> targets;
+        this->getMovemapTargetExtents(unit->movemap, targets);
+        for (std::vector<FsBitmap::extent_t>::const_iterator it = targets.begin();
+             it != targets.end(); ++ it)
+        {
+            // extents of adjacent allocations may be merged across AG border
+            const uint32_t first_ag = this->fs.bitmap->AGOfBlock(it->start);
+            const uint32_t last_ag = this->fs.bitmap->AGOfBlock(it->start + it->len - 1);
+            for (uint32_t ag = first_ag; ag <= last_ag; ag ++)
+                this->fs.bitmap->requestAGRescan(ag);
+        }
+    }
+}
+
+void
+Defrag::confirmPlannedTargets(std::vector<plan_unit> &units)
+{
+    // free extent lists of AGs where blocks were moved or targets were planned are rebuilt
+    // from bitmap, and reservations made while moving are lost. Make them again. Any target
+    // taken meanwhile invalidates plan of its part, such parts are planned once again,
+    // in order
+    std::vector<plan_unit *> conflicting;
+    for (std::vector<plan_unit>::iterator unit = units.begin(); unit != units.end(); ++ unit) {
+        std::vector<FsBitmap::extent_t> targets;
+        this->getMovemapTargetExtents(unit->movemap, targets);
+        std::vector<FsBitmap::extent_t>::const_iterator it = targets.begin();
+        while (it != targets.end()) {
+            if (RFSD_OK != this->fs.bitmap->reserveExtent(it->start, it->len))
+                break;
+            ++ it;
         }
-        // save obj_count for consequent passes
-        this->previous_obj_count = obj_count;
+        if (it == targets.end())
+            continue;
+        while (it != targets.begin()) {
+            -- it;
+            this->fs.bitmap->releaseExtent(it->start, it->len);
+        }
+        conflicting.push_back(&*unit);
+    }
+    for (std::vector<plan_unit *>::iterator it = conflicting.begin(); it != conflicting.end();
+         ++ it)
+    {
+        (*it)->outcome = this->planDefragTask((*it)->blocks, (*it)->movemap, false);
     }
+}
+
+int
+Defrag::incrementalDefrag(uint32_t batch_size, bool use_previous_estimation)
+{
+    movemap_t movemap;
+
+    // object catalog is collected along with leaf index, so there is no need for separate
+    // estimation walk. Objects not moved since they were found in order last time are skipped
+    const uint32_t obj_count = fs.objectCount();
+    std::vector<uint32_t> objs;
+    fs.takeDirtiedObjects(objs);
+    if (use_previous_estimation and this->worklist_valid) {
+        // objects previous pass failed to put in order, and objects moved since
+        objs.insert(objs.end(), this->worklist.begin(), this->worklist.end());
+        std::sort(objs.begin(), objs.end());
+        objs.erase(std::unique(objs.begin(), objs.end()), objs.end());
+    } else {
+        fs.markAllObjectsDirty();
+        objs.clear();
+        for (uint32_t obj_idx = 0; obj_idx < obj_count; obj_idx ++)
+            objs.push_back(obj_idx);
+    }
+    // worklist becomes valid again only if this pass completes
+    this->worklist_valid = false;
+    std::vector<uint32_t> next_worklist;
 
     Progress progress;
-    progress.setMaxValue(obj_count);
+    progress.setMaxValue(objs.size());
     progress.setName("[incremental]");
-    start_key = Block::zero_key;
-    start_offset = 0;
     this->defrag_statistics.reset();
 
+    // objects are read sequentially, in batches of about batch_size blocks. Every batch is
+    // planned in parallel, and results are applied in order. When accumulated moves are
+    // executed, next batch is planned by separate thread meanwhile
+    object_walk walk;
+    walk.first = objs.begin();
+    walk.obj_it = objs.begin();
+    walk.last = objs.end();
+    walk.obj_open = false;
+    // tally of object being applied
+    uint32_t block_count = 0;
+    uint32_t fragment_count = 0;
+    bool settled = true;
+    std::vector<plan_unit> units;
+    bool units_planned = false;
     while (1) {
-        if (ReiserFs::userAskedForTermination()) {
-            progress.abort();
-            this->showDefragStatistics();
-            return RFSD_FAIL;
+        if (not units_planned) {
+            if (RFSD_OK != this->collectPlanUnits(walk, batch_size, units)) {
+                progress.abort();
+                this->showDefragStatistics();
+                return RFSD_FAIL;
+            }
+            if (units.empty())
+                break;
+            this->planDefragTasks(units);
         }
+        units_planned = false;
+        progress.update(walk.obj_it - walk.first);
 
-        fs.getIndirectBlocksOfObject(start_key, start_offset, next_key, next_offset,
-                                     file_blocks, limit);
-        progress.inc();
-
-        this->filterOutSparseBlocks(file_blocks);
-        if (0 != file_blocks.size() && not this->objectIsSealed(start_key)) {
-            movemap_t partial_movemap;
-            if (RFSD_FAIL == this->prepareDefragTask(file_blocks, partial_movemap)) {
-                // Before we do anything, we must process all pending moves as further moves may
-                // lead to inconsistency.
+        bool batch_failed = false;
+        for (std::vector<plan_unit>::iterator unit = units.begin(); unit != units.end();
+             ++ unit)
+        {
+            this->countPlanOutcome(unit->outcome);
+            if (PLAN_FAILURE == unit->outcome) {
+                // plans of following parts are dropped, they'll be made again
+                for (std::vector<plan_unit>::const_iterator it = unit + 1; it != units.end();
+                     ++ it)
+                {
+                    this->releaseMovemapTargets(it->movemap);
+                }
+                // Before we do anything, we must process all pending moves as further
+                // moves may lead to inconsistency.
                 fs.moveBlocks(movemap);
                 movemap.clear();
                 // we get here if free extent allocation failed. That may mean we have too
@@ -582,23 +1465,74 @@ Defrag::incrementalDefrag(uint32_t batch_size, bool use_previous_estimation)
                     this->showDefragStatistics();
                     return RFSD_FAIL;
                 }
-                continue;   // restart with current parameters
+                // restart with failed part
+                walk.obj_it = unit->obj_it;
+                walk.obj_key = fs.catalogEntry(*walk.obj_it).key();
+                walk.start_key = unit->start_key;
+                walk.start_offset = unit->start_offset;
+                walk.obj_open = true;
+                batch_failed = true;
+                break;
             }
-
-            this->mergeMovemap(movemap, partial_movemap);
-            if (movemap.size() > batch_size) {
-                fs.moveBlocks(movemap);
-                movemap.clear();
+            if (0 != unit->blocks.size()) {
+                if (not unit->movemap.empty())
+                    settled = false;
+                std::vector<FsBitmap::extent_t> extents;
+                this->convertBlocksToExtents(unit->blocks, extents);
+                fragment_count += extents.size() - 1;
+                this->mergeMovemap(movemap, unit->movemap);
+            }
+            block_count += unit->raw_count;
+            if (unit->last) {
+                fs.updateCatalogEntry(*unit->obj_it, block_count, fragment_count, settled);
+                if (not settled)
+                    next_worklist.push_back(*unit->obj_it);
+                block_count = 0;
+                fragment_count = 0;
+                settled = true;
             }
         }
+        if (batch_failed or movemap.size() <= batch_size)
+            continue;
 
-        // next_key's and start_key's reference to the same object means we are done
-        // with tree enumeration and may exit
-        if (next_key.sameObjectAs(start_key) && (next_offset == 0))
-            break;
-        start_key = next_key;
-        start_offset = next_offset;
+        // moving blocks doesn't change blocks of other objects, so next batch can be read
+        // now and planned while this one is written
+        if (RFSD_OK != this->collectPlanUnits(walk, batch_size, units)) {
+            progress.abort();
+            this->showDefragStatistics();
+            return RFSD_FAIL;
+        }
+        if (units.empty()) {
+            fs.moveBlocks(movemap);
+            movemap.clear();
+            continue;
+        }
+        plan_ahead_task task;
+        task.defrag = this;
+        task.units = &units;
+        pthread_t thread;
+        fs.holdFreeExtents(true);
+        const bool started = (0 == pthread_create(&thread, NULL, Defrag::planAheadWorker, &task));
+        if (not started)
+            fs.holdFreeExtents(false);
+        fs.moveBlocks(movemap);
+        movemap.clear();
+        if (started) {
+            pthread_join(thread, NULL);
+            // release rebuilds lists of AGs changed by moves only. Planner took its targets
+            // out of lists of other AGs too, have them rebuilt as well
+            this->requestPlannedTargetsRescan(units);
+            fs.holdFreeExtents(false);
+            if (not task.error.empty())
+                throw std::logic_error(task.error);
+            this->confirmPlannedTargets(units);
+        } else {
+            this->planDefragTasks(units);
+        }
+        units_planned = true;
     }
+    this->worklist.swap(next_worklist);
+    this->worklist_valid = true;
 
     if (movemap.size() > 0) {
         fs.moveBlocks(movemap);
@@ -608,9 +1542,94 @@ Defrag::incrementalDefrag(uint32_t batch_size, bool use_previous_estimation)
     progress.show100();
     this->showDefragStatistics();
 
+    // failure to place leaves is not failure of the pass, data is defragmented anyway
+    if (RFSD_OK != this->placeMetadata() and ReiserFs::userAskedForTermination())
+        return RFSD_FAIL;
+
     return RFSD_OK;
 }
 
+void
+Defrag::setMetadataPlacement(int placement)
+{
+    this->metadata_placement = placement;
+}
+
+int
+Defrag::placeMetadata()
+{
+    switch (this->metadata_placement) {
+    case METADATA_ZONE:
+        return this->metadataDefrag();
+    case METADATA_NEAR_DATA:
+        return this->placeLeavesNearData();
+    default:
+        // leaves stay where data moves left them
+        return RFSD_OK;
+    }
+}
+
+int
+Defrag::placeLeavesNearData()
+{
+    std::vector<ReiserFs::leaf_data_span> spans;
+    this->fs.getLeafDataSpans(spans);
+
+    // leaf goes to nearest free block before its first data block, or after it if there is
+    // none. Search is limited to one extent length each way
+    const uint32_t fs_size = this->fs.sizeInBlocks();
+    std::set<uint32_t> taken;
+    movemap_t movemap;
+    for (std::vector<ReiserFs::leaf_data_span>::const_iterator it = spans.begin();
+         it != spans.end(); ++ it)
+    {
+        if (it->distance <= LEAF_NEAR_DISTANCE)
+            continue;
+        uint32_t target = 0;
+        uint32_t target_distance = 0;
+        for (uint32_t d = 1; d <= this->desired_extent_length and 0 == target; d ++) {
+            const uint32_t candidates[2] = { it->first - d, it->first + d };
+            for (uint32_t c = 0; c < 2 and 0 == target; c ++) {
+                const uint32_t idx = candidates[c];
+                if ((0 == c and d >= it->first) or (1 == c and idx >= fs_size))
+                    continue;
+                if (this->fs.blockUsed(idx) or this->fs.blockReserved(idx) or taken.count(idx))
+                    continue;
+                target = idx;
+                target_distance = d;
+            }
+        }
+        // new place should be closer than old one, data may be spread around the leaf
+        if (0 == target or target_distance >= it->distance)
+            continue;
+        movemap.insert(it->leaf, target);
+        taken.insert(target);
+    }
+    movemap.normalize();
+    if (movemap.size() == 0)
+        return RFSD_OK;
+
+    std::cout << "moving " << movemap.size() << " leaves closer to their data" << std::endl;
+    this->fs.moveBlocks(movemap);
+    return RFSD_OK;
+}
+
+void
+Defrag::showLeafDataDistance()
+{
+    std::vector<ReiserFs::leaf_data_span> spans;
+    this->fs.getLeafDataSpans(spans);
+    uint64_t total_distance = 0;
+    for (std::vector<ReiserFs::leaf_data_span>::const_iterator it = spans.begin();
+         it != spans.end(); ++ it)
+    {
+        total_distance += it->distance;
+    }
+    const uint64_t average = spans.empty() ? 0 : total_distance / spans.size();
+    std::cout << "leaf-to-data distance: " << average << " blocks average, over "
+        << spans.size() << " leaves" << std::endl;
+}
+
 void
 Defrag::sealObjects(const std::vector<Block::key_t> &objs)
 {
@@ -18,6 +18,8 @@
 const int DEFRAG_TYPE_INCREMENTAL = 0;
 const int DEFRAG_TYPE_TREETHROUGH = 1;
 const int DEFRAG_TYPE_NONE = 2;
+const int DEFRAG_TYPE_METADATA = 3;
+const int DEFRAG_TYPE_DIRECTORY = 4;
 
 struct params_struct {
     int defrag_type;
@@ -26,6 +28,13 @@ struct params_struct {
     int squeeze_threshold;
     bool journal_data;
     uint32_t cache_size;
+    bool dry_run;
+    std::string index_cache;
+    uint32_t thread_count;
+    uint32_t io_streams;
+    int metadata_placement;
+    uint32_t hot_size;
+    uint32_t cold_size;
     std::vector<std::string> firstfiles;
 } params;
 
@@ -38,6 +47,13 @@ static const struct option long_opts[] = {
     { "squeeze-threshold",  required_argument,  NULL, 128 },
     { "type",               required_argument,  NULL, 't' },
     { "journal-data",       no_argument,        NULL, 129 },
+    { "dry-run",            no_argument,        NULL, 130 },
+    { "index-cache",        required_argument,  NULL, 131 },
+    { "threads",            required_argument,  NULL, 132 },
+    { "io-streams",         required_argument,  NULL, 133 },
+    { "metadata-placement", required_argument,  NULL, 134 },
+    { "hot-size",           required_argument,  NULL, 135 },
+    { "cold-size",          required_argument,  NULL, 136 },
     { 0, 0, 0, 0}
 };
 
@@ -50,16 +66,28 @@ display_usage()
     printf("Usage: reiserfs-defrag [options] <reiserfs partition>\n"
     "\n"
     "  -c, --cache-size <size>      specify block cache size in MiB (200 by default)\n"
+    "  --cold-size <size>           move least recently used <size> MiB of files\n"
+    "                               to the end of the fs\n"
+    "  --dry-run                    print predicted cost of AG sweeps, move nothing\n"
     "  -f, --file-list <filename>   move files from list in <filename> to\n"
     "                               beginning of the fs\n"
     "  -h, --help                   show usage (this screen)\n"
+    "  --hot-size <size>            move most recently used <size> MiB of files\n"
+    "                               to beginning of the fs\n"
+    "  --index-cache <filename>     keep leaf index and catalog in <filename>\n"
+    "  --io-streams <count>         copy data in <count> parallel streams\n"
     "  --journal-data               journal data in unformatted blocks\n"
+    "  --metadata-placement <name>  where to put leaves: interleaved (default),\n"
+    "                               zone or near-data\n"
     "  -p <passcount>               incremental defrag pass count\n"
     "  -s, --squeeze                squeeze AGs\n"
     "  --squeeze-threshold <value>  squeeze AGs with more than 'value' gaps\n"
+    "  --threads <count>            use <count> threads (0 to choose automatically)\n"
     "  -t, --type <name>            select defragmentation algorithm:\n"
     "                                 * tree/treethrough/tree-through\n"
     "                                 * inc/incremental (default)\n"
+    "                                 * meta/metadata\n"
+    "                                 * dir/directory\n"
     "                                 * none\n"
     );
 }
@@ -72,6 +100,13 @@ void default_params()
     params.squeeze_threshold = 7;
     params.journal_data = false;
     params.cache_size = 200;
+    params.dry_run = false;
+    params.index_cache = "";
+    params.thread_count = 0;
+    params.io_streams = 1;
+    params.metadata_placement = Defrag::METADATA_INTERLEAVED;
+    params.hot_size = 0;
+    params.cold_size = 0;
 }
 
 void fill_file_list_from_file(const std::string &fname)
@@ -132,6 +167,10 @@ main (int argc, char *argv[])
                 std::string("tree-through") == optarg || std::string("tree") == optarg)
             {
                 params.defrag_type = DEFRAG_TYPE_TREETHROUGH;
+            } else if (std::string("metadata") == optarg || std::string("meta") == optarg) {
+                params.defrag_type = DEFRAG_TYPE_METADATA;
+            } else if (std::string("directory") == optarg || std::string("dir") == optarg) {
+                params.defrag_type = DEFRAG_TYPE_DIRECTORY;
             } else if (std::string("none") == optarg) {
                 params.defrag_type = DEFRAG_TYPE_NONE;
             } else {
@@ -154,6 +193,48 @@ main (int argc, char *argv[])
         case 129:   // journal-data
             params.journal_data = true;
             break;
+        case 130:   // dry-run
+            params.dry_run = true;
+            break;
+        case 131:   // index-cache
+            params.index_cache = optarg;
+            break;
+        case 132:   // threads
+            {
+                std::stringstream ss(optarg);
+                if (!(ss >> params.thread_count)) params.thread_count = 0;
+            }
+            break;
+        case 133:   // io-streams
+            {
+                std::stringstream ss(optarg);
+                if (!(ss >> params.io_streams) || params.io_streams < 1) params.io_streams = 1;
+            }
+            break;
+        case 134:   // metadata-placement
+            if (std::string("interleaved") == optarg) {
+                params.metadata_placement = Defrag::METADATA_INTERLEAVED;
+            } else if (std::string("zone") == optarg) {
+                params.metadata_placement = Defrag::METADATA_ZONE;
+            } else if (std::string("near-data") == optarg) {
+                params.metadata_placement = Defrag::METADATA_NEAR_DATA;
+            } else {
+                std::cout << "wrong metadata placement: " << optarg << std::endl;
+                return 2;
+            }
+            break;
+        case 135:   // hot-size
+            {
+                std::stringstream ss(optarg);
+                if (!(ss >> params.hot_size)) params.hot_size = 0;
+            }
+            break;
+        case 136:   // cold-size
+            {
+                std::stringstream ss(optarg);
+                if (!(ss >> params.cold_size)) params.cold_size = 0;
+            }
+            break;
         }
 
         opt = getopt_long(argc, argv, opt_string, long_opts, &long_index);
@@ -170,10 +251,14 @@ main (int argc, char *argv[])
         std::cout << "journaling mode: ";
         std::cout << (params.journal_data ? "data" : "metadata only") << std::endl;
         fs.setCacheSize(params.cache_size);
+        fs.setIndexCacheFile(params.index_cache);
+        fs.setThreadCount(params.thread_count);
+        fs.setIOStreams(params.io_streams);
         std::cout << "max block cache size: " << fs.cacheSize() << " MiB" << std::endl;
 
         if (argc - optind >= 1) {
-            if (RFSD_OK != fs.open(argv[optind], false)) {
+            // dry run only reads fs, so it doesn't even get marked dirty
+            if (RFSD_OK != fs.open(argv[optind], false, params.dry_run)) {
                 // User may ask to terminate while leaf index created
                 if (ReiserFs::userAskedForTermination())
                     throw user_asked_termination();
@@ -186,9 +271,9 @@ main (int argc, char *argv[])
         }
 
         // determine object key for every entry in params.firstfiles
+        std::vector<Block::key_t> firstobjs;
         if (params.firstfiles.size() > 0) {
             std::set<Block::key_t> unique_objs;
-            std::vector<Block::key_t> firstobjs;
             for (std::vector<std::string>::const_iterator it = params.firstfiles.begin();
                  it != params.firstfiles.end(); ++ it)
             {
@@ -198,11 +283,38 @@ main (int argc, char *argv[])
                     unique_objs.insert(k);
                 }
             }
+        }
+        // most recently used files follow files from the list
+        if (params.hot_size > 0) {
+            std::vector<Block::key_t> hotobjs;
+            defrag.selectObjectsByAccessTime((uint64_t)params.hot_size * BLOCKS_IN_ONE_MB,
+                                             true, firstobjs, hotobjs);
+            std::cout << "hot files: " << hotobjs.size() << std::endl;
+            firstobjs.insert(firstobjs.end(), hotobjs.begin(), hotobjs.end());
+        }
+        std::vector<Block::key_t> coldobjs;
+        if (params.cold_size > 0) {
+            defrag.selectObjectsByAccessTime((uint64_t)params.cold_size * BLOCKS_IN_ONE_MB,
+                                             false, firstobjs, coldobjs);
+            std::cout << "cold files: " << coldobjs.size() << std::endl;
+        }
 
-            defrag.moveObjectsUp(firstobjs);
-            defrag.sealObjects(firstobjs);
+        if (firstobjs.size() > 0)
+            defrag.moveObjectsUp(firstobjs, params.dry_run);
+        if (coldobjs.size() > 0)
+            defrag.moveObjectsDown(coldobjs, params.dry_run);
+        // packed files stay where they are
+        firstobjs.insert(firstobjs.end(), coldobjs.begin(), coldobjs.end());
+        defrag.sealObjects(firstobjs);
+
+        if (params.dry_run) {
+            defrag.showSweepCosts();
+            throw no_error();
         }
 
+        defrag.setMetadataPlacement(params.metadata_placement);
+        defrag.showLeafDataDistance();
+
         switch (params.defrag_type) {
         case DEFRAG_TYPE_INCREMENTAL:
             {
@@ -231,6 +343,15 @@ main (int argc, char *argv[])
             std::cout << "defrag type: treethrough" << std::endl;
             defrag.treeThroughDefrag(8000);
             break;
+        case DEFRAG_TYPE_METADATA:
+            std::cout << "defrag type: metadata" << std::endl;
+            defrag.metadataDefrag();
+            break;
+        case DEFRAG_TYPE_DIRECTORY:
+            std::cout << "defrag type: directory" << std::endl;
+            if (RFSD_FAIL == defrag.directoryDefrag() and ReiserFs::userAskedForTermination())
+                throw user_asked_termination();
+            break;
         case DEFRAG_TYPE_NONE:
             std::cout << "defrag type: none" << std::endl;
             break;
@@ -246,6 +367,7 @@ main (int argc, char *argv[])
                 }
             }
         }
+        defrag.showLeafDataDistance();
     } catch (user_asked_termination &uat) {
         std::cout << "user asked for termination" << std::endl;
     } catch (std::logic_error &le) {
@@ -0,0 +1,277 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+static const char INDEX_CACHE_MAGIC[8] = { 'R', 'F', 'S', 'D', 'I', 'D', 'X', '2' };
+/// how many leaves are read back to check that tree is the same
+static const uint32_t INDEX_CACHE_SAMPLES = 64;
+
+struct index_sample {
+    uint32_t block_idx;
+    uint64_t checksum;
+};
+
+/// FNV-1a hash of block content
+static uint64_t
+block_checksum(const Block *block_obj)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t k = 0; k < BLOCKSIZE; k ++) {
+        hash ^= static_cast<uint8_t>(block_obj->buf[k]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename T>
+static void
+write_value(std::ofstream &fp, const T &value)
+{
+    fp.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool
+read_value(std::ifstream &fp, T &value)
+{
+    fp.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return fp.good();
+}
+
+void
+ReiserFs::getIndexStamp(index_stamp &stamp) const
+{
+    ::memset(&stamp, 0, sizeof(stamp));
+    stamp.block_count = this->sb.s_block_count;
+    stamp.root_block = this->sb.s_root_block;
+    stamp.free_blocks = this->sb.s_free_blocks;
+    stamp.tree_height = this->sb.s_tree_height;
+    stamp.mount_id = this->journal->mountId();
+    stamp.last_flush_id = this->journal->lastFlushId();
+    stamp.granularity = this->leaf_index_granularity;
+}
+
+int
+ReiserFs::saveLeafIndex()
+{
+    // write to temporary file first, so interrupted save never leaves broken cache
+    const std::string tmp_name = this->index_cache_file + ".tmp";
+    std::ofstream fp(tmp_name.c_str(), std::ios::binary | std::ios::trunc);
+    if (not fp.good())
+        return RFSD_FAIL;
+
+    index_stamp stamp;
+    this->getIndexStamp(stamp);
+    fp.write(INDEX_CACHE_MAGIC, sizeof(INDEX_CACHE_MAGIC));
+    write_value(fp, stamp);
+
+    // sample leaves evenly across the tree
+    std::vector<index_sample> samples;
+    const std::vector<node_entry> &nodes = this->node_index.items();
+    uint32_t leaf_count = 0;
+    for (std::vector<node_entry>::const_iterator it = nodes.begin(); it != nodes.end(); ++ it) {
+        if (TREE_LEVEL_LEAF == it->link.level)
+            leaf_count ++;
+    }
+    const uint32_t stride = std::max(1u, leaf_count / INDEX_CACHE_SAMPLES);
+    uint32_t leaf_k = 0;
+    for (std::vector<node_entry>::const_iterator it = nodes.begin(); it != nodes.end(); ++ it) {
+        if (TREE_LEVEL_LEAF != it->link.level)
+            continue;
+        if (leaf_k ++ % stride != 0)
+            continue;
+        index_sample sample;
+        sample.block_idx = it->block;
+        Block *block_obj = this->journal->readBlock(it->block, false);
+        sample.checksum = block_checksum(block_obj);
+        this->journal->releaseBlock(block_obj);
+        samples.push_back(sample);
+    }
+    write_value(fp, static_cast<uint32_t>(samples.size()));
+    for (std::vector<index_sample>::const_iterator it = samples.begin(); it != samples.end();
+         ++ it)
+    {
+        write_value(fp, it->block_idx);
+        write_value(fp, it->checksum);
+    }
+
+    write_value(fp, static_cast<uint32_t>(nodes.size()));
+    for (std::vector<node_entry>::const_iterator it = nodes.begin(); it != nodes.end(); ++ it) {
+        write_value(fp, it->block);
+        write_value(fp, it->link);
+    }
+
+    write_value(fp, static_cast<uint32_t>(this->leaf_index.size()));
+    for (std::vector<leaf_index_entry>::const_iterator basket = this->leaf_index.begin();
+         basket != this->leaf_index.end(); ++ basket)
+    {
+        write_value(fp, static_cast<uint32_t>(basket->runs.size()));
+        if (not basket->runs.empty())
+            fp.write(reinterpret_cast<const char *>(&basket->runs[0]),
+                     basket->runs.size() * sizeof(ref_run));
+    }
+
+    // object catalog, if there is one. Objects are neither created nor deleted, so it's
+    // as valid as the rest of index
+    write_value(fp, static_cast<uint8_t>(this->object_catalog_ready ? 1 : 0));
+    if (this->object_catalog_ready) {
+        write_value(fp, static_cast<uint32_t>(this->object_catalog.size()));
+        for (std::vector<catalog_entry>::const_iterator it = this->object_catalog.begin();
+             it != this->object_catalog.end(); ++ it)
+        {
+            write_value(fp, it->obj);
+            write_value(fp, it->block_count);
+            write_value(fp, it->fragment_count);
+            write_value(fp, it->access_time);
+        }
+    }
+    write_value(fp, INDEX_CACHE_MAGIC);     // trailer, guards against truncation
+    fp.close();
+    if (fp.fail())
+        return RFSD_FAIL;
+
+    if (0 != ::rename(tmp_name.c_str(), this->index_cache_file.c_str()))
+        return RFSD_FAIL;
+    return RFSD_OK;
+}
+
+int
+ReiserFs::loadLeafIndex(const index_stamp &stamp)
+{
+    std::ifstream fp(this->index_cache_file.c_str(), std::ios::binary);
+    if (not fp.good())
+        return RFSD_FAIL;       // no cache yet, that's fine
+
+    char magic[sizeof(INDEX_CACHE_MAGIC)];
+    index_stamp saved_stamp;
+    if (not read_value(fp, magic) or 0 != ::memcmp(magic, INDEX_CACHE_MAGIC, sizeof(magic))
+        or not read_value(fp, saved_stamp))
+    {
+        std::cout << "leaf index cache: unknown format, rebuilding" << std::endl;
+        return RFSD_FAIL;
+    }
+    if (0 != ::memcmp(&saved_stamp, &stamp, sizeof(stamp))) {
+        std::cout << "leaf index cache: filesystem changed, rebuilding" << std::endl;
+        return RFSD_FAIL;
+    }
+
+    uint32_t sample_count;
+    if (not read_value(fp, sample_count))
+        return RFSD_FAIL;
+    for (uint32_t k = 0; k < sample_count; k ++) {
+        index_sample sample;
+        if (not read_value(fp, sample.block_idx) or not read_value(fp, sample.checksum))
+            return RFSD_FAIL;
+        if (sample.block_idx >= this->sizeInBlocks())
+            return RFSD_FAIL;
+        Block *block_obj = this->journal->readBlock(sample.block_idx, false);
+        const uint64_t checksum = block_checksum(block_obj);
+        this->journal->releaseBlock(block_obj);
+        if (checksum != sample.checksum) {
+            std::cout << "leaf index cache: leaf contents changed, rebuilding" << std::endl;
+            return RFSD_FAIL;
+        }
+    }
+
+    // stamp and samples match, read index itself
+    uint32_t node_count;
+    if (not read_value(fp, node_count))
+        return RFSD_FAIL;
+    std::vector<node_entry> new_node_index;
+    new_node_index.reserve(node_count);
+    for (uint32_t k = 0; k < node_count; k ++) {
+        node_entry entry;
+        if (not read_value(fp, entry.block) or not read_value(fp, entry.link))
+            return RFSD_FAIL;
+        if (not new_node_index.empty() and new_node_index.back().block >= entry.block)
+            return RFSD_FAIL;
+        new_node_index.push_back(entry);
+    }
+
+    uint32_t basket_count;
+    if (not read_value(fp, basket_count)
+        or basket_count != (this->sizeInBlocks() - 1) / this->leaf_index_granularity + 1)
+    {
+        return RFSD_FAIL;
+    }
+    std::vector<leaf_index_entry> new_leaf_index(basket_count);
+    for (std::vector<leaf_index_entry>::iterator basket = new_leaf_index.begin();
+         basket != new_leaf_index.end(); ++ basket)
+    {
+        uint32_t run_count;
+        if (not read_value(fp, run_count) or run_count > this->leaf_index_granularity)
+            return RFSD_FAIL;
+        basket->runs.resize(run_count);
+        if (run_count > 0) {
+            fp.read(reinterpret_cast<char *>(&basket->runs[0]), run_count * sizeof(ref_run));
+            if (not fp.good())
+                return RFSD_FAIL;
+        }
+        // leaf lists are not stored, they are recomputed from runs
+        basket->changed = true;
+    }
+
+    uint8_t catalog_saved;
+    if (not read_value(fp, catalog_saved))
+        return RFSD_FAIL;
+    std::vector<catalog_entry> new_catalog;
+    if (catalog_saved) {
+        uint32_t entry_count;
+        if (not read_value(fp, entry_count))
+            return RFSD_FAIL;
+        new_catalog.reserve(entry_count);
+        for (uint32_t k = 0; k < entry_count; k ++) {
+            catalog_entry entry;
+            if (not read_value(fp, entry.obj) or not read_value(fp, entry.block_count)
+                or not read_value(fp, entry.fragment_count)
+                or not read_value(fp, entry.access_time))
+            {
+                return RFSD_FAIL;
+            }
+            if (not new_catalog.empty() and new_catalog.back().obj >= entry.obj)
+                return RFSD_FAIL;   // must be sorted, lookups rely on that
+            // nothing is known about current state of object, as in fresh catalog
+            entry.dirty = true;
+            entry.settled = false;
+            new_catalog.push_back(entry);
+        }
+    }
+    if (not read_value(fp, magic) or 0 != ::memcmp(magic, INDEX_CACHE_MAGIC, sizeof(magic))) {
+        std::cout << "leaf index cache: file truncated, rebuilding" << std::endl;
+        return RFSD_FAIL;
+    }
+
+    this->node_index.assign(new_node_index);
+    this->leaf_index.swap(new_leaf_index);
+    if (catalog_saved) {
+        this->object_catalog.swap(new_catalog);
+        this->dirtied_objects.clear();
+        this->object_catalog_ready = true;
+    }
+    std::vector<basket_link> links;
+    for (uint32_t basket_id = 0; basket_id < this->leaf_index.size(); basket_id ++) {
+        const std::vector<ref_run> &runs = this->leaf_index[basket_id].runs;
+        for (std::vector<ref_run>::const_iterator it = runs.begin(); it != runs.end(); ++ it) {
+            basket_link link;
+            link.leaf = it->leaf;
+            link.basket = basket_id;
+            links.push_back(link);
+        }
+    }
+    this->leaf_baskets.assign(links);
+    this->updateLeafIndex();
+
+    std::cout << "leaf index: loaded from `" << this->index_cache_file << "', "
+        << this->node_index.size() << " tree nodes" << std::endl;
+    return RFSD_OK;
+}
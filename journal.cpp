@@ -13,6 +13,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <cstdlib>
+#include <stdexcept>
+#include <pthread.h>
+#include <time.h>
+
+/// how many blocks raw copy stream reads before writing them out
+static const uint32_t RAW_STREAM_CHUNK = 256;
+/// raw moves are split into streams only if there is at least that many of them
+static const uint32_t RAW_STREAM_MIN_MOVES = 64;
 
 FsJournal::FsJournal(int fd_, FsSuperblock *sb)
 {
@@ -24,6 +32,8 @@ FsJournal::FsJournal(int fd_, FsSuperblock *sb)
     this->use_journaling = true;
     this->sb = sb;
     this->flag_transaction_max_size_exceeded = false;
+    this->io_streams = 1;
+    this->stream_group_size = 1;
 
     // read journal header
     int res = readBufAt (this->fd, this->sb->jp_journal_1st_block + this->sb->jp_journal_size,
@@ -53,6 +63,15 @@ FsJournal::~FsJournal()
 
     std::cout << "blockcache statistics: " << this->cache_hits << "/" << this->cache_misses;
     std::cout << " (hits/misses)" << std::endl;
+    for (uint32_t k = 0; k < this->stream_stats.size(); k ++) {
+        const raw_stream_stats &st = this->stream_stats[k];
+        const double mib = static_cast<double>(st.blocks) * BLOCKSIZE / (1024 * 1024);
+        std::cout << "raw copy stream " << k << ": " << st.blocks << " blocks, ";
+        if (st.seconds > 0)
+            std::cout << mib / st.seconds << " MiB/s" << std::endl;
+        else
+            std::cout << "no time measured" << std::endl;
+    }
 }
 
 void
@@ -81,12 +100,9 @@ writeBufAt(int fd, uint32_t block_idx, void *buf, uint32_t size)
     fprintf (stderr, "%d.%09d ? %d\n", (int)ts.tv_sec, (int)ts.tv_nsec, block_idx);
 #endif
 
+    // pwrite does not move file offset, so it's safe to call from several threads
     off_t ofs = static_cast<off_t>(block_idx) * BLOCKSIZE;
-    off_t new_ofs = ::lseek (fd, ofs, SEEK_SET);
-    if (static_cast<off_t>(-1) == new_ofs || new_ofs != ofs) {
-        assert2 ("seek failed (write)", false);
-    }
-    ssize_t bytes_written = ::write (fd, buf, size);
+    ssize_t bytes_written = ::pwrite (fd, buf, size, ofs);
     if (-1 == bytes_written || static_cast<ssize_t>(size) != bytes_written) {
         assert2 ("write failed", false);
     }
@@ -103,11 +119,7 @@ readBufAt(int fd, uint32_t block_idx, void *buf, uint32_t size)
 #endif
 
     off_t ofs = static_cast<off_t>(block_idx) * BLOCKSIZE;
-    off_t new_ofs = ::lseek (fd, ofs, SEEK_SET);
-    if (static_cast<off_t>(-1) == new_ofs || new_ofs != ofs) {
-        assert2 ("seek failed (write)", false);
-    }
-    ssize_t bytes_read = ::read (fd, buf, size);
+    ssize_t bytes_read = ::pread (fd, buf, size, ofs);
     if (-1 == bytes_read || static_cast<ssize_t>(size) != bytes_read) {
         assert2 ("read failed", false);
     }
@@ -276,14 +288,158 @@ FsJournal::commitTransaction()
     return RFSD_OK;
 }
 
+void
+FsJournal::setIOStreams(uint32_t count, uint32_t group_size)
+{
+    this->io_streams = std::max(1u, count);
+    this->stream_group_size = std::max(1u, group_size);
+}
+
+/// raw moves copied by one thread
+struct raw_stream {
+    int fd;
+    std::vector<std::pair<uint32_t, uint32_t> > moves;   //< (from, to), sorted by source
+    pthread_t thread;
+    bool started;
+    double seconds;
+    std::string error;
+};
+
+static uint32_t
+find_group_root(std::vector<uint32_t> &parent, uint32_t group)
+{
+    while (parent[group] != group) {
+        parent[group] = parent[parent[group]];
+        group = parent[group];
+    }
+    return group;
+}
+
+static void *
+raw_stream_worker(void *arg)
+{
+    raw_stream *stream = static_cast<raw_stream *>(arg);
+    struct timespec start_ts, end_ts;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    std::vector<char> buf(RAW_STREAM_CHUNK * BLOCKSIZE);
+    std::vector<std::pair<uint32_t, uint32_t> > writes;
+    try {
+        // sources are read in sorted order, then their chunk is written in order of targets
+        for (uint32_t first = 0; first < stream->moves.size(); first += RAW_STREAM_CHUNK) {
+            const uint32_t last = std::min<uint32_t>(first + RAW_STREAM_CHUNK,
+                                                     stream->moves.size());
+            writes.clear();
+            for (uint32_t k = first; k < last; k ++) {
+                readBufAt(stream->fd, stream->moves[k].first, &buf[(k - first) * BLOCKSIZE],
+                          BLOCKSIZE);
+                writes.push_back(std::make_pair(stream->moves[k].second, k - first));
+            }
+            std::sort(writes.begin(), writes.end());
+            for (uint32_t k = 0; k < writes.size(); k ++)
+                writeBufAt(stream->fd, writes[k].first, &buf[writes[k].second * BLOCKSIZE],
+                           BLOCKSIZE);
+        }
+    } catch (std::logic_error &e) {
+        stream->error = e.what();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_ts);
+    stream->seconds = (end_ts.tv_sec - start_ts.tv_sec) + (end_ts.tv_nsec - start_ts.tv_nsec) / 1e9;
+    return NULL;
+}
+
+void
+FsJournal::flushRawMovesInStreams()
+{
+    // moves sharing a group, either by source or by target, stay in the same stream. So
+    // streams work on disjoint regions of disk. Targets are free blocks, never sources of
+    // other moves, so copies don't depend on each other and may go in any order
+    const uint32_t group_count = (this->sb->s_block_count - 1) / this->stream_group_size + 1;
+    std::vector<uint32_t> parent(group_count);
+    for (uint32_t k = 0; k < group_count; k ++)
+        parent[k] = k;
+    for (movemap_t::const_iterator it = this->raw_moves.begin(); it != this->raw_moves.end();
+         ++ it)
+    {
+        const uint32_t a = find_group_root(parent, it->first / this->stream_group_size);
+        const uint32_t b = find_group_root(parent, it->second / this->stream_group_size);
+        parent[std::max(a, b)] = std::min(a, b);
+    }
+
+    // component sizes, then largest components go first, each to the least loaded stream
+    std::map<uint32_t, uint32_t> component_size;
+    for (movemap_t::const_iterator it = this->raw_moves.begin(); it != this->raw_moves.end();
+         ++ it)
+    {
+        component_size[find_group_root(parent, it->first / this->stream_group_size)] ++;
+    }
+    std::vector<std::pair<uint32_t, uint32_t> > by_size;  // (-size, root), for sorting
+    for (std::map<uint32_t, uint32_t>::const_iterator it = component_size.begin();
+         it != component_size.end(); ++ it)
+    {
+        by_size.push_back(std::make_pair(~it->second, it->first));
+    }
+    std::sort(by_size.begin(), by_size.end());
+
+    const uint32_t stream_count = std::min<uint32_t>(this->io_streams, by_size.size());
+    std::vector<raw_stream> streams(stream_count);
+    std::vector<uint32_t> stream_load(stream_count, 0);
+    std::map<uint32_t, uint32_t> stream_of_root;
+    for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it = by_size.begin();
+         it != by_size.end(); ++ it)
+    {
+        const uint32_t stream_id =
+            std::min_element(stream_load.begin(), stream_load.end()) - stream_load.begin();
+        stream_load[stream_id] += ~it->first;
+        stream_of_root[it->second] = stream_id;
+    }
+    // raw_moves iterate in order of source, so moves of every stream are sorted too
+    for (movemap_t::const_iterator it = this->raw_moves.begin(); it != this->raw_moves.end();
+         ++ it)
+    {
+        const uint32_t root = find_group_root(parent, it->first / this->stream_group_size);
+        streams[stream_of_root[root]].moves.push_back(*it);
+    }
+
+    for (uint32_t k = 0; k < stream_count; k ++) {
+        streams[k].fd = this->fd;
+        streams[k].started =
+            (0 == pthread_create(&streams[k].thread, NULL, raw_stream_worker, &streams[k]));
+    }
+    // if thread can't be created, copy its part here
+    for (uint32_t k = 0; k < stream_count; k ++) {
+        if (not streams[k].started)
+            raw_stream_worker(&streams[k]);
+    }
+    for (uint32_t k = 0; k < stream_count; k ++) {
+        if (streams[k].started)
+            pthread_join(streams[k].thread, NULL);
+    }
+
+    if (this->stream_stats.size() < stream_count)
+        this->stream_stats.resize(stream_count);
+    for (uint32_t k = 0; k < stream_count; k ++) {
+        if (not streams[k].error.empty())
+            throw std::logic_error(streams[k].error);
+        this->stream_stats[k].blocks += streams[k].moves.size();
+        this->stream_stats[k].seconds += streams[k].seconds;
+    }
+    this->raw_moves.clear();
+}
+
 void
 FsJournal::flushRawMoves()
 {
+    this->raw_moves.normalize();
+    if (this->io_streams > 1 and this->raw_moves.size() >= RAW_STREAM_MIN_MOVES) {
+        this->flushRawMovesInStreams();
+        return;
+    }
+
     std::map<uint32_t, Block *> write_map;
     for (movemap_t::const_iterator it = this->raw_moves.begin(); it != this->raw_moves.end();
          ++ it)
     {
-        // movemap is a std::map and therefore iterates in sorted manner,
+        // movemap iterates in sorted manner,
         // and reads performed in sorted order. That reduces disk seeks, so reads
         // become a bit faster
         Block *block_obj = this->readBlock(it->first, false);
@@ -391,7 +547,7 @@ FsJournal::moveRawBlock(uint32_t from, uint32_t to, bool factor_into_trasaction)
         }
         this->releaseBlock(block_obj, true);
     } else {    // collect raw moves
-        this->raw_moves[from] = to;
+        this->raw_moves.insert(from, to);
         if (this->blockInCache(from)) {
             assert2("unformatted blocks should not be cached", false);
         }
@@ -0,0 +1,97 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+#include <algorithm>
+
+/// unsorted tail is merged when it grows beyond that size...
+static const uint32_t LEAFSET_PENDING_MIN = 32;
+/// ... or beyond that fraction of sorted part, whichever is larger
+static const uint32_t LEAFSET_PENDING_RATIO = 4;
+
+void
+LeafSet::insert(uint32_t leaf_idx)
+{
+    if (this->pending.empty() and (this->sorted.empty() or this->sorted.back() < leaf_idx)) {
+        // appending in order, no need to sort anything
+        this->sorted.push_back(leaf_idx);
+        return;
+    }
+    if (not this->pending.empty() and this->pending.back() == leaf_idx)
+        return;
+    this->pending.push_back(leaf_idx);
+    if (this->pending.size() >= std::max(LEAFSET_PENDING_MIN,
+                                         (uint32_t)this->sorted.size() / LEAFSET_PENDING_RATIO))
+    {
+        this->compact();
+    }
+}
+
+void
+LeafSet::compact() const
+{
+    if (this->pending.empty())
+        return;
+
+    std::sort(this->pending.begin(), this->pending.end());
+    std::vector<uint32_t> merged;
+    merged.reserve(this->sorted.size() + this->pending.size());
+    std::merge(this->sorted.begin(), this->sorted.end(), this->pending.begin(),
+               this->pending.end(), std::back_inserter(merged));
+    merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+    // copy to get rid of excess capacity
+    std::vector<uint32_t>(merged.begin(), merged.end()).swap(this->sorted);
+    std::vector<uint32_t>().swap(this->pending);
+}
+
+void
+LeafSet::erase(uint32_t leaf_idx)
+{
+    this->compact();
+    std::vector<uint32_t>::iterator it =
+        std::lower_bound(this->sorted.begin(), this->sorted.end(), leaf_idx);
+    if (it != this->sorted.end() and *it == leaf_idx)
+        this->sorted.erase(it);
+}
+
+void
+LeafSet::replace(uint32_t old_idx, uint32_t new_idx)
+{
+    this->compact();
+    if (not std::binary_search(this->sorted.begin(), this->sorted.end(), old_idx))
+        return;
+    this->erase(old_idx);
+    this->insert(new_idx);
+}
+
+uint32_t
+LeafSet::size() const
+{
+    this->compact();
+    return this->sorted.size();
+}
+
+const std::vector<uint32_t> &
+LeafSet::items() const
+{
+    this->compact();
+    return this->sorted;
+}
+
+void
+LeafSet::assign(std::vector<uint32_t> &sorted_leaves)
+{
+    this->sorted.swap(sorted_leaves);
+    std::vector<uint32_t>().swap(sorted_leaves);
+    std::vector<uint32_t>().swap(this->pending);
+}
+
+uint64_t
+LeafSet::memoryUsage() const
+{
+    return (this->sorted.capacity() + this->pending.capacity()) * sizeof(uint32_t);
+}
@@ -19,7 +19,7 @@ main (int argc, char *argv[])
         if (fs.blockUsed(block_idx)) {
             freeblock = fs.findFreeBlockBefore(freeblock);
             if (block_idx < freeblock)
-                movemap[block_idx] = freeblock;
+                movemap.insert(block_idx, freeblock);
         }
         block_idx ++;
     }
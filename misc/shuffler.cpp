@@ -34,8 +34,9 @@ main (int argc, char *argv[])
         (from != occupied_blocks.end()) && (to != free_blocks.end());
         ++from, ++to)
     {
-        movemap[*from] = *to;
+        movemap.insert(*from, *to);
     }
+    movemap.normalize();
 
     if (movemap.size() > 0) {
         fs.moveBlocks(movemap);
@@ -0,0 +1,214 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+#include <algorithm>
+
+/// below that size std::stable_sort is faster than radix sort
+static const uint32_t RADIX_SORT_THRESHOLD = 256;
+
+static uint32_t
+entry_key(const Movemap::value_type &entry)
+{
+    return entry.first;
+}
+
+static uint32_t
+block_key(const uint32_t &block_idx)
+{
+    return block_idx;
+}
+
+/// stable LSD radix sort by 32-bit key, byte by byte
+template <typename T>
+static void
+radix_sort(typename std::vector<T>::iterator first, typename std::vector<T>::iterator last,
+           uint32_t (*key)(const T &))
+{
+    const uint32_t count = last - first;
+    if (count < RADIX_SORT_THRESHOLD) {
+        std::stable_sort(first, last, compare_by_key<T>(key));
+        return;
+    }
+
+    std::vector<T> tmp(count);
+    typename std::vector<T>::iterator src = first;
+    typename std::vector<T>::iterator dst = tmp.begin();
+    for (uint32_t shift = 0; shift < 32; shift += 8) {
+        uint32_t offsets[256] = { 0 };
+        for (uint32_t k = 0; k < count; k ++)
+            offsets[(key(src[k]) >> shift) & 0xff] ++;
+        uint32_t sum = 0;
+        for (uint32_t b = 0; b < 256; b ++) {
+            const uint32_t c = offsets[b];
+            offsets[b] = sum;
+            sum += c;
+        }
+        for (uint32_t k = 0; k < count; k ++)
+            dst[offsets[(key(src[k]) >> shift) & 0xff] ++] = src[k];
+        std::swap(src, dst);
+    }
+    // even number of passes, so result is in place already
+}
+
+Movemap::Movemap()
+{
+    this->sorted_count = 0;
+    this->erased_count = 0;
+}
+
+void
+Movemap::clear()
+{
+    this->entries.clear();
+    this->sorted_count = 0;
+    this->erased_count = 0;
+}
+
+void
+Movemap::normalize()
+{
+    if (this->sorted_count == this->entries.size())
+        return;
+
+    // sort appended tail, then merge it with sorted head. Merge is stable, so for every source
+    // block its latest entry goes last
+    std::vector<value_type>::iterator middle = this->entries.begin() + this->sorted_count;
+    radix_sort<value_type>(middle, this->entries.end(), entry_key);
+    std::inplace_merge(this->entries.begin(), middle, this->entries.end(),
+                       compare_by_key<value_type>(entry_key));
+
+    // leave only latest entry for each source, dropping erased ones
+    std::vector<value_type>::iterator out = this->entries.begin();
+    std::vector<value_type>::const_iterator it = this->entries.begin();
+    while (it != this->entries.end()) {
+        std::vector<value_type>::const_iterator next = it + 1;
+        if (next == this->entries.end() || next->first != it->first) {
+            if (ERASED != it->second)
+                *out++ = *it;
+        }
+        it = next;
+    }
+    this->entries.erase(out, this->entries.end());
+    this->sorted_count = this->entries.size();
+    this->erased_count = 0;
+}
+
+std::vector<Movemap::value_type>::const_iterator
+Movemap::lookup(uint32_t from) const
+{
+    assert2 ("movemap is not normalized", this->normalized());
+    std::vector<value_type>::const_iterator it =
+        std::lower_bound(this->entries.begin(), this->entries.end(), value_type(from, 0));
+    if (it == this->entries.end() || it->first != from || ERASED == it->second)
+        return this->entries.end();
+    return it;
+}
+
+uint32_t
+Movemap::size() const
+{
+    assert2 ("movemap is not normalized", this->normalized());
+    return this->entries.size() - this->erased_count;
+}
+
+void
+Movemap::insert(uint32_t from, uint32_t to)
+{
+    assert1 (ERASED != to);
+    this->entries.push_back(value_type(from, to));
+}
+
+uint32_t
+Movemap::count(uint32_t from) const
+{
+    return (this->lookup(from) != this->entries.end()) ? 1 : 0;
+}
+
+Movemap::const_iterator
+Movemap::find(uint32_t from) const
+{
+    return const_iterator(this->lookup(from), this->entries.end());
+}
+
+uint32_t
+Movemap::at(uint32_t from) const
+{
+    std::vector<value_type>::const_iterator it = this->lookup(from);
+    assert2 ("no such block in movemap", it != this->entries.end());
+    return it->second;
+}
+
+void
+Movemap::erase(uint32_t from)
+{
+    this->normalize();
+    std::vector<value_type>::const_iterator it = this->lookup(from);
+    if (it == this->entries.end())
+        return;
+    // entries are not removed from the middle of vector, that would cost O(n) per call.
+    // Just mark them, they are dropped on next normalization
+    this->entries[it - this->entries.begin()].second = ERASED;
+    this->erased_count ++;
+}
+
+int
+Movemap::merge(const Movemap &src)
+{
+    this->normalize();
+    assert2 ("movemap is not normalized", src.normalized());
+
+    std::vector<value_type> merged;
+    merged.reserve(this->entries.size() + src.entries.size());
+    bool overlapped = false;
+    std::vector<value_type>::const_iterator a = this->entries.begin();
+    std::vector<value_type>::const_iterator b = src.entries.begin();
+    while (a != this->entries.end() || b != src.entries.end()) {
+        // skip erased entries on both sides
+        if (a != this->entries.end() && ERASED == a->second) { ++ a; continue; }
+        if (b != src.entries.end() && ERASED == b->second) { ++ b; continue; }
+        if (b == src.entries.end() || (a != this->entries.end() && a->first < b->first)) {
+            merged.push_back(*a++);
+        } else if (a == this->entries.end() || b->first < a->first) {
+            merged.push_back(*b++);
+        } else {
+            // same source block in both maps. Keep destination's one, as std::map::insert do
+            merged.push_back(*a++);
+            ++ b;
+            overlapped = true;
+        }
+    }
+    this->entries.swap(merged);
+    this->sorted_count = this->entries.size();
+    this->erased_count = 0;
+
+    return overlapped ? RFSD_FAIL : RFSD_OK;
+}
+
+bool
+Movemap::targetsUnique() const
+{
+    std::vector<uint32_t> targets;
+    targets.reserve(this->size());
+    for (const_iterator it = this->begin(); it != this->end(); ++ it)
+        targets.push_back(it->second);
+    radix_sort<uint32_t>(targets.begin(), targets.end(), block_key);
+    return std::adjacent_find(targets.begin(), targets.end()) == targets.end();
+}
+
+Movemap::const_iterator
+Movemap::begin() const
+{
+    assert2 ("movemap is not normalized", this->normalized());
+    return const_iterator(this->entries.begin(), this->entries.end());
+}
+
+Movemap::const_iterator
+Movemap::end() const
+{
+    return const_iterator(this->entries.end(), this->entries.end());
+}
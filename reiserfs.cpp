@@ -16,6 +16,22 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+
+/// longest pointer run leaf index keeps, limited by width of ref_run::len (11 bits)
+static const uint32_t REF_RUN_MAX_LEN = (1u << 11) - 1;
+
+static bool
+ref_run_less(const ReiserFs::ref_run &a, const ReiserFs::ref_run &b)
+{
+    return a.start < b.start;
+}
+
+static bool
+leaf_data_span_less(const ReiserFs::leaf_data_span &a, const ReiserFs::leaf_data_span &b)
+{
+    return a.leaf < b.leaf;
+}
 
 void
 assert_failfunc1(const std::string &expr, const std::string &filename, int lineno)
@@ -42,12 +58,30 @@ assert_failfunc_s(const std::string &msg, const std::string &filename, int linen
     throw std::logic_error(ss.str());
 }
 
-ReiserFs::ReiserFs()
+ReiserFs::ReiserFs() : cursor(*this)
 {
     this->closed = true;
+    this->read_only = false;
     this->use_data_journaling = false;
     this->leaf_index_granularity = 2000;
     this->cache_size = 200;
+    this->io_streams = 1;
+    this->leaf_index_ready = false;
+    this->tree_generation = 0;
+    this->free_extents_held = false;
+    this->object_catalog_ready = false;
+    this->setThreadCount(0);
+}
+
+void
+ReiserFs::setThreadCount(uint32_t count)
+{
+    if (0 == count) {
+        // leaf scan waits for disk mostly, so use some threads even on single CPU
+        const long cpu_count = ::sysconf(_SC_NPROCESSORS_ONLN);
+        count = std::max(4L, std::min(16L, cpu_count));
+    }
+    this->thread_count = count;
 }
 
 ReiserFs::~ReiserFs()
@@ -140,10 +174,13 @@ ReiserFs::validateSuperblock()
 }
 
 int
-ReiserFs::open(const std::string &name, bool o_sync)
+ReiserFs::open(const std::string &name, bool o_sync, bool read_only)
 {
     this->fname = name;
-    if (o_sync) {
+    this->read_only = read_only;
+    if (read_only) {
+        fd = ::open(name.c_str(), O_RDONLY | O_LARGEFILE);
+    } else if (o_sync) {
         fd = ::open(name.c_str(), O_RDWR | O_SYNC | O_LARGEFILE);
     } else {
         fd = ::open(name.c_str(), O_RDWR | O_LARGEFILE);
@@ -168,22 +205,36 @@ ReiserFs::open(const std::string &name, bool o_sync)
     }
     this->journal = new FsJournal(this->fd, &this->sb);
     this->journal->setCacheSize(this->cache_size);
+    this->tree_generation ++;   // forget paths into previously opened tree
+    // marking fs dirty below changes journal header, so remember state before that
+    this->getIndexStamp(this->open_stamp);
     this->bitmap = new FsBitmap(this->journal, &this->sb);
     this->closed = false;
     this->bitmap->setAGSize(AG_SIZE_128M);
+    this->journal->setIOStreams(this->io_streams, AG_SIZE_128M);
 
     // initialize sealed AG list
     this->sealed_ags.clear();
     this->sealed_ags.resize(this->bitmap->AGCount(), false);
 
     // mark fs dirty
-    this->sb.s_umount_state = UMOUNT_STATE_DIRTY;
-    this->journal->beginTransaction();
-    this->writeSuperblock();
-    this->journal->commitTransaction();
+    if (not read_only) {
+        this->sb.s_umount_state = UMOUNT_STATE_DIRTY;
+        this->journal->beginTransaction();
+        this->writeSuperblock();
+        this->journal->commitTransaction();
+    }
 
+    this->leaf_index_ready = false;
+    this->object_catalog.clear();
+    this->object_catalog_ready = false;
+    if (not this->index_cache_file.empty() and RFSD_OK == this->loadLeafIndex(this->open_stamp)) {
+        this->leaf_index_ready = true;
+        return RFSD_OK;
+    }
     if (RFSD_FAIL == this->createLeafIndex())
         return RFSD_FAIL;
+    this->leaf_index_ready = true;
 
     return RFSD_OK;
 }
@@ -260,10 +311,20 @@ ReiserFs::close()
     if (this->closed)   // don't do anything if fs already closed
         return;
     // clean fs dirty flag
-    this->sb.s_umount_state = UMOUNT_STATE_CLEAN;
-    this->journal->beginTransaction();
-    this->writeSuperblock();
-    this->journal->commitTransaction();
+    if (not this->read_only) {
+        this->sb.s_umount_state = UMOUNT_STATE_CLEAN;
+        this->journal->beginTransaction();
+        this->writeSuperblock();
+        this->journal->commitTransaction();
+    }
+
+    if (not this->index_cache_file.empty() and this->leaf_index_ready) {
+        // index must be saved with journal state as it will be on disk
+        this->journal->flushTransactionCache();
+        if (RFSD_OK != this->saveLeafIndex())
+            std::cout << "warning: can't save leaf index to `" << this->index_cache_file << "'"
+                << std::endl;
+    }
 
     // FsBitmap deletes its blocks itself, so if FsJournal desctructor will be called later
     // that FsBitmap's one, there can be case when block_cache have bitmap blocks, which
@@ -278,58 +339,146 @@ ReiserFs::close()
 void
 ReiserFs::cleanupRegionMoveDataDown(uint32_t from, uint32_t to)
 {
-    std::vector<uint32_t> leaves;
-    this->getLeavesForBlockRange(leaves, from, to);
+    // data blocks go first, in order of pointers that refer them. That way files which were
+    // contiguous stay contiguous
+    std::vector<data_move> data_moves;
+    this->getDataRefsForBlockRange(data_moves, from, to);
+    std::sort(data_moves.begin(), data_moves.end());
 
-    // move unformatted
     uint32_t free_idx = this->findFreeBlockAfter(to);
     assert1 (free_idx != 0);
     movemap_t movemap;
-    std::set<Block::key_t> key_list;
-    for (uint32_t k = 0; k < leaves.size(); k ++) {
-        uint32_t leaf_idx = leaves[k];
-        Block *block_obj = this->journal->readBlock(leaf_idx);
-        block_obj->checkLeafNode();
-        movemap.clear();
-        key_list.clear();
-        for (uint32_t item_idx = 0; item_idx < block_obj->itemCount(); item_idx ++) {
-            const Block::item_header &ih = block_obj->itemHeader(item_idx);
-            if (KEY_TYPE_INDIRECT != ih.type())
-                continue;
-            bool use_key = false;
-            for (uint32_t idx = 0; idx < ih.length/4; idx ++) {
-                uint32_t child_idx = block_obj->indirectItemRef(ih, idx);
-                if (0 == child_idx)     // sparse file
-                    continue;
-                if (from <= child_idx && child_idx <= to) {
-                    movemap[child_idx] = free_idx;
-                    free_idx = this->findFreeBlockAfter(free_idx);
-                    assert1 (free_idx != 0);
-                    use_key = true;
-                }
-            }
-            if (use_key) {
-                key_list.insert(ih.key);
-            }
-        }
-        this->journal->releaseBlock(block_obj);
-        this->leafContentMoveUnformatted(leaf_idx, movemap, key_list);
-        assert2 ("something left in movemap", movemap.size() == 0);
+    movemap.reserve(to - from + 1);
+    std::vector<uint32_t> data_blocks;
+    data_blocks.reserve(data_moves.size());
+    for (std::vector<data_move>::const_iterator it = data_moves.begin();
+         it != data_moves.end(); ++ it)
+    {
+        movemap.insert(it->from, free_idx);
+        data_blocks.push_back(it->from);
+        free_idx = this->findFreeBlockAfter(free_idx);
+        assert1 (free_idx != 0);
     }
+    std::sort(data_blocks.begin(), data_blocks.end());
 
-    // now, when unformatted blocks moved, time to move tree nodes
-    // create movemap
-    movemap.clear();
+    // then tree nodes, which are all the rest used blocks in region
     for (uint32_t c_idx = from; c_idx <= to; c_idx ++) {
         if (this->bitmap->blockReserved(c_idx)) continue;
         if (not this->bitmap->blockUsed(c_idx)) continue;
-        movemap[c_idx] = free_idx;
+        if (std::binary_search(data_blocks.begin(), data_blocks.end(), c_idx)) continue;
+        movemap.insert(c_idx, free_idx);
         free_idx = this->findFreeBlockAfter(free_idx);
         assert1 (free_idx != 0);
     }
-    this->moveBlocks(movemap); // will move only tree nodes, should be fast
-    this->journal->flushTransactionCache();
-    this->updateLeafIndex();
+    this->moveBlocks(movemap);
+}
+
+/// leaf scan does not start new thread for less than that many leaves
+static const uint32_t LEAF_SCAN_MIN_SHARE = 256;
+/// how often progress of leaf scan is updated, in microseconds
+static const uint32_t LEAF_SCAN_POLL_INTERVAL = 50000;
+
+/// part of leaf list scanned by one thread, and partial leaf index it builds
+struct leaf_scan_task {
+    int fd;
+    uint32_t granularity;
+    uint32_t block_count;
+    std::vector<uint32_t>::const_iterator first;    //< leaves to scan, in disk order
+    std::vector<uint32_t>::const_iterator last;
+    uint32_t *leaves_done;          //< shared counters, updated atomically
+    uint32_t *workers_finished;
+    pthread_t thread;
+    bool started;                   //< whether separate thread was started for the task
+    std::vector<ReiserFs::ref_run> runs;
+    std::vector<ReiserFs::basket_link> links;
+    std::vector<uint64_t> objects;  //< objects having items in scanned leaves
+    std::vector<std::pair<uint64_t, uint32_t> > times;  //< (object, access time) from stat items
+    std::string error;
+};
+
+/// reads leaves directly from disk, bypassing block cache which is not thread-safe.
+/// Leaf index is built right after open, so disk content is current
+static void *
+leaf_scan_worker(void *arg)
+{
+    leaf_scan_task *task = static_cast<leaf_scan_task *>(arg);
+    Block *block_obj = new Block();
+    BlockFilter nonzero_filter;     // zero pointers are sparse file holes
+    nonzero_filter.setRange(1, task->block_count - 1);
+    std::vector<uint32_t> baskets_of_leaf;
+
+    try {
+        for (std::vector<uint32_t>::const_iterator leaf = task->first; leaf != task->last;
+             ++ leaf)
+        {
+            if (ReiserFs::userAskedForTermination())
+                break;
+            block_obj->block = *leaf;
+            readBufAt(task->fd, *leaf, block_obj->buf, BLOCKSIZE);
+            block_obj->checkLeafNode();
+            // runs of this leaf go to different baskets, track run being extended separately
+            // for each item
+            baskets_of_leaf.clear();
+            for (uint32_t k = 0; k < block_obj->itemCount(); k ++) {
+                const struct Block::item_header &ih = block_obj->itemHeader(k);
+                const uint64_t obj = ih.key.normalized().hi;
+                if (task->objects.empty() or task->objects.back() != obj)
+                    task->objects.push_back(obj);
+                if (KEY_TYPE_STAT == ih.type()) {
+                    Block::stat_info info;
+                    block_obj->statItemInfo(ih, info);
+                    task->times.push_back(std::make_pair(obj, std::max(info.atime, info.mtime)));
+                }
+                // indirect items contain links to unformatted (data) blocks
+                if (KEY_TYPE_INDIRECT != ih.type())
+                    continue;
+                const uint32_t *refs = block_obj->indirectItemRefs(ih);
+                const uint32_t ref_count = ih.length / 4;
+                ReiserFs::ref_run *last_run = NULL;
+                for (uint32_t idx = nonzero_filter.nextCandidate(refs, ref_count, 0);
+                     idx < ref_count; idx = nonzero_filter.nextCandidate(refs, ref_count, idx + 1))
+                {
+                    const uint32_t child_idx = refs[idx];
+                    const uint32_t basket_id = child_idx / task->granularity;
+                    // neighbouring pointers usually continue previous run
+                    if (last_run and last_run->len < REF_RUN_MAX_LEN
+                        and last_run->start + last_run->len == child_idx
+                        and static_cast<uint32_t>(last_run->pos) + last_run->len == idx
+                        and last_run->start / task->granularity == basket_id)
+                    {
+                        last_run->len ++;
+                        continue;
+                    }
+                    ReiserFs::ref_run run;
+                    run.start = child_idx;
+                    run.leaf = *leaf;
+                    run.len = 1;
+                    run.item = k;
+                    run.pos = idx;
+                    task->runs.push_back(run);
+                    last_run = &task->runs.back();
+                    baskets_of_leaf.push_back(basket_id);
+                }
+            }
+            std::sort(baskets_of_leaf.begin(), baskets_of_leaf.end());
+            baskets_of_leaf.erase(std::unique(baskets_of_leaf.begin(), baskets_of_leaf.end()),
+                                  baskets_of_leaf.end());
+            for (std::vector<uint32_t>::const_iterator it = baskets_of_leaf.begin();
+                 it != baskets_of_leaf.end(); ++ it)
+            {
+                ReiserFs::basket_link link;
+                link.leaf = *leaf;
+                link.basket = *it;
+                task->links.push_back(link);
+            }
+            __sync_fetch_and_add(task->leaves_done, 1);
+        }
+    } catch (std::logic_error &e) {
+        task->error = e.what();
+    }
+    delete block_obj;
+    __sync_fetch_and_add(task->workers_finished, 1);
+    return NULL;
 }
 
 int
@@ -337,41 +486,135 @@ ReiserFs::createLeafIndex()
 {
     uint32_t basket_count = (this->sizeInBlocks() - 1) / this->leaf_index_granularity + 1;
     this->leaf_index.clear();
+    this->leaf_baskets.clear();
+    this->node_index.clear();
+    std::vector<TreeWalker::node> nodes;
+    this->walkTree(nodes);
+    std::vector<node_entry> node_entries;
+    node_entries.reserve(nodes.size());
+    for (std::vector<TreeWalker::node>::const_iterator it = nodes.begin(); it != nodes.end();
+         ++ it)
+    {
+        node_entry entry;
+        entry.block = it->block;
+        entry.link.parent = it->parent;
+        entry.link.slot = it->slot;
+        entry.link.level = it->level;
+        node_entries.push_back(entry);
+    }
+    std::vector<TreeWalker::node>().swap(nodes);
+    this->node_index.assign(node_entries);
     this->leaf_index.resize (basket_count);
 
-    std::vector<tree_element> tree;
-    recursivelyEnumerateNodes(this->sb.s_root_block, tree, false);
+    // node index is ordered by block number, so leaves are read in disk order
+    std::vector<uint32_t> leaves;
+    const std::vector<node_entry> &all_nodes = this->node_index.items();
+    for (std::vector<node_entry>::const_iterator it = all_nodes.begin(); it != all_nodes.end();
+         ++ it)
+    {
+        if (TREE_LEVEL_LEAF == it->link.level)
+            leaves.push_back(it->block);
+    }
 
-    Progress progress(tree.size());
+    Progress progress(leaves.size());
     progress.setName("[leaf index]");
 
-    for (std::vector<tree_element>::iterator it = tree.begin(); it != tree.end(); ++ it) {
-        progress.inc();
-        if (it->type != BLOCKTYPE_LEAF)
-            continue;
-        Block *block_obj = this->journal->readBlock(it->idx, false);
-        block_obj->checkLeafNode();
-        for (uint32_t k = 0; k < block_obj->itemCount(); k ++) {
-            const struct Block::item_header &ih = block_obj->itemHeader(k);
-            // indirect items contain links to unformatted (data) blocks
-            if (KEY_TYPE_INDIRECT != ih.type())
-                continue;
-            for (int idx = 0; idx < ih.length/4; idx ++) {
-                uint32_t child_idx = block_obj->indirectItemRef(ih, idx);
-                if (0 == child_idx)     // sparse file
-                    continue;
-                uint32_t basket_id = child_idx / this->leaf_index_granularity;
-                this->leaf_index[basket_id].leaves.insert(it->idx);
-            }
-        }
-        this->journal->releaseBlock(block_obj);
-        if (ReiserFs::userAskedForTermination()) {
+    // every worker gets contiguous part of leaf list, so reads of each one stay sequential
+    const uint32_t worker_count =
+        std::max(1u, std::min<uint32_t>(this->thread_count, leaves.size() / LEAF_SCAN_MIN_SHARE));
+    std::vector<leaf_scan_task> tasks(worker_count);
+    uint32_t leaves_done = 0;
+    uint32_t workers_finished = 0;
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        leaf_scan_task &task = tasks[k];
+        task.fd = this->fd;
+        task.granularity = this->leaf_index_granularity;
+        task.block_count = this->sizeInBlocks();
+        task.first = leaves.begin() + static_cast<uint64_t>(leaves.size()) * k / worker_count;
+        task.last = leaves.begin() + static_cast<uint64_t>(leaves.size()) * (k + 1) / worker_count;
+        task.leaves_done = &leaves_done;
+        task.workers_finished = &workers_finished;
+        task.started = (0 == pthread_create(&task.thread, NULL, leaf_scan_worker, &task));
+    }
+    // if thread can't be created, scan its part here
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (not tasks[k].started)
+            leaf_scan_worker(&tasks[k]);
+    }
+    while (__sync_fetch_and_add(&workers_finished, 0) < worker_count) {
+        progress.update(__sync_fetch_and_add(&leaves_done, 0));
+        ::usleep(LEAF_SCAN_POLL_INTERVAL);
+    }
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (tasks[k].started)
+            pthread_join(tasks[k].thread, NULL);
+    }
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (not tasks[k].error.empty()) {
             progress.abort();
-            return RFSD_FAIL;
+            throw std::logic_error(tasks[k].error);
         }
     }
+    if (ReiserFs::userAskedForTermination()) {
+        progress.abort();
+        return RFSD_FAIL;
+    }
+
+    // merge partial indices. Tasks cover ascending ranges of leaves, so leaf lists are
+    // built by appending. Objects are not ordered by leaf position, they need sorting
+    std::vector<uint64_t> objs;
+    std::vector<std::pair<uint64_t, uint32_t> > times;
+    std::vector<basket_link> links;
+    for (std::vector<leaf_scan_task>::iterator task = tasks.begin(); task != tasks.end(); ++ task)
+    {
+        for (std::vector<ref_run>::const_iterator it = task->runs.begin();
+             it != task->runs.end(); ++ it)
+        {
+            this->leaf_index[it->start / this->leaf_index_granularity].runs.push_back(*it);
+        }
+        std::vector<ref_run>().swap(task->runs);
+        objs.insert(objs.end(), task->objects.begin(), task->objects.end());
+        std::vector<uint64_t>().swap(task->objects);
+        times.insert(times.end(), task->times.begin(), task->times.end());
+        std::vector<std::pair<uint64_t, uint32_t> >().swap(task->times);
+        for (std::vector<basket_link>::const_iterator it = task->links.begin();
+             it != task->links.end(); ++ it)
+        {
+            this->leaf_index[it->basket].leaves.insert(it->leaf);
+        }
+        links.insert(links.end(), task->links.begin(), task->links.end());
+        std::vector<basket_link>().swap(task->links);
+    }
+    this->leaf_baskets.assign(links);
+
+    std::sort(objs.begin(), objs.end());
+    objs.erase(std::unique(objs.begin(), objs.end()), objs.end());
+    this->setObjectCatalog(objs);
+    this->setObjectTimes(times);
 
     progress.show100();
+
+    uint64_t ref_count = 0;
+    uint64_t run_count = 0;
+    uint64_t memory_used = this->leaf_index.capacity() * sizeof(leaf_index_entry);
+    for (std::vector<leaf_index_entry>::iterator it = this->leaf_index.begin();
+         it != this->leaf_index.end(); ++ it)
+    {
+        // runs are ordered by leaf, not by data block
+        std::sort(it->runs.begin(), it->runs.end(), ref_run_less);
+        std::vector<ref_run>(it->runs.begin(), it->runs.end()).swap(it->runs);
+        ref_count += it->leaves.size();
+        run_count += it->runs.size();
+        memory_used += it->leaves.memoryUsage() + it->runs.capacity() * sizeof(ref_run);
+    }
+    memory_used += this->leaf_baskets.memoryUsage();
+    memory_used += this->node_index.memoryUsage();
+    memory_used += this->object_catalog.capacity() * sizeof(catalog_entry);
+    std::cout << "leaf index: " << ref_count << " references in " << this->leaf_index.size()
+        << " baskets, " << run_count << " pointer runs, " << this->node_index.size()
+        << " tree nodes, " << this->object_catalog.size() << " objects, "
+        << (memory_used + 1023) / 1024
+        << " KiB" << std::endl;
     return RFSD_OK;
 }
 
@@ -382,40 +625,210 @@ ReiserFs::updateLeafIndex()
         leaf_index_entry &basket = this->leaf_index[basket_id];
         if (not basket.changed)
             continue;
-        std::set<uint32_t>::iterator leaf_iter = basket.leaves.begin();
-        while (leaf_iter != basket.leaves.end()) {
-            uint32_t block_idx = *leaf_iter;
-            Block *block_obj = this->journal->readBlock(block_idx, false);
-            block_obj->checkLeafNode();
-            bool leaf_has_link = false;
-            for (uint32_t item_id = 0; item_id < block_obj->itemCount(); item_id ++) {
-                const struct Block::item_header &ih = block_obj->itemHeader(item_id);
-                if (KEY_TYPE_INDIRECT != ih.type())
-                    continue;
-                for (int idx = 0; idx < ih.length/4; idx ++) {
-                    uint32_t target_idx = block_obj->indirectItemRef(ih, idx);
-                    if (0 == target_idx)        // sparse file
-                        continue;
-                    uint32_t target_basket = target_idx / this->leaf_index_granularity;
-                    if (target_basket == basket_id) {
-                        leaf_has_link = true;
-                        break;
-                    }
-                }
-                if (leaf_has_link) break;
-            }
-            this->journal->releaseBlock(block_obj);
-            if (not leaf_has_link) basket.leaves.erase(leaf_iter ++);
-            else ++leaf_iter;
+        std::vector<uint32_t> leaves;
+        for (std::vector<ref_run>::const_iterator it = basket.runs.begin();
+             it != basket.runs.end(); ++ it)
+        {
+            leaves.push_back(it->leaf);
+        }
+        std::sort(leaves.begin(), leaves.end());
+        leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+        // leaves that no longer point to this basket lose their reverse link
+        const std::vector<uint32_t> &old_leaves = basket.leaves.items();
+        std::vector<uint32_t> gone_leaves;
+        std::set_difference(old_leaves.begin(), old_leaves.end(), leaves.begin(), leaves.end(),
+                            std::back_inserter(gone_leaves));
+        for (std::vector<uint32_t>::const_iterator it = gone_leaves.begin();
+             it != gone_leaves.end(); ++ it)
+        {
+            this->unlinkLeafFromBasket(*it, basket_id);
         }
+
+        basket.leaves.assign(leaves);
         basket.changed = false;
     }
 }
 
+void
+ReiserFs::linkLeafToBasket(uint32_t leaf_idx, uint32_t basket_id)
+{
+    basket_link link;
+    link.leaf = leaf_idx;
+    link.basket = basket_id;
+    this->leaf_baskets.insert(link);
+}
+
+void
+ReiserFs::unlinkLeafFromBasket(uint32_t leaf_idx, uint32_t basket_id)
+{
+    basket_link link;
+    link.leaf = leaf_idx;
+    link.basket = basket_id;
+    this->leaf_baskets.erase(link.key());
+}
+
+bool
+ReiserFs::findDataRef(uint32_t block_idx, data_ref &ref) const
+{
+    const std::vector<ref_run> &runs =
+        this->leaf_index[block_idx / this->leaf_index_granularity].runs;
+    ref_run key;
+    key.start = block_idx;
+    std::vector<ref_run>::const_iterator it =
+        std::upper_bound(runs.begin(), runs.end(), key, ref_run_less);
+    if (it == runs.begin())
+        return false;
+    -- it;
+    if (block_idx >= it->start + it->len)
+        return false;
+    ref.leaf = it->leaf;
+    ref.item = it->item;
+    ref.pos = it->pos + (block_idx - it->start);
+    return true;
+}
+
+void
+ReiserFs::removeDataRef(uint32_t block_idx)
+{
+    leaf_index_entry &basket = this->leaf_index[block_idx / this->leaf_index_granularity];
+    ref_run key;
+    key.start = block_idx;
+    std::vector<ref_run>::iterator it =
+        std::upper_bound(basket.runs.begin(), basket.runs.end(), key, ref_run_less);
+    assert2 ("block is not in leaf index", it != basket.runs.begin());
+    -- it;
+    assert2 ("block is not in leaf index", block_idx < it->start + it->len);
+
+    const uint32_t offset = block_idx - it->start;
+    if (1 == it->len) {
+        basket.runs.erase(it);
+    } else if (0 == offset) {
+        it->start ++;
+        it->pos ++;
+        it->len --;
+    } else if (static_cast<uint32_t>(it->len) - 1 == offset) {
+        it->len --;
+    } else {
+        // block is in the middle of run, split it in two
+        ref_run tail = *it;
+        tail.start = block_idx + 1;
+        tail.pos = it->pos + offset + 1;
+        tail.len = it->len - offset - 1;
+        it->len = offset;
+        basket.runs.insert(it + 1, tail);
+    }
+    basket.changed = true;
+}
+
+void
+ReiserFs::addDataRef(uint32_t block_idx, const data_ref &ref)
+{
+    leaf_index_entry &basket = this->leaf_index[block_idx / this->leaf_index_granularity];
+    ref_run key;
+    key.start = block_idx;
+    std::vector<ref_run>::iterator next =
+        std::upper_bound(basket.runs.begin(), basket.runs.end(), key, ref_run_less);
+    basket.leaves.insert(ref.leaf);
+    this->linkLeafToBasket(ref.leaf, block_idx / this->leaf_index_granularity);
+
+    // try to extend previous run
+    if (next != basket.runs.begin()) {
+        std::vector<ref_run>::iterator prev = next - 1;
+        assert2 ("block is in leaf index already", block_idx >= prev->start + prev->len);
+        if (prev->leaf == ref.leaf && prev->item == ref.item && prev->len < REF_RUN_MAX_LEN
+            && prev->start + prev->len == block_idx
+            && static_cast<uint32_t>(prev->pos) + prev->len == ref.pos)
+        {
+            prev->len ++;
+            // now it may touch next one
+            if (next != basket.runs.end() && next->leaf == ref.leaf && next->item == ref.item
+                && next->start == block_idx + 1 && next->pos == ref.pos + 1
+                && static_cast<uint32_t>(prev->len) + next->len <= REF_RUN_MAX_LEN)
+            {
+                prev->len += next->len;
+                basket.runs.erase(next);
+            }
+            return;
+        }
+    }
+    // try to extend next run backwards
+    if (next != basket.runs.end() && next->leaf == ref.leaf && next->item == ref.item
+        && next->start == block_idx + 1 && next->pos == ref.pos + 1 && next->len < REF_RUN_MAX_LEN)
+    {
+        next->start --;
+        next->pos --;
+        next->len ++;
+        return;
+    }
+
+    ref_run run;
+    run.start = block_idx;
+    run.leaf = ref.leaf;
+    run.len = 1;
+    run.item = ref.item;
+    run.pos = ref.pos;
+    basket.runs.insert(next, run);
+}
+
+void
+ReiserFs::renameLeafInIndex(uint32_t old_idx, uint32_t new_idx)
+{
+    std::vector<basket_link> links;
+    const uint64_t first_key = static_cast<uint64_t>(old_idx) << 32;
+    this->leaf_baskets.collect(first_key, first_key | 0xffffffffu, links);
+    if (links.empty())
+        return;     // leaf has no pointers to data blocks
+
+    // visit only baskets this leaf points to
+    for (std::vector<basket_link>::iterator b_it = links.begin(); b_it != links.end(); ++ b_it)
+    {
+        this->leaf_baskets.erase(b_it->key());
+        b_it->leaf = new_idx;
+        this->leaf_baskets.insert(*b_it);
+        leaf_index_entry &basket = this->leaf_index[b_it->basket];
+        basket.leaves.replace(old_idx, new_idx);
+        for (std::vector<ref_run>::iterator it = basket.runs.begin(); it != basket.runs.end();
+             ++ it)
+        {
+            if (it->leaf == old_idx)
+                it->leaf = new_idx;
+        }
+    }
+}
+
+void
+ReiserFs::getDataRefsForBlockRange(std::vector<data_move> &refs, uint32_t from, uint32_t to)
+{
+    refs.clear();
+    to = std::min(to, this->sizeInBlocks() - 1);
+    if (from > to)
+        return;
+    for (uint32_t basket_id = from / this->leaf_index_granularity;
+         basket_id <= to / this->leaf_index_granularity; basket_id ++)
+    {
+        const std::vector<ref_run> &runs = this->leaf_index[basket_id].runs;
+        for (std::vector<ref_run>::const_iterator it = runs.begin(); it != runs.end(); ++ it) {
+            const uint32_t run_from = std::max(from, it->start);
+            const uint32_t run_to = std::min(to, it->start + it->len - 1);
+            for (uint32_t block_idx = run_from; block_idx <= run_to && run_from <= run_to;
+                 block_idx ++)
+            {
+                data_move dm;
+                dm.from = block_idx;
+                dm.to = 0;
+                dm.ref.leaf = it->leaf;
+                dm.ref.item = it->item;
+                dm.ref.pos = it->pos + (block_idx - it->start);
+                refs.push_back(dm);
+            }
+        }
+    }
+}
+
 bool
 ReiserFs::movemapConsistent(const movemap_t &movemap)
 {
-    movemap_t revmap;
     movemap_t::const_iterator mapiter;
 
     // last journal block is journal header block, its length is one
@@ -464,12 +877,9 @@ ReiserFs::movemapConsistent(const movemap_t &movemap)
             err_string = "some 'to' blocks map beyound filesystem limits";
             return false;
         }
-
-        // build inverse transform
-        revmap[mapiter->second] = mapiter->first;
     }
     // check for singularity
-    if (revmap.size() != movemap.size()) {
+    if (not movemap.targetsUnique()) {
         err_string = "movemap degenerate";
         return false;
     }
@@ -479,6 +889,7 @@ ReiserFs::movemapConsistent(const movemap_t &movemap)
 uint32_t
 ReiserFs::moveBlocks(movemap_t &movemap)
 {
+    movemap.normalize();
     if (0 == movemap.size())
         return 0;
 
@@ -490,39 +901,92 @@ ReiserFs::moveBlocks(movemap_t &movemap)
     this->blocks_moved_formatted = 0;
     this->blocks_moved_unformatted = 0;
 
-    std::vector<uint32_t> leaves;
-    std::set<Block::key_t> stub_empty_list;
-    this->getLeavesForMovemap(leaves, movemap);
-
-    for (std::vector<uint32_t>::const_iterator it = leaves.begin(); it != leaves.end(); ++ it) {
-        uint32_t leaf_idx = *it;
-        // move items with all keys from specific leaf
-        this->leafContentMoveUnformatted(leaf_idx, movemap, stub_empty_list, true);
+    // unformatted blocks. Leaf index tells exactly where pointer to each of them is, so
+    // group them by leaf and visit each leaf once
+    std::vector<data_move> data_moves;
+    for (movemap_t::const_iterator it = movemap.begin(); it != movemap.end(); ++ it) {
+        data_move dm;
+        if (not this->findDataRef(it->first, dm.ref))
+            continue;       // tree node, moved below
+        dm.from = it->first;
+        dm.to = it->second;
+        data_moves.push_back(dm);
     }
-
-    // tree nodes
-    uint32_t tree_height = this->estimateTreeHeight();  // estimate tree height
-    // move internal nodes, from layer 2 to sb.s_tree_height
-    for (uint32_t t_level = TREE_LEVEL_LEAF + 1; t_level <= tree_height; t_level ++)
+    std::sort(data_moves.begin(), data_moves.end());
+
+    std::vector<data_move>::const_iterator group_start = data_moves.begin();
+    while (group_start != data_moves.end()) {
+        std::vector<data_move>::const_iterator group_end = group_start;
+        while (group_end != data_moves.end() && group_end->ref.leaf == group_start->ref.leaf)
+            ++ group_end;
+        this->leafContentMoveUnformatted(group_start->ref.leaf, group_start, group_end);
+        group_start = group_end;
+    }
+    for (std::vector<data_move>::const_iterator it = data_moves.begin();
+         it != data_moves.end(); ++ it)
     {
-        this->recursivelyMoveInternalNodes(this->sb.s_root_block, movemap, t_level);
+        movemap.erase(it->from);
     }
 
-    // previous call moves all but root_block, move it if necessary
-    if (movemap.count(this->sb.s_root_block)) {
-        uint32_t old_root_block_idx = this->sb.s_root_block;
-        this->journal->beginTransaction();
-        // move root block itself
-        this->journal->moveRawBlock(this->sb.s_root_block, movemap[this->sb.s_root_block]);
-        // update bitmap
-        this->bitmap->markBlockFree(this->sb.s_root_block);
-        this->bitmap->markBlockUsed(movemap[this->sb.s_root_block]);
-        // update s_root_block field in superblock and write it down through journal
-        this->sb.s_root_block = movemap[this->sb.s_root_block];
-        this->writeSuperblock();
-        this->bitmap->writeChangedBitmapBlocks();
-        this->journal->commitTransaction();
-        movemap.erase(old_root_block_idx);
+    // tree nodes. Node index tells parent of each, so only parents of moved nodes are
+    // visited. Lower levels go first: parent's pointers get updated before parent moves itself
+    std::vector<node_move> node_moves;
+    for (movemap_t::const_iterator it = movemap.begin(); it != movemap.end(); ++ it) {
+        const node_entry *entry = this->node_index.find(it->first);
+        if (NULL == entry)
+            continue;       // not a tree node. It's left in movemap, assert below catches that
+        node_move nm;
+        nm.from = it->first;
+        nm.to = it->second;
+        nm.link = entry->link;
+        node_moves.push_back(nm);
+    }
+    std::sort(node_moves.begin(), node_moves.end());
+    if (not node_moves.empty())
+        this->tree_generation ++;   // tree cursor paths become stale
+
+    std::vector<node_move>::const_iterator node_group = node_moves.begin();
+    while (node_group != node_moves.end()) {
+        std::vector<node_move>::const_iterator node_group_end = node_group;
+        while (node_group_end != node_moves.end()
+               && node_group_end->link.level == node_group->link.level
+               && node_group_end->link.parent == node_group->link.parent)
+        {
+            ++ node_group_end;
+        }
+        if (0 != node_group->link.parent) {
+            this->moveChildNodes(node_group->link.parent, node_group, node_group_end);
+        } else {
+            // root block, it has no parent but superblock
+            assert1 (node_group->from == this->sb.s_root_block);
+            std::vector<uint32_t> children;
+            if (node_group->link.level > TREE_LEVEL_LEAF)
+                this->getChildNodes(node_group->from, children);
+            this->journal->beginTransaction();
+            // move root block itself
+            this->journal->moveRawBlock(node_group->from, node_group->to);
+            this->blocks_moved_formatted ++;
+            // update bitmap
+            this->bitmap->markBlockFree(node_group->from);
+            this->bitmap->markBlockUsed(node_group->to);
+            // update s_root_block field in superblock and write it down through journal
+            this->sb.s_root_block = node_group->to;
+            this->relinkNode(node_group->from, node_group->to, children);
+            // root may be the only leaf
+            if (TREE_LEVEL_LEAF == node_group->link.level) {
+                this->renameLeafInIndex(node_group->from, node_group->to);
+                this->markLeafObjectsDirty(node_group->to);
+            }
+            this->writeSuperblock();
+            this->bitmap->writeChangedBitmapBlocks();
+            this->journal->commitTransaction();
+        }
+        node_group = node_group_end;
+    }
+    for (std::vector<node_move>::const_iterator it = node_moves.begin();
+         it != node_moves.end(); ++ it)
+    {
+        movemap.erase(it->from);
     }
     assert2 ("movemap should be empty after moveBlocks()", movemap.size() == 0);
 
@@ -531,11 +995,20 @@ ReiserFs::moveBlocks(movemap_t &movemap)
     // wipe obsolete entries out of leaf index
     this->updateLeafIndex();
     // rescan changed allocation groups
-    this->bitmap->updateAGFreeExtents();
+    if (not this->free_extents_held)
+        this->bitmap->updateAGFreeExtents();
 
     return (this->blocks_moved_unformatted + this->blocks_moved_formatted);
 }
 
+void
+ReiserFs::holdFreeExtents(bool hold)
+{
+    this->free_extents_held = hold;
+    if (not hold)
+        this->bitmap->updateAGFreeExtents();
+}
+
 Block*
 ReiserFs::readBlock(uint32_t block) const
 {
@@ -550,190 +1023,119 @@ ReiserFs::releaseBlock(Block *block) const
     journal->releaseBlock(block);
 }
 
-uint32_t
-ReiserFs::estimateTreeHeight()
-{
-    Block *block_obj = this->journal->readBlock(this->sb.s_root_block);
-    uint32_t root_block_level = block_obj->level();
-    if (TREE_LEVEL_LEAF == root_block_level) block_obj->checkLeafNode();
-    else block_obj->checkInternalNode();
-
-    this->journal->releaseBlock(block_obj);
-    return root_block_level;
-}
-
-/// \brief moves internal nodes and leaves
 void
-ReiserFs::recursivelyMoveInternalNodes(uint32_t block_idx, movemap_t &movemap,
-    uint32_t target_level)
-{
-    /* we reach node on target_level (>=2), move nodes which it refers (as
-    raw data),  and update  pointers in that node.  That form  a complete
-    transaction. No internal node could have move than (4096-24-8)/(16+8)+1 =
-    = 170 pointers, so transaction will have at most 170+1 blocks plus affected
-    bitmap blocks. In worst case every block can change one bitmap, thus
-    resulting in 171 bitmap blocks. So upper bound on transaction size is
-    342 blocks, which is smaller than default 1024-block max transaction size.
+ReiserFs::moveChildNodes(uint32_t parent_idx, std::vector<node_move>::const_iterator first,
+                         std::vector<node_move>::const_iterator last)
+{
+    /* move nodes which parent refers (as raw data), and update pointers in parent.
+    That form  a complete transaction. No internal node could have move than
+    (4096-24-8)/(16+8)+1 = 170 pointers, so transaction will have at most 170+1 blocks
+    plus affected bitmap blocks. In worst case every block can change one bitmap, thus
+    resulting in 171 bitmap blocks. So upper bound on transaction size is 342 blocks,
+    which is smaller than default 1024-block max transaction size.
     */
-    Block *block_obj = this->journal->readBlock(block_idx);
+    Block *block_obj = this->journal->readBlock(parent_idx);
     block_obj->checkInternalNode();
-    uint32_t level = block_obj->level();
-
-    if (level > target_level) {
-        // if we are not on target_level, go deeper
-        for (uint32_t k = 0; k < block_obj->ptrCount(); k ++ ) {
-            uint32_t child_idx = block_obj->ptr(k).block;
-            this->recursivelyMoveInternalNodes(child_idx, movemap, target_level);
+    this->journal->beginTransaction();
+    std::vector<uint32_t> children;
+    for (std::vector<node_move>::const_iterator it = first; it != last; ++ it) {
+        assert2 ("node index points to wrong pointer", it->link.slot < block_obj->ptrCount()
+                 && block_obj->ptr(it->link.slot).block == it->from);
+        children.clear();
+        if (it->link.level > TREE_LEVEL_LEAF)
+            this->getChildNodes(it->from, children);
+        // move pointed block
+        this->journal->moveRawBlock(it->from, it->to);
+        this->blocks_moved_formatted ++;
+        // update bitmap
+        this->bitmap->markBlockFree(it->from);
+        this->bitmap->markBlockUsed(it->to);
+        // update pointer
+        block_obj->ptr(it->link.slot).block = it->to;
+        block_obj->markDirty();
+        // if transaction becomes too large, divide it into smaller ones
+        if (this->journal->estimateTransactionSize() > 100) {
+            if (block_obj->dirty)
+                this->journal->writeBlock(block_obj);
+            this->bitmap->writeChangedBitmapBlocks();
+            this->journal->commitTransaction();
+            this->journal->beginTransaction();
         }
-        this->journal->releaseBlock(block_obj);
-    } else {
-        assert1 (level == target_level); // we reached target_level
-        this->journal->beginTransaction();
-        for (uint32_t k = 0; k < block_obj->ptrCount(); k ++ ) {
-            uint32_t child_idx = block_obj->ptr(k).block;
-            if (movemap.count(child_idx) > 0) {
-                // move pointed block
-                this->journal->moveRawBlock(child_idx, movemap[child_idx]);
-                this->blocks_moved_formatted ++;
-                // update bitmap
-                this->bitmap->markBlockFree(child_idx);
-                this->bitmap->markBlockUsed(movemap[child_idx]);
-                // update pointer
-                block_obj->ptr(k).block = movemap[child_idx];
-                block_obj->markDirty();
-                // if transaction becomes too large, divide it into smaller ones
-                if (this->journal->estimateTransactionSize() > 100) {
-                    if (block_obj->dirty)
-                        this->journal->writeBlock(block_obj);
-                    this->bitmap->writeChangedBitmapBlocks();
-                    this->journal->commitTransaction();
-                    this->journal->beginTransaction();
-                }
-                // update in-memory leaf index
-                if (TREE_LEVEL_LEAF == level - 1) {
-                    // child_idx pointing to leaf node, which moved just now
-                    // so we must update all occurences of child_idx to movemap[child_idx]
-                    // in leaf_index
-                    for (std::vector<leaf_index_entry>::iterator it = this->leaf_index.begin();
-                        it != this->leaf_index.end(); ++ it)
-                    {
-                        if (it->leaves.count(child_idx) > 0) {
-                            it->leaves.erase(child_idx);
-                            it->leaves.insert(movemap[child_idx]);
-                        }
-                    }
-                }
-                movemap.erase(child_idx);
-            }
+        // update in-memory indices
+        this->relinkNode(it->from, it->to, children);
+        if (TREE_LEVEL_LEAF == it->link.level) {
+            this->renameLeafInIndex(it->from, it->to);
+            this->markLeafObjectsDirty(it->to);
         }
-        this->journal->releaseBlock(block_obj);
-        this->bitmap->writeChangedBitmapBlocks();
-        this->journal->commitTransaction();
     }
+    this->journal->releaseBlock(block_obj);
+    this->bitmap->writeChangedBitmapBlocks();
+    this->journal->commitTransaction();
 }
 
 void
-ReiserFs::recursivelyMoveUnformatted(uint32_t block_idx, movemap_t &movemap)
+ReiserFs::getChildNodes(uint32_t block_idx, std::vector<uint32_t> &children) const
 {
     Block *block_obj = this->journal->readBlock(block_idx);
-    uint32_t level = block_obj->level();
-    if (level > TREE_LEVEL_LEAF) {
-        block_obj->checkInternalNode();
-        for (uint32_t k = 0; k < block_obj->ptrCount(); k ++) {
-            uint32_t child_idx = block_obj->ptr(k).block;
-            this->recursivelyMoveUnformatted(child_idx, movemap);
-        }
-        this->journal->releaseBlock(block_obj);
-    } else {
-        // leaf level
-        block_obj->checkLeafNode();
-        this->journal->beginTransaction();
-        for (uint32_t k = 0; k < block_obj->itemCount(); k ++) {
-            const struct Block::item_header &ih = block_obj->itemHeader(k);
-            // indirect items contain links to unformatted (data) blocks
-            if (KEY_TYPE_INDIRECT != ih.type())
-                continue;
-            for (int idx = 0; idx < ih.length/4; idx ++) {
-                uint32_t child_idx = block_obj->indirectItemRef(ih, idx);
-                if (0 == child_idx)     // sparse file
-                    continue;
-                if (movemap.count(child_idx) == 0) continue;
-                // update pointers in indirect item
-                block_obj->setIndirectItemRef(ih, idx, movemap[child_idx]);
-                // actually move block
-                bool should_journal_data = this->use_data_journaling;
-                this->journal->moveRawBlock(child_idx, movemap[child_idx], should_journal_data);
-                this->blocks_moved_unformatted ++;
-                // update bitmap
-                this->bitmap->markBlockFree(child_idx);
-                this->bitmap->markBlockUsed(movemap[child_idx]);
-                // if transaction becomes too large, divide it into smaller ones
-                if (this->journal->estimateTransactionSize() > 100) {
-                    if (block_obj->dirty)
-                        this->journal->writeBlock(block_obj);
-                    this->bitmap->writeChangedBitmapBlocks();
-                    this->journal->commitTransaction();
-                    this->journal->beginTransaction();
-                }
-                // update in-memory leaf index
-                uint32_t new_basket_id = movemap[child_idx] / this->leaf_index_granularity;
-                uint32_t old_basket_id = child_idx / this->leaf_index_granularity;
-                this->leaf_index[new_basket_id].leaves.insert(block_idx);
-                this->leaf_index[new_basket_id].changed = true;
-                this->leaf_index[old_basket_id].changed = true;
-            }
-        }
-        this->journal->releaseBlock(block_obj);
-        this->bitmap->writeChangedBitmapBlocks();
-        this->journal->commitTransaction();
+    block_obj->checkInternalNode();
+    for (uint32_t k = 0; k < block_obj->ptrCount(); k ++)
+        children.push_back(block_obj->ptr(k).block);
+    this->journal->releaseBlock(block_obj);
+}
+
+void
+ReiserFs::relinkNode(uint32_t old_idx, uint32_t new_idx, const std::vector<uint32_t> &children)
+{
+    const node_entry *old_entry = this->node_index.find(old_idx);
+    assert2 ("node is not in node index", NULL != old_entry);
+    node_entry entry = *old_entry;
+    this->node_index.erase(old_idx);
+    entry.block = new_idx;
+    this->node_index.insert(entry);
+    for (std::vector<uint32_t>::const_iterator c_it = children.begin(); c_it != children.end();
+         ++ c_it)
+    {
+        node_entry *child = this->node_index.find(*c_it);
+        assert2 ("node is not in node index", NULL != child);
+        assert1 (child->link.parent == old_idx);
+        child->link.parent = new_idx;
     }
 }
 
 void
-ReiserFs::leafContentMoveUnformatted(uint32_t block_idx, movemap_t &movemap,
-                                     const std::set<Block::key_t> &key_list, bool all_keys)
+ReiserFs::leafContentMoveUnformatted(uint32_t block_idx,
+                                     std::vector<data_move>::const_iterator first,
+                                     std::vector<data_move>::const_iterator last)
 {
     Block *block_obj = this->journal->readBlock(block_idx);
     block_obj->checkLeafNode();
     this->journal->beginTransaction();
-    for (uint32_t k = 0; k < block_obj->itemCount(); k ++) {
-        const struct Block::item_header &ih = block_obj->itemHeader(k);
-        // indirect items contain links to unformatted (data) blocks
-        if (KEY_TYPE_INDIRECT != ih.type())
-            continue;
-        if (not all_keys && (key_list.count(ih.key) == 0))
-            continue;
-        for (int idx = 0; idx < ih.length/4; idx ++) {
-            uint32_t child_idx = block_obj->indirectItemRef(ih, idx);
-            if (0 == child_idx)     // sparse file
-                continue;
-            if (movemap.count(child_idx) == 0) continue;
-            uint32_t target_idx = movemap.find(child_idx)->second;
-            // update pointers in indirect item
-            block_obj->setIndirectItemRef(ih, idx, target_idx);
-            // actually move block
-            bool should_journal_data = this->use_data_journaling;
-            this->journal->moveRawBlock(child_idx, target_idx, should_journal_data);
-            this->blocks_moved_unformatted ++;
-            // update bitmap
-            this->bitmap->markBlockFree(child_idx);
-            this->bitmap->markBlockUsed(target_idx);
-            // if transaction becomes too large, divide it into smaller ones
-            if (this->journal->estimateTransactionSize() > 100) {
-                if (block_obj->dirty)
-                    this->journal->writeBlock(block_obj);
-                this->bitmap->writeChangedBitmapBlocks();
-                this->journal->commitTransaction();
-                this->journal->beginTransaction();
-            }
-            // update in-memory leaf index
-            uint32_t new_basket_id = target_idx / this->leaf_index_granularity;
-            uint32_t old_basket_id = child_idx / this->leaf_index_granularity;
-            this->leaf_index[new_basket_id].leaves.insert(block_idx);
-            this->leaf_index[new_basket_id].changed = true;
-            this->leaf_index[old_basket_id].changed = true;
-            movemap.erase(child_idx);
+    for (std::vector<data_move>::const_iterator it = first; it != last; ++ it) {
+        const struct Block::item_header &ih = block_obj->itemHeader(it->ref.item);
+        assert2 ("leaf index points to wrong pointer",
+                 KEY_TYPE_INDIRECT == ih.type() && it->ref.pos < ih.length / 4u
+                 && block_obj->indirectItemRef(ih, it->ref.pos) == it->from);
+        // update pointers in indirect item
+        block_obj->setIndirectItemRef(ih, it->ref.pos, it->to);
+        // actually move block
+        bool should_journal_data = this->use_data_journaling;
+        this->journal->moveRawBlock(it->from, it->to, should_journal_data);
+        this->blocks_moved_unformatted ++;
+        // update bitmap
+        this->bitmap->markBlockFree(it->from);
+        this->bitmap->markBlockUsed(it->to);
+        // if transaction becomes too large, divide it into smaller ones
+        if (this->journal->estimateTransactionSize() > 100) {
+            if (block_obj->dirty)
+                this->journal->writeBlock(block_obj);
+            this->bitmap->writeChangedBitmapBlocks();
+            this->journal->commitTransaction();
+            this->journal->beginTransaction();
         }
+        // update in-memory indices
+        this->removeDataRef(it->from);
+        this->addDataRef(it->to, it->ref);
+        this->markObjectDirty(ih.key.normalized().hi);
     }
     this->journal->releaseBlock(block_obj);
     this->bitmap->writeChangedBitmapBlocks();
@@ -824,37 +1226,14 @@ ReiserFs::getLeavesForBlockRange(std::vector<uint32_t> &leaves, uint32_t from, u
     uint32_t basket_to = to / this->leaf_index_granularity;
 
     for (uint32_t basket_id = basket_from; basket_id <= basket_to; basket_id ++) {
-        leaves.insert(leaves.end(), this->leaf_index[basket_id].leaves.begin(),
-            this->leaf_index[basket_id].leaves.end());
+        const std::vector<uint32_t> &basket_leaves = this->leaf_index[basket_id].leaves.items();
+        leaves.insert(leaves.end(), basket_leaves.begin(), basket_leaves.end());
     }
-    std::sort(leaves.begin(), leaves.end());
-    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
-}
-
-void
-ReiserFs::getLeavesForMovemap(std::vector<uint32_t> &leaves, const movemap_t &movemap)
-{
-    leaves.clear();
-    std::vector<uint32_t> basket_list;
-    for (movemap_t::const_iterator it = movemap.begin(); it != movemap.end(); ++ it) {
-        uint32_t basket_id = it->first / this->leaf_index_granularity;
-        basket_list.push_back(basket_id);
-    }
-    // remove duplicates
-    std::sort(basket_list.begin(), basket_list.end());
-    basket_list.erase(
-        std::unique(basket_list.begin(), basket_list.end()),
-        basket_list.end());
-
-    for (std::vector<uint32_t>::iterator it = basket_list.begin(); it != basket_list.end(); ++ it) {
-        uint32_t basket_id = *it;
-        leaves.insert(leaves.end(), this->leaf_index[basket_id].leaves.begin(),
-            this->leaf_index[basket_id].leaves.end());
+    // every basket list is sorted and unique already
+    if (basket_from != basket_to) {
+        std::sort(leaves.begin(), leaves.end());
+        leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
     }
-
-    // remove duplicates
-    std::sort(leaves.begin(), leaves.end());
-    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
 }
 
 void
@@ -930,62 +1309,144 @@ ReiserFs::squeezeDataBlocksInAG(uint32_t ag)
     while (front_ptr <= block_end) {
         if (this->blockUsed(front_ptr)) {
             if (front_ptr != packed_ptr)
-                movemap[front_ptr] = packed_ptr;
+                movemap.insert(front_ptr, packed_ptr);
             do { packed_ptr++; } while (this->bitmap->blockReserved(packed_ptr));
         }
         do { front_ptr++; } while (this->bitmap->blockReserved(front_ptr));
     }
+    movemap.normalize();
 
     if (0 == movemap.size())    // all blocks are on their position already
         return RFSD_OK;
 
-    // move map is likely to be degenerate, with cycles. We need to find way untangle it.
-    // first, count how many free block we need
-    uint32_t free_block_count = 0;
-    for (movemap_t::const_iterator iter = movemap.begin(); iter != movemap.end(); ++ iter) {
-        if (this->blockUsed(iter->second))
-            free_block_count ++;
+    // move map is likely to be degenerate: most targets are occupied by blocks which
+    // are moved by the same map. Executor will sort it out.
+    return this->movePermutation(movemap);
+}
+
+int
+ReiserFs::movePermutation(const movemap_t &movemap, uint32_t max_wave_count)
+{
+    const uint32_t NONE = ~0u;
+    assert1 (max_wave_count > 0);
+
+    // moves, sorted by source block
+    std::vector<std::pair<uint32_t, uint32_t> > moves(movemap.begin(), movemap.end());
+    const uint32_t move_count = moves.size();
+    if (0 == move_count)
+        return RFSD_OK;
+
+    std::vector<uint32_t> targets;
+    targets.reserve(move_count);
+    for (uint32_t k = 0; k < move_count; k ++)
+        targets.push_back(moves[k].second);
+    std::sort(targets.begin(), targets.end());
+    if (std::adjacent_find(targets.begin(), targets.end()) != targets.end()) {
+        std::cout << "error: movemap degenerate, some targets coincide" << std::endl;
+        return RFSD_FAIL;
     }
 
-    // allocate free blocks in large chunks
-    std::vector<uint32_t> free_blocks;
-    uint32_t ext_size = 2048;
-    while (free_block_count > 0) {
-        uint32_t wag = ag + 1;
-        std::vector<uint32_t> w_blocks;
-        const uint32_t count = std::min(ext_size, free_block_count);
-        while (RFSD_FAIL == this->bitmap->allocateFreeExtent(wag, count, w_blocks, ag)) {
-            ext_size /= 2;
-            if (0 == ext_size)
-                return RFSD_FAIL;
+    // move can be done only after its target vacated, by move with that source block.
+    // Find such blockers for every move
+    std::vector<uint32_t> blocker(move_count, NONE);
+    for (uint32_t k = 0; k < move_count; k ++) {
+        std::vector<std::pair<uint32_t, uint32_t> >::const_iterator b =
+            std::lower_bound(moves.begin(), moves.end(), std::make_pair(moves[k].second, 0u));
+        if (b != moves.end() && b->first == moves[k].second) {
+            blocker[k] = b - moves.begin();
+        } else if (this->bitmap->blockUsed(moves[k].second)) {
+            std::cout << "error: some 'to' blocks are occupied by blocks not being moved"
+                << std::endl;
+            return RFSD_FAIL;
         }
-        free_block_count -= count;
-        free_blocks.insert(free_blocks.end(), w_blocks.begin(), w_blocks.end());
     }
 
-    // give up if we haven't managed to find enough free blocks
-    if (free_block_count > 0)
-        return RFSD_FAIL;
+    // Compute depth of each move in its chain, that is how many moves must be done before.
+    // Moves of the same depth have free targets at the same time, and form a wave.
+    // Moves which are too deep, or close cycle, are parked: they go to spare block first,
+    // and to their real target in the very last wave.
+    std::vector<uint32_t> depth(move_count, NONE);
+    std::vector<bool> on_path(move_count, false);
+    std::vector<bool> parked(move_count, false);
+    std::vector<uint32_t> path;
+    uint32_t parked_count = 0;
+    uint32_t max_depth = 0;
+    for (uint32_t k = 0; k < move_count; k ++) {
+        if (NONE != depth[k])
+            continue;
+        // follow chain until its end, already processed move or cycle
+        path.clear();
+        uint32_t base_depth = NONE;
+        uint32_t j = k;
+        while (1) {
+            on_path[j] = true;
+            path.push_back(j);
+            const uint32_t b = blocker[j];
+            if (NONE == b)          // target is free
+                break;
+            if (NONE != depth[b]) { // target will be vacated by known wave
+                base_depth = depth[b];
+                break;
+            }
+            if (on_path[b]) {       // cycle, break it here
+                parked[j] = true;
+                break;
+            }
+            j = b;
+        }
+        // assign depths backwards, starting from chain end
+        uint32_t d = base_depth;
+        for (std::vector<uint32_t>::reverse_iterator it = path.rbegin(); it != path.rend(); ++ it) {
+            const uint32_t p = *it;
+            if (parked[p] || NONE == d) {
+                d = 0;
+            } else if (d + 1 >= max_wave_count) {
+                parked[p] = true;
+                d = 0;
+            } else {
+                d ++;
+            }
+            depth[p] = d;
+            on_path[p] = false;
+            max_depth = std::max(max_depth, d);
+            if (parked[p])
+                parked_count ++;
+        }
+    }
 
-    // sort free block pointers
-    std::sort (free_blocks.begin(), free_blocks.end());
+    // find spare blocks for parked moves. They must be free and must not be targets
+    std::vector<uint32_t> spare_blocks;
+    uint32_t spare_idx = 0;
+    while (spare_blocks.size() < parked_count) {
+        spare_idx = this->findFreeBlockAfter(spare_idx);
+        if (0 == spare_idx) {
+            std::cout << "error: not enough free space to park blocks" << std::endl;
+            return RFSD_FAIL;
+        }
+        if (not std::binary_search(targets.begin(), targets.end(), spare_idx))
+            spare_blocks.push_back(spare_idx);
+    }
 
-    // fill movemap for second stage
-    movemap_t movemap2;
-    std::vector<uint32_t>::const_iterator free_ptr = free_blocks.begin();
-    for (movemap_t::iterator iter = movemap.begin(); iter != movemap.end(); ++ iter) {
-        if (this->blockUsed(iter->second)) {
-            movemap2[*free_ptr] = iter->second;
-            iter->second = *free_ptr;
-            ++ free_ptr;
+    // distribute moves by waves. Last one moves parked blocks to their targets
+    std::vector<movemap_t> waves(max_depth + 2);
+    std::vector<uint32_t>::const_iterator spare_ptr = spare_blocks.begin();
+    for (uint32_t k = 0; k < move_count; k ++) {
+        if (parked[k]) {
+            waves[depth[k]].insert(moves[k].first, *spare_ptr);
+            waves[max_depth + 1].insert(*spare_ptr, moves[k].second);
+            ++ spare_ptr;
+        } else {
+            waves[depth[k]].insert(moves[k].first, moves[k].second);
         }
     }
-    assert1 (free_ptr == free_blocks.end());
+    assert1 (spare_ptr == spare_blocks.end());
 
-    // do actual moves
-    this->moveBlocks(movemap);
-    this->moveBlocks(movemap2);
-    // free extents in touched AGs are rescanned in ->moveBlocks
+    for (std::vector<movemap_t>::iterator it = waves.begin(); it != waves.end(); ++ it) {
+        this->moveBlocks(*it);
+        // moveBlocks leaves map untouched if it refused to move
+        if (it->size() > 0)
+            return RFSD_FAIL;
+    }
 
     return RFSD_OK;
 }
@@ -1002,17 +1463,37 @@ ReiserFs::sweepOutAG(uint32_t ag)
     if (0 == blocks_needed) // no need to do anything
         return RFSD_OK;
 
-    // allocate free blocks in other AGs
+    // allocate free blocks in other AGs. Sealed ones are used only if there is no room
+    // elsewhere, as blocks put there end up between files packed into them
     std::vector<uint32_t> free_blocks;
     uint32_t segment_size = 4096;
     uint32_t temp_ag = ag;
+    bool use_sealed = false;
+    const uint32_t ag_count = this->bitmap->AGCount();
     while (blocks_needed > 0) {
         uint32_t cnt = std::min(segment_size, blocks_needed);
         std::vector<uint32_t> w_blocks;
-        while (RFSD_FAIL == this->bitmap->allocateFreeExtent(temp_ag, cnt, w_blocks, ag)) {
+        while (1) {
+            bool allocated = false;
+            for (uint32_t k = 0; k < ag_count and not allocated; k ++) {
+                const uint32_t try_ag = (temp_ag + k) % ag_count;
+                if (try_ag == ag or (this->sealed_ags[try_ag] and not use_sealed))
+                    continue;
+                if (RFSD_OK == this->bitmap->allocateFreeExtentInAG(try_ag, cnt, w_blocks)) {
+                    temp_ag = try_ag;
+                    allocated = true;
+                }
+            }
+            if (allocated)
+                break;
             segment_size /= 2;
-            if (0 == segment_size)  // can't allocate 0 blocks. That means we failed to allocate
-                return RFSD_FAIL;   // single block. There is no sense to continue.
+            if (0 == segment_size) {
+                // can't allocate even single block. Retry with sealed AGs, or give up
+                if (use_sealed)
+                    return RFSD_FAIL;
+                use_sealed = true;
+                segment_size = 4096;
+            }
             cnt = std::min(segment_size, blocks_needed);
         }
         blocks_needed -= cnt;
@@ -1028,7 +1509,7 @@ ReiserFs::sweepOutAG(uint32_t ag)
     std::vector<uint32_t>::const_iterator free_ptr = free_blocks.begin();
     for (uint32_t k = this->bitmap->AGBegin(ag); k <= this->bitmap->AGEnd(ag); k ++) {
         if (this->blockUsed(k) && !this->bitmap->blockReserved(k)) {
-            movemap[k] = *free_ptr;
+            movemap.insert(k, *free_ptr);
             ++ free_ptr;
             qqq ++;
         }
@@ -1041,113 +1522,135 @@ ReiserFs::sweepOutAG(uint32_t ag)
     return RFSD_OK;
 }
 
+uint32_t
+ReiserFs::leafCountForBlockRange(uint32_t from, uint32_t to)
+{
+    std::vector<uint32_t> leaves;
+    this->getLeavesForBlockRange(leaves, from, to);
+    return leaves.size();
+}
+
 void
-ReiserFs::recursivelyEnumerateNodes(uint32_t block_idx, std::vector<ReiserFs::tree_element> &tree,
-                                    bool only_internal_nodes) const
+ReiserFs::getLeafDataSpans(std::vector<leaf_data_span> &spans) const
 {
-    Block *block_obj = this->journal->readBlock(block_idx);
-    uint32_t level = block_obj->level();
-    block_obj->checkInternalNode();
-    tree_element te;
-    te.idx = block_idx;
-    te.type = BLOCKTYPE_INTERNAL;
-    tree.push_back(te);
-    if (level == TREE_LEVEL_LEAF + 1) { // just above leaf level
-        if (not only_internal_nodes) {
-            for (uint32_t k = 0; k < block_obj->ptrCount(); k ++) {
-                te.idx = block_obj->ptr(k).block;;
-                te.type = BLOCKTYPE_LEAF;
-                tree.push_back(te);
-            }
+    // one span per run first, then runs of the same leaf are merged
+    spans.clear();
+    for (std::vector<leaf_index_entry>::const_iterator basket = this->leaf_index.begin();
+         basket != this->leaf_index.end(); ++ basket)
+    {
+        for (std::vector<ref_run>::const_iterator it = basket->runs.begin();
+             it != basket->runs.end(); ++ it)
+        {
+            leaf_data_span span;
+            span.leaf = it->leaf;
+            span.first = it->start;
+            const uint32_t last = it->start + it->len - 1;
+            if (it->leaf < it->start)
+                span.distance = it->start - it->leaf;
+            else if (it->leaf > last)
+                span.distance = it->leaf - last;
+            else
+                span.distance = 0;
+            spans.push_back(span);
         }
-    } else {
-        for (uint32_t k = 0; k < block_obj->ptrCount(); k ++) {
-            uint32_t child_idx = block_obj->ptr(k).block;
-            this->recursivelyEnumerateNodes(child_idx, tree, only_internal_nodes);
+    }
+    std::sort(spans.begin(), spans.end(), leaf_data_span_less);
+
+    std::vector<leaf_data_span>::iterator out = spans.begin();
+    for (std::vector<leaf_data_span>::const_iterator it = spans.begin(); it != spans.end();
+         ++ it)
+    {
+        if (out != spans.begin() and (out - 1)->leaf == it->leaf) {
+            (out - 1)->first = std::min((out - 1)->first, it->first);
+            (out - 1)->distance = std::min((out - 1)->distance, it->distance);
+        } else {
+            *out ++ = *it;
         }
     }
-    this->journal->releaseBlock(block_obj);
+    spans.erase(out, spans.end());
+}
+
+void
+ReiserFs::walkTree(std::vector<TreeWalker::node> &nodes) const
+{
+    // walker reads from disk directly, so everything journal holds must get there first
+    this->journal->flushTransactionCache();
+    TreeWalker walker(this->fd, this->thread_count);
+    walker.walk(this->sb.s_root_block, this->sb.s_tree_height, nodes);
 }
 
 void
 ReiserFs::enumerateTree(std::vector<tree_element> &tree) const
 {
+    std::vector<TreeWalker::node> nodes;
+    this->walkTree(nodes);
     tree.clear();
-    // last parameter: false, not only internal nodes
-    this->recursivelyEnumerateNodes(this->sb.s_root_block, tree, false);
+    tree.reserve(nodes.size());
+    for (std::vector<TreeWalker::node>::const_iterator it = nodes.begin(); it != nodes.end();
+         ++ it)
+    {
+        tree_element te;
+        te.idx = it->block;
+        te.type = (TREE_LEVEL_LEAF == it->level) ? BLOCKTYPE_LEAF : BLOCKTYPE_INTERNAL;
+        tree.push_back(te);
+    }
 }
 
 void
 ReiserFs::enumerateInternalNodes(std::vector<tree_element> &tree) const
 {
+    std::vector<TreeWalker::node> nodes;
+    this->walkTree(nodes);
     tree.clear();
-    // last parameter: true, only internal nodes
-    this->recursivelyEnumerateNodes(this->sb.s_root_block, tree, true);
+    for (std::vector<TreeWalker::node>::const_iterator it = nodes.begin(); it != nodes.end();
+         ++ it)
+    {
+        if (TREE_LEVEL_LEAF == it->level)
+            continue;
+        tree_element te;
+        te.idx = it->block;
+        te.type = BLOCKTYPE_INTERNAL;
+        tree.push_back(te);
+    }
 }
 
 void
-ReiserFs::recursivelyEnumerateLeaves(uint32_t block_idx, const Block::key_t &start_key,
-                                     int &soft_threshold, Block::key_t left, Block::key_t right,
-                                     std::vector<uint32_t> &leaves, Block::key_t &last_key) const
+ReiserFs::enumerateLeaves(const Block::key_t &start_key, int soft_threshold,
+                          std::vector<uint32_t> &leaves, Block::key_t &last_key) const
 {
-    Block *block_obj = this->journal->readBlock(block_idx);
-    uint32_t level = block_obj->level();
-    if (level > TREE_LEVEL_LEAF) {
-        // internal node
-        block_obj->checkInternalNode();
-        for (uint32_t k = 0; k < block_obj->ptrCount(); k ++) {
-            const Block::key_t new_left = (k > 0) ? block_obj->key(k-1) : left;
-            const Block::key_t new_right = (k < block_obj->keyCount()) ? block_obj->key(k) : right;
-            if (new_right > start_key) {
-                this->recursivelyEnumerateLeaves(block_obj->ptr(k).block, start_key, soft_threshold,
-                                                 new_left, new_right, leaves, last_key);
-                if (soft_threshold < 0)
-                    break;
-            }
-        }
-    } else {
-        // leaf node
+    last_key = start_key;
+    leaves.clear();
+    this->cursor.seek(start_key);
+    do {
+        const uint32_t leaf_idx = this->cursor.leaf();
+        Block *block_obj = this->journal->readBlock(leaf_idx);
         block_obj->checkLeafNode();
         // every run will touch last leaf from previous scan. To prevent adding leaf twice
-        // we check each item key and skip those less than start_key
+        // we start from first item with key greater than start_key
         bool touch_leaf = false;
-        for (uint32_t item_idx = 0; item_idx < block_obj->itemCount(); item_idx ++) {
+        for (uint32_t item_idx = block_obj->upperBoundItem(start_key);
+             item_idx < block_obj->itemCount(); item_idx ++)
+        {
             const Block::item_header &ih = block_obj->itemHeader(item_idx);
-            if (ih.key <= start_key)    // skip items with inappropriate keys
-                continue;
             touch_leaf = true;
             last_key = ih.key;  // and update last_key
             if (KEY_TYPE_INDIRECT != ih.type())
                 continue;
-            if (ih.key > start_key) {
-                soft_threshold -= ih.length / 4; // decrease by number of unformatted blocks
-            }
+            soft_threshold -= ih.length / 4; // decrease by number of unformatted blocks
         }
         if (touch_leaf) {
-            leaves.push_back(block_idx);
+            leaves.push_back(leaf_idx);
             soft_threshold --; // count leaf block itself
         }
-    }
-
-    this->journal->releaseBlock(block_obj);
-}
-
-void
-ReiserFs::enumerateLeaves(const Block::key_t &start_key, int soft_threshold,
-                          std::vector<uint32_t> &leaves, Block::key_t &last_key) const
-{
-    last_key = start_key;
-    leaves.clear();
-    this->recursivelyEnumerateLeaves(this->sb.s_root_block, start_key, soft_threshold,
-                                     Block::zero_key, Block::largest_key, leaves, last_key);
+        this->journal->releaseBlock(block_obj);
+    } while (soft_threshold >= 0 and this->cursor.nextLeaf());
 }
 
 bool
-ReiserFs::recursivelyGetBlocksOfObject(const uint32_t leaf_idx, const Block::key_t &start_key,
-                                       const uint32_t object_type, const Block::key_t left,
-                                       const Block::key_t right, uint32_t &start_offset,
-                                       blocklist_t &blocks, Block::key_t &next_key,
-                                       uint32_t &next_offset, uint32_t &limit) const
+ReiserFs::collectBlocksOfObject(uint32_t leaf_idx, const Block::key_t &start_key,
+                                const uint32_t object_type, uint32_t &start_offset,
+                                blocklist_t &blocks, Block::key_t &next_key,
+                                uint32_t &next_offset, uint32_t &limit) const
 {
     // you may find asking yourself, why does `limit' compare to 1, not to 0. That's because
     // no one likes to get leaf block as the last block in a batch. Next call will add it anyway
@@ -1156,69 +1659,50 @@ ReiserFs::recursivelyGetBlocksOfObject(const uint32_t leaf_idx, const Block::key
 
     bool should_continue = true;
     Block *block_obj = this->journal->readBlock(leaf_idx);
-    uint32_t level = block_obj->level();
-    if (level > TREE_LEVEL_LEAF) {
-        // internal node
-        block_obj->checkInternalNode();
-        for (uint32_t k = 0; k < block_obj->ptrCount(); k ++) {
-            const Block::key_t new_left = (k > 0) ? block_obj->key(k-1) : left;
-            const Block::key_t new_right = (k < block_obj->keyCount()) ? block_obj->key(k) : right;
-            if (new_right > start_key) {
-                should_continue = this->recursivelyGetBlocksOfObject(block_obj->ptr(k).block,
-                                    start_key, object_type, new_left, new_right, start_offset,
-                                    blocks, next_key, next_offset, limit);
-                if (! start_key.sameObjectAs(next_key))
-                    break;
-                if (! should_continue)
-                    break;
-            }
+    block_obj->checkLeafNode();
+    uint32_t indirect_idx = 0;   //< indirect item index. 1-based
+    // skip items with inappropriate keys
+    for (uint32_t item_idx = block_obj->lowerBoundItem(start_key);
+         item_idx < block_obj->itemCount(); item_idx ++)
+    {
+        const Block::item_header &ih = block_obj->itemHeader(item_idx);
+        if (limit <= 1) {
+            // start_offset equal to zero means we finished previous indirect item
+            // and should advance next_key pointer to next one. Otherwise next_key
+            // should be kept the same
+            if (0 == start_offset)
+                next_key = ih.key;
+            should_continue = false;
+            break;
         }
-    } else {
-        // leaf node
-        block_obj->checkLeafNode();
-        uint32_t indirect_idx = 0;   //< indirect item index. 1-based
-        for (uint32_t item_idx = 0; item_idx < block_obj->itemCount(); item_idx ++) {
-            const Block::item_header &ih = block_obj->itemHeader(item_idx);
-            if (ih.key < start_key)     // skip items with inappropriate keys
-                continue;
-            if (limit <= 1) {
-                // start_offset equal to zero means we finished previous indirect item
-                // and should advance next_key pointer to next one. Otherwise next_key
-                // should be kept the same
-                if (0 == start_offset)
-                    next_key = ih.key;
-                should_continue = false;
-                break;
-            }
-            next_key = ih.key;          // update next_key
-            // exit if current item belongs to another object
-            if (! start_key.sameObjectAs(next_key))
-                break;
-            if (KEY_TYPE_INDIRECT == ih.type() && KEY_TYPE_INDIRECT == object_type) {
-                indirect_idx ++;
-                if (1 == indirect_idx && 0 == start_offset && limit > 1
-                    && (ih.key.offset(ih.version) != 1))
-                {
-                    blocks.push_back(leaf_idx);
-                    limit --;
-                    assert1((limit & 0x80000000) == 0); // catch negative
-                }
-                uint32_t end_pos = ih.length/4;
-                if (start_offset + limit < end_pos)
-                    end_pos = start_offset + limit;
-                for (uint32_t idx = start_offset; idx < end_pos; idx ++) {
-                    blocks.push_back(block_obj->indirectItemRef(ih, idx));
-                    limit --;
-                    assert1((limit & 0x80000000) == 0); // catch negative
-                }
-                start_offset = end_pos;
-                if (end_pos == ih.length/4)
-                    start_offset = 0;
-                next_offset = start_offset;
-            }
-            if (KEY_TYPE_DIRECTORY == ih.type() && KEY_TYPE_DIRECTORY == object_type) {
+        next_key = ih.key;          // update next_key
+        // exit if current item belongs to another object
+        if (! start_key.sameObjectAs(next_key))
+            break;
+        if (KEY_TYPE_INDIRECT == ih.type() && KEY_TYPE_INDIRECT == object_type) {
+            indirect_idx ++;
+            if (1 == indirect_idx && 0 == start_offset && limit > 1
+                && (ih.key.offset(ih.version) != 1))
+            {
                 blocks.push_back(leaf_idx);
+                limit --;
+                assert1((limit & 0x80000000) == 0); // catch negative
+            }
+            uint32_t end_pos = ih.length/4;
+            if (start_offset + limit < end_pos)
+                end_pos = start_offset + limit;
+            for (uint32_t idx = start_offset; idx < end_pos; idx ++) {
+                blocks.push_back(block_obj->indirectItemRef(ih, idx));
+                limit --;
+                assert1((limit & 0x80000000) == 0); // catch negative
             }
+            start_offset = end_pos;
+            if (end_pos == ih.length/4)
+                start_offset = 0;
+            next_offset = start_offset;
+        }
+        if (KEY_TYPE_DIRECTORY == ih.type() && KEY_TYPE_DIRECTORY == object_type) {
+            blocks.push_back(leaf_idx);
         }
     }
 
@@ -1226,6 +1710,24 @@ ReiserFs::recursivelyGetBlocksOfObject(const uint32_t leaf_idx, const Block::key
     return should_continue;
 }
 
+void
+ReiserFs::getBlocksOfObject(const Block::key_t &start_key, const uint32_t object_type,
+                            uint32_t &start_offset, blocklist_t &blocks, Block::key_t &next_key,
+                            uint32_t &next_offset, uint32_t &limit) const
+{
+    // object may span several leaves, walk them until object ends or limit is reached
+    this->cursor.seek(start_key);
+    do {
+        if (not this->collectBlocksOfObject(this->cursor.leaf(), start_key, object_type,
+                                            start_offset, blocks, next_key, next_offset, limit))
+        {
+            break;
+        }
+        if (not start_key.sameObjectAs(next_key))
+            break;
+    } while (this->cursor.nextLeaf());
+}
+
 void
 ReiserFs::getIndirectBlocksOfObject(const Block::key_t &start_key, uint32_t start_offset,
                                     Block::key_t &next_key, uint32_t &next_offset,
@@ -1234,9 +1736,8 @@ ReiserFs::getIndirectBlocksOfObject(const Block::key_t &start_key, uint32_t star
     next_key = start_key;
     next_offset = 0;
     blocks.clear();
-    this->recursivelyGetBlocksOfObject(this->sb.s_root_block, start_key, KEY_TYPE_INDIRECT,
-                                       Block::zero_key, Block::largest_key, start_offset, blocks,
-                                       next_key, next_offset, limit);
+    this->getBlocksOfObject(start_key, KEY_TYPE_INDIRECT, start_offset, blocks, next_key,
+                            next_offset, limit);
 }
 
 Block::key_t
@@ -1266,40 +1767,77 @@ ReiserFs::findObject(const std::string &fname) const
 Block::key_t
 ReiserFs::findObjectAt(const std::string &fname, const Block::key_t &at) const
 {
-    Block::key_t dir_key(KEY_V1, at.dir_id, at.obj_id, 0, 0);
     const uint32_t fname_hash = this->getStringHashR5(fname);
+    std::vector<dir_entry> entries;
+    this->readDirectory(at, entries);
+    for (std::vector<dir_entry>::const_iterator it = entries.begin(); it != entries.end(); ++ it) {
+        if (fname_hash == it->hash && fname == it->name)
+            return it->key;
+    }
+
+    return Block::key_t(KEY_V1, 0, 0, 0, 0);
+}
+
+void
+ReiserFs::readDirectory(const Block::key_t &dir, std::vector<dir_entry> &entries) const
+{
+    Block::key_t dir_key(KEY_V1, dir.dir_id, dir.obj_id, 0, 0);
 
     uint32_t start_offset = 0, next_offset = 0; // dummy
     uint32_t limit = 10; // should be greater than 1 to prevent early exit. Kind of dummy var too.
     Block::key_t next_key;
     blocklist_t dir_leaves;
-    this->recursivelyGetBlocksOfObject(this->sb.s_root_block, dir_key, KEY_TYPE_DIRECTORY,
-                                       Block::zero_key, Block::largest_key, start_offset,
-                                       dir_leaves, next_key, next_offset, limit);
+    this->getBlocksOfObject(dir_key, KEY_TYPE_DIRECTORY, start_offset, dir_leaves, next_key,
+                            next_offset, limit);
+    // leaf holding several directory items of the object is listed once for every item
+    dir_leaves.erase(std::unique(dir_leaves.begin(), dir_leaves.end()), dir_leaves.end());
 
+    entries.clear();
     for (blocklist_t::iterator it = dir_leaves.begin(); it != dir_leaves.end(); ++ it) {
         const uint32_t leaf_idx = *it;
         Block *block_obj = this->journal->readBlock(leaf_idx);
 
-        for (uint32_t item_idx = 0; item_idx < block_obj->itemCount(); item_idx ++) {
+        for (uint32_t item_idx = block_obj->lowerBoundItem(dir_key);
+             item_idx < block_obj->itemCount(); item_idx ++)
+        {
             const Block::item_header &ih = block_obj->itemHeader(item_idx);
-            if (!ih.key.sameObjectAs(dir_key)) continue;
-            if (KEY_TYPE_DIRECTORY == ih.type()) {
-                for (uint32_t k = 0; k < ih.count; k ++) {
-                    const struct Block::de_header &deh = block_obj->dirHeader(ih, k);
-                    if (fname_hash == (deh.hash_gen & 0x7fffff80)
-                        && fname == block_obj->dirEntryName(ih, k))
-                    {
-                        this->journal->releaseBlock(block_obj);
-                        return Block::key_t(KEY_V1, deh.dir_id, deh.obj_id, 0, 0);
-                    }
-                }
+            if (!ih.key.sameObjectAs(dir_key)) break;
+            if (KEY_TYPE_DIRECTORY != ih.type())
+                continue;
+            // entries within item, and items themselves, are sorted by hash already
+            for (uint32_t k = 0; k < ih.count; k ++) {
+                const struct Block::de_header &deh = block_obj->dirHeader(ih, k);
+                if (0 == (deh.state & DEH_VISIBLE))
+                    continue;
+                dir_entry entry;
+                entry.hash = deh.hash_gen & 0x7fffff80;
+                entry.key = Block::key_t(KEY_V1, deh.dir_id, deh.obj_id, 0, 0);
+                entry.name = block_obj->dirEntryName(ih, k);
+                entries.push_back(entry);
             }
         }
         this->journal->releaseBlock(block_obj);
     }
+}
 
-    return Block::key_t(KEY_V1, 0, 0, 0, 0);
+int
+ReiserFs::getObjectStat(const Block::key_t &obj, Block::stat_info &info) const
+{
+    // stat item is the first item of an object
+    Block::key_t stat_key(KEY_V1, obj.dir_id, obj.obj_id, 0, KEY_TYPE_STAT);
+    this->cursor.seek(stat_key);
+    Block *block_obj = this->journal->readBlock(this->cursor.leaf());
+    const uint32_t item_idx = block_obj->lowerBoundItem(stat_key);
+    int res = RFSD_FAIL;
+    if (item_idx < block_obj->itemCount()) {
+        const Block::item_header &ih = block_obj->itemHeader(item_idx);
+        if (ih.key.sameObjectAs(stat_key) and KEY_TYPE_STAT == ih.type()) {
+            block_obj->statItemInfo(ih, info);
+            res = RFSD_OK;
+        }
+    }
+    this->journal->releaseBlock(block_obj);
+    return res;
 }
 
 uint32_t
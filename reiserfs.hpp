@@ -13,6 +13,9 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstddef>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -43,6 +46,9 @@ const uint32_t KEY_TYPE_DIRECT     = 2;
 const uint32_t KEY_TYPE_DIRECTORY  = 3;
 const uint32_t KEY_TYPE_ANY        = 15;
 
+/// directory entry state bit, set for entries readdir shows
+const uint16_t DEH_VISIBLE = 4;
+
 const uint32_t BLOCKSIZE = 4096;
 const uint32_t BLOCKS_PER_BITMAP = BLOCKSIZE * 8;
 const uint32_t BLOCKS_IN_ONE_MB = 1024*1024/BLOCKSIZE;
@@ -84,7 +90,114 @@ assert_failfunc_s(const std::string &msg, const std::string &filename, int linen
 
 
 typedef std::vector<uint32_t> blocklist_t;
-typedef std::map<uint32_t, uint32_t> movemap_t;
+
+/// orders values by key extracted with given function
+template <typename T>
+struct compare_by_key {
+    uint32_t (*key)(const T &);
+    compare_by_key(uint32_t (*key_func)(const T &)) : key(key_func) {}
+    bool operator()(const T &a, const T &b) const { return this->key(a) < this->key(b); }
+};
+
+/// block-to-block map, kept as a flat array of (from, to) pairs.
+///
+/// New entries are appended to unsorted tail, which is sorted and merged into sorted head
+/// by normalize(). Later insert of the same source block wins. Lookups, iteration and size
+/// need normalized map, so build the map first and call normalize() before using it. Erased
+/// entries are marked instead of removed and are dropped on next normalization.
+class Movemap {
+public:
+    typedef std::pair<uint32_t, uint32_t> value_type;
+
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Movemap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type *pointer;
+        typedef const value_type &reference;
+
+        const_iterator() {}
+        const_iterator(std::vector<value_type>::const_iterator pos,
+                       std::vector<value_type>::const_iterator last) : pos(pos), last(last)
+            { this->skipErased(); }
+        reference operator*() const { return *this->pos; }
+        pointer operator->() const { return &*this->pos; }
+        const_iterator &operator++() { ++ this->pos; this->skipErased(); return *this; }
+        const_iterator operator++(int) { const_iterator tmp = *this; ++ *this; return tmp; }
+        bool operator==(const const_iterator &b) const { return this->pos == b.pos; }
+        bool operator!=(const const_iterator &b) const { return this->pos != b.pos; }
+    private:
+        std::vector<value_type>::const_iterator pos;
+        std::vector<value_type>::const_iterator last;
+        void skipErased() { while (this->pos != this->last and ERASED == this->pos->second)
+                                ++ this->pos; }
+    };
+    typedef const_iterator iterator;
+
+    Movemap();
+    /// adds (or replaces) mapping for block \param from
+    void insert(uint32_t from, uint32_t to);
+    /// removes mapping for block \param from, if any
+    void erase(uint32_t from);
+    /// returns target of block \param from, which must be present in map
+    uint32_t at(uint32_t from) const;
+    uint32_t count(uint32_t from) const;
+    const_iterator find(uint32_t from) const;
+    uint32_t size() const;
+    /// stored entries, including ones not merged yet. Upper bound of size(), which
+    /// doesn't need normalized map
+    uint32_t entryCount() const { return this->entries.size(); }
+    bool empty() const { return this->size() == 0; }
+    void clear();
+    void reserve(uint32_t sz) { this->entries.reserve(sz); }
+    /// adds all entries of \param src, keeping existing ones on collision
+    /// \return RFSD_OK if maps had no common source blocks, RFSD_FAIL otherwise
+    int merge(const Movemap &src);
+    /// merges appended entries into sorted array. Cheap if there is nothing to merge
+    void normalize();
+    /// checks if no two blocks have same target
+    bool targetsUnique() const;
+    const_iterator begin() const;
+    const_iterator end() const;
+
+private:
+    static const uint32_t ERASED = ~0u;
+    std::vector<value_type> entries;
+    uint32_t sorted_count;
+    uint32_t erased_count;
+
+    bool normalized() const { return this->sorted_count == this->entries.size(); }
+    std::vector<value_type>::const_iterator lookup(uint32_t from) const;
+};
+
+typedef Movemap movemap_t;
+
+/// fast pre-check for scans over block pointer arrays.
+///
+/// Passes every block within [lo, hi] range. Exact check is still up to caller, filter only
+/// helps to skip pointers which are certainly of no interest.
+class BlockFilter {
+public:
+    BlockFilter();
+    /// pass all blocks in range [\param lo, \param hi], nothing if \p hi is less than \p lo
+    void setRange(uint32_t lo, uint32_t hi);
+    bool mayContain(uint32_t block_idx) const {
+        return not this->empty and block_idx - this->lo <= this->span;
+    }
+    /// finds first pointer that passes filter
+    ///
+    /// \param refs[in]     array of block pointers, as in indirect item
+    /// \param count[in]    array length
+    /// \param start[in]    position to start search from
+    /// \return position of first candidate at or after \p start, or \p count if none
+    uint32_t nextCandidate(const uint32_t *refs, uint32_t count, uint32_t start) const;
+
+private:
+    uint32_t lo;
+    uint32_t span;          //< hi - lo
+    bool empty;             //< range is empty, nothing passes
+};
 
 struct FsSuperblock {
     uint32_t s_block_count;
@@ -180,6 +293,22 @@ public:
         uint8_t bh_right_key[16];
     } __attribute__ ((__packed__));
 
+    /// key in canonical form: (dir_id, obj_id) in upper word, offset and type in lower one.
+    ///
+    /// Keys of both formats map to the same form, so it's compared as two integers
+    struct norm_key {
+        uint64_t hi;
+        uint64_t lo;
+
+        // bitwise operators on purpose, they leave nothing to branch on
+        bool operator < (const norm_key &b) const {
+            return (this->hi < b.hi) | ((this->hi == b.hi) & (this->lo < b.lo));
+        }
+        bool operator == (const norm_key &b) const {
+            return (this->hi == b.hi) & (this->lo == b.lo);
+        }
+    };
+
     // reiserfs key, 3.5 (v0) and 3.6 (v1) formats
     struct key_struct {
         uint32_t dir_id;
@@ -218,33 +347,31 @@ public:
             else return KEY_V1;
         }
 
+        /// converts key to canonical form. Format is guessed the same way guessVersion
+        /// does, v0 types are translated to v1 ones. Unknown v0 types map to KEY_TYPE_ANY
+        norm_key normalized() const {
+            const uint64_t word = (static_cast<uint64_t>(v0.type) << 32) | v0.offset;
+            const uint32_t v1_type = word >> 60;
+            const uint32_t v0_type = v0.type;
+            const uint32_t v0_known = (v0_type == 0) | (v0_type == 0xfffffffe)
+                | (v0_type == 0xffffffff) | (v0_type == 500);
+            const uint64_t v0_code = (v0_type == 0xfffffffe) * KEY_TYPE_INDIRECT
+                + (v0_type == 0xffffffff) * KEY_TYPE_DIRECT
+                + (v0_type == 500) * KEY_TYPE_DIRECTORY + (1 - v0_known) * KEY_TYPE_ANY;
+            const uint64_t v0_lo = ((word & 0xffffffffu) << 4) | v0_code;
+            const uint64_t v1_lo = (word << 4) | v1_type;
+            const uint64_t v0_mask = -static_cast<uint64_t>((v1_type == 0) | (v1_type == 15));
+            norm_key nk;
+            nk.hi = (static_cast<uint64_t>(dir_id) << 32) | obj_id;
+            nk.lo = (v0_lo & v0_mask) | (v1_lo & ~v0_mask);
+            return nk;
+        }
+
         bool operator < (const struct key_struct& b) const {
-            if (dir_id < b.dir_id) return true;
-            if (dir_id > b.dir_id) return false;
-            //  dir_id == b.dir_id
-            if (obj_id < b.obj_id) return true;
-            if (obj_id > b.obj_id) return false;
-            // obj_id == b.obj_id
-            if (this->offset(KEY_VGUESS) < b.offset(KEY_VGUESS)) return true;
-            if (this->offset(KEY_VGUESS) > b.offset(KEY_VGUESS)) return false;
-            // should reach here only when keys are equal
-            assert2 ("key types should be equal", this->type(KEY_VGUESS) == b.type(KEY_VGUESS));
-            if (this->type(KEY_VGUESS) < b.type(KEY_VGUESS)) return true;
-            return false;
+            return this->normalized() < b.normalized();
         }
         bool operator > (const struct key_struct& b) const {
-            if (dir_id > b.dir_id) return true;
-            if (dir_id < b.dir_id) return false;
-            //  dir_id == b.dir_id
-            if (obj_id > b.obj_id) return true;
-            if (obj_id < b.obj_id) return false;
-            // obj_id == b.obj_id
-            if (this->offset(KEY_VGUESS) > b.offset(KEY_VGUESS)) return true;
-            if (this->offset(KEY_VGUESS) < b.offset(KEY_VGUESS)) return false;
-            // should reach here only when keys are equal
-            assert2 ("key types should be equal", this->type(KEY_VGUESS) == b.type(KEY_VGUESS));
-            if (this->type(KEY_VGUESS) > b.type(KEY_VGUESS)) return true;
-            return false;
+            return b.normalized() < this->normalized();
         }
         bool operator == (const struct key_struct& b) const {
             return dir_id == b.dir_id && obj_id == b.obj_id && v0.offset == b.v0.offset
@@ -254,8 +381,8 @@ public:
             return dir_id != b.dir_id || obj_id != b.obj_id || v0.offset != b.v0.offset
                 || v0.type != b.v0.type;
         }
-        bool operator >= (const struct key_struct& b) const { return (*this > b) || (*this == b); }
-        bool operator <= (const struct key_struct& b) const { return (*this < b) || (*this == b); }
+        bool operator >= (const struct key_struct& b) const { return not (*this < b); }
+        bool operator <= (const struct key_struct& b) const { return not (b < *this); }
 
         uint32_t offset_v0() const { return v0.offset; }
         uint64_t offset_v1() const { return v1.offset; }
@@ -344,6 +471,16 @@ public:
         uint32_t type() const { return this->key.type(this->version); }
     } __attribute__ ((__packed__));
 
+    /// finds child of internal node whose subtree covers \param key
+    ///
+    /// Binary search over node keys, so node must pass checkInternalNode first.
+    /// \return pointer index, in [0, keyCount()]
+    uint32_t childIndexForKey(const key_t &key) const;
+    /// \return index of first item with key not less than \param key, or itemCount()
+    uint32_t lowerBoundItem(const key_t &key) const;
+    /// \return index of first item with key greater than \param key, or itemCount()
+    uint32_t upperBoundItem(const key_t &key) const;
+
     const key_t &key(uint32_t index) const {
         const key_t *kp = reinterpret_cast<const key_t *>(&buf[0] + 24 + 16*index);
         const key_t &kpr = kp[0];
@@ -389,6 +526,33 @@ public:
         return name;
     };
 
+    /// stat item fields defrag cares about
+    struct stat_info {
+        uint16_t mode;
+        uint64_t size;
+        uint32_t atime;
+        uint32_t mtime;
+    };
+    /// parses stat item, of either version. Old one is 32 bytes long, new one is 44
+    void statItemInfo(const struct item_header &ih, stat_info &info) const {
+        const char *p = &buf[0] + ih.offset;
+        if (ih.length >= 44) {
+            info.mode = *reinterpret_cast<const uint16_t *>(p);
+            info.size = *reinterpret_cast<const uint64_t *>(p + 8);
+            info.atime = *reinterpret_cast<const uint32_t *>(p + 24);
+            info.mtime = *reinterpret_cast<const uint32_t *>(p + 28);
+        } else {
+            info.mode = *reinterpret_cast<const uint16_t *>(p);
+            info.size = *reinterpret_cast<const uint32_t *>(p + 8);
+            info.atime = *reinterpret_cast<const uint32_t *>(p + 12);
+            info.mtime = *reinterpret_cast<const uint32_t *>(p + 16);
+        }
+    }
+
+    /// pointer array of indirect item, ih.length/4 elements
+    const uint32_t *indirectItemRefs(const struct item_header &ih) const {
+        return reinterpret_cast<const uint32_t *>(&buf[0] + ih.offset);
+    }
     const uint32_t &indirectItemRef(const struct item_header &ih, uint32_t idx) const {
         const uint32_t *ci = reinterpret_cast<uint32_t const *>(&buf[0] + ih.offset + 4*idx);
         const uint32_t &ref = ci[0];
@@ -419,6 +583,11 @@ public:
     uint32_t estimateTransactionSize();
     void setCacheSize(uint32_t mib) { this->max_cache_size = mib * BLOCKS_IN_ONE_MB; }
     uint32_t cacheSize() const { return this->max_cache_size / BLOCKS_IN_ONE_MB; }
+    uint32_t mountId() const { return this->journal_header.mount_id; }
+    uint32_t lastFlushId() const { return this->journal_header.last_flush_id; }
+    /// copies raw moves in up to \param count parallel streams. Moves within the same
+    /// \param group_size-block group of disk always go to the same stream
+    void setIOStreams(uint32_t count, uint32_t group_size);
 
 private:
     struct cache_entry {
@@ -446,6 +615,14 @@ private:
         bool batch_running;
     } transaction;
     movemap_t raw_moves;
+    uint32_t io_streams;            //< how many raw copy streams may run at once
+    uint32_t stream_group_size;     //< granularity of raw move grouping, in blocks
+    struct raw_stream_stats {
+        uint64_t blocks;
+        double seconds;             //< time stream was busy
+        raw_stream_stats() : blocks(0), seconds(0) {}
+    };
+    std::vector<raw_stream_stats> stream_stats;
 
     bool blockInCache(uint32_t block_idx) { return this->block_cache.count(block_idx) > 0; }
     void pushToCache(Block *block_obj, int priority = CACHE_PRIORITY_NORMAL);
@@ -455,6 +632,8 @@ private:
     int writeJournalEntry();
     int doCommitTransaction();
     void flushRawMoves();
+    /// copies raw moves in parallel, see setIOStreams
+    void flushRawMovesInStreams();
 };
 
 class FsBitmap {
@@ -467,8 +646,11 @@ public:
         std::vector<extent_t> list;
         bool need_update;
         uint32_t used_blocks;
+        uint32_t max_extent_when_empty; //< longest run of unreserved blocks
+        uint32_t change_count;          //< bumped every time some block changes its state
         ag_entry() {
             need_update = true;
+            change_count = 0;
         }
         extent_t & operator [] (uint32_t k) { return this->list[k]; }
         const extent_t & operator [] (uint32_t k) const { return this->list[k]; }
@@ -491,6 +673,9 @@ public:
     void writeChangedBitmapBlocks();
     void updateAGFreeExtents();
     void rescanAGForFreeExtents(uint32_t ag);
+    /// makes next updateAGFreeExtents() rebuild free extent list of \param ag, even if no
+    /// block of AG changed its state
+    void requestAGRescan(uint32_t ag) { this->ag_free_extents[ag].need_update = true; }
     /// returns count of allocation groups
     uint32_t AGCount() const { return this->ag_free_extents.size(); }
     uint32_t AGOfBlock(uint32_t block_idx) const { return block_idx / this->ag_size; }
@@ -500,6 +685,14 @@ public:
     uint32_t AGExtentCount(uint32_t ag) const { return this->ag_free_extents[ag].size(); }
     uint32_t AGUsedBlockCount(uint32_t ag) const { return this->ag_free_extents[ag].used_blocks; }
     uint32_t AGFreeBlockCount(uint32_t ag) const;
+    /// \return counter which changes whenever some block of AG is marked used or free
+    uint32_t AGChangeCount(uint32_t ag) const { return this->ag_free_extents[ag].change_count; }
+    /// \return length of largest free extent in AG
+    uint32_t AGLargestFreeExtent(uint32_t ag) const;
+    /// \return length of largest free extent AG will have after all its blocks moved out
+    uint32_t AGLargestExtentWhenEmpty(uint32_t ag) const {
+        return this->ag_free_extents[ag].max_extent_when_empty;
+    }
     /// sets size of each allocation group
     void setAGSize(uint32_t size);
 
@@ -512,6 +705,25 @@ public:
     int allocateFreeExtent(uint32_t &ag, uint32_t required_size, std::vector<uint32_t> &blocks,
                            uint32_t forbidden_ag = -1);
 
+    /// allocate free blocks, continuous, in one AG only
+    ///
+    /// Touches free extent list of \param ag only, so calls for different AGs may run in
+    /// parallel.
+    /// \param  ag[in]              AG to allocate in
+    /// \param  required_size[in]   required size of extent
+    /// \param  blocks[out]         allocated blocks
+    /// \return RFSD_OK if allocation was successful, RFSD_FAIL otherwise
+    int allocateFreeExtentInAG(uint32_t ag, uint32_t required_size,
+                               std::vector<uint32_t> &blocks);
+
+    /// returns extent allocated by allocateFreeExtent, but never used, to free extent list
+    void releaseExtent(uint32_t start, uint32_t len);
+
+    /// takes extent out of free extent list, as if it was allocated
+    ///
+    /// \return RFSD_OK on success, RFSD_FAIL if some block of extent is not in the list
+    int reserveExtent(uint32_t start, uint32_t len);
+
 private:
     FsJournal *journal;
     const FsSuperblock *sb;
@@ -527,6 +739,15 @@ private:
     /// \return count of reserved blocks in [from, to] segment
     uint32_t reservedBlockCount(uint32_t from, uint32_t to) const;
 
+    /// \return length of longest run of unreserved blocks in [from, to] segment
+    uint32_t largestUnreservedRun(uint32_t from, uint32_t to) const;
+
+    /// lists reserved areas which intersect [from, to] segment
+    ///
+    /// \param intervals[out]   sorted non-overlapping (first, last) pairs, clipped to segment
+    void getReservedIntervals(uint32_t from, uint32_t to,
+                              std::vector<std::pair<uint32_t, uint32_t> > &intervals) const;
+
     /// \return true if \param block_idx points to bitmap
     bool blockIsBitmap(uint32_t block_idx) const;
 
@@ -540,28 +761,428 @@ private:
     bool blockIsSuperblock(uint32_t block_idx) const;
 };
 
+/// set of leaf block numbers, stored as sorted array.
+///
+/// Inserts go to unsorted tail first and are merged into sorted part in batches. Costs about
+/// four bytes per element, compared to tens of bytes per std::set node.
+class LeafSet {
+public:
+    void insert(uint32_t leaf_idx);
+    void erase(uint32_t leaf_idx);
+    /// replaces \param old_idx with \param new_idx, if former is present
+    void replace(uint32_t old_idx, uint32_t new_idx);
+    uint32_t size() const;
+    /// sorted list of leaves
+    const std::vector<uint32_t> &items() const;
+    /// replaces content with \param sorted_leaves, which must be sorted and unique.
+    /// Argument is left empty
+    void assign(std::vector<uint32_t> &sorted_leaves);
+    /// \return heap memory used, in bytes
+    uint64_t memoryUsage() const;
+
+private:
+    mutable std::vector<uint32_t> sorted;
+    mutable std::vector<uint32_t> pending;
+
+    void compact() const;
+};
+
+/// sorted array of entries with unique 64-bit keys, for indices of millions of entries.
+///
+/// Entry type provides key(). Entries inserted out of order go to small sorted overlay, and
+/// erased entries of main array are only marked. Overlay is merged into main array once it
+/// grows beyond square root of main array size, so both lookups and updates stay cheap.
+template <typename T>
+class FlatIndex {
+public:
+    FlatIndex() : erased_count(0) {}
+    /// replaces content with \param entries, which get sorted. Later of entries with the
+    /// same key is dropped. Argument is left empty
+    void assign(std::vector<T> &entries);
+    void clear();
+    uint32_t size() const
+        { return this->sorted.size() - this->erased_count + this->pending.size(); }
+    /// \return entry with \param key, or NULL if there is none. Key of returned entry must
+    /// not be changed
+    T *find(uint64_t key);
+    const T *find(uint64_t key) const
+        { return const_cast<FlatIndex *>(this)->find(key); }
+    /// adds \param entry, replacing one with the same key
+    void insert(const T &entry);
+    /// removes entry with \param key, if any
+    void erase(uint64_t key);
+    /// appends entries with keys within [\param lo, \param hi] to \param out, in key order
+    void collect(uint64_t lo, uint64_t hi, std::vector<T> &out) const;
+    /// all entries in key order
+    const std::vector<T> &items() const;
+    /// \return heap memory used, in bytes
+    uint64_t memoryUsage() const;
+
+private:
+    /// overlay is never merged before it grows to that size
+    static const uint32_t PENDING_MIN = 64;
+    mutable std::vector<T> sorted;
+    mutable std::vector<bool> erased;   //< marks for entries of sorted
+    mutable std::vector<T> pending;     //< sorted overlay
+    mutable uint32_t erased_count;
+
+    void compact() const;
+    static bool keyLess(const T &a, uint64_t key) { return a.key() < key; }
+    static bool entryLess(const T &a, const T &b) { return a.key() < b.key(); }
+    static bool entrySameKey(const T &a, const T &b) { return a.key() == b.key(); }
+};
+
+template <typename T>
+void
+FlatIndex<T>::assign(std::vector<T> &entries)
+{
+    std::stable_sort(entries.begin(), entries.end(), entryLess);
+    entries.erase(std::unique(entries.begin(), entries.end(), entrySameKey), entries.end());
+    std::vector<T>(entries.begin(), entries.end()).swap(this->sorted);
+    std::vector<T>().swap(entries);
+    std::vector<bool>(this->sorted.size(), false).swap(this->erased);
+    std::vector<T>().swap(this->pending);
+    this->erased_count = 0;
+}
+
+template <typename T>
+void
+FlatIndex<T>::clear()
+{
+    std::vector<T>().swap(this->sorted);
+    std::vector<bool>().swap(this->erased);
+    std::vector<T>().swap(this->pending);
+    this->erased_count = 0;
+}
+
+template <typename T>
+T *
+FlatIndex<T>::find(uint64_t key)
+{
+    typename std::vector<T>::iterator it =
+        std::lower_bound(this->sorted.begin(), this->sorted.end(), key, keyLess);
+    if (it != this->sorted.end() and it->key() == key
+        and not this->erased[it - this->sorted.begin()])
+    {
+        return &*it;
+    }
+    it = std::lower_bound(this->pending.begin(), this->pending.end(), key, keyLess);
+    if (it != this->pending.end() and it->key() == key)
+        return &*it;
+    return NULL;
+}
+
+template <typename T>
+void
+FlatIndex<T>::insert(const T &entry)
+{
+    const uint64_t key = entry.key();
+    if (this->pending.empty() and (this->sorted.empty() or this->sorted.back().key() < key)) {
+        // appending in order, no need to merge anything
+        this->sorted.push_back(entry);
+        this->erased.push_back(false);
+        return;
+    }
+    typename std::vector<T>::iterator it =
+        std::lower_bound(this->sorted.begin(), this->sorted.end(), key, keyLess);
+    if (it != this->sorted.end() and it->key() == key) {
+        // replace entry, or revive erased one in place
+        const uint32_t idx = it - this->sorted.begin();
+        if (this->erased[idx]) {
+            this->erased[idx] = false;
+            this->erased_count --;
+        }
+        *it = entry;
+        return;
+    }
+    it = std::lower_bound(this->pending.begin(), this->pending.end(), key, keyLess);
+    if (it != this->pending.end() and it->key() == key) {
+        *it = entry;
+        return;
+    }
+    this->pending.insert(it, entry);
+    if (this->pending.size() >= PENDING_MIN
+        and static_cast<uint64_t>(this->pending.size()) * this->pending.size()
+            > this->sorted.size())
+    {
+        this->compact();
+    }
+}
+
+template <typename T>
+void
+FlatIndex<T>::erase(uint64_t key)
+{
+    typename std::vector<T>::iterator it =
+        std::lower_bound(this->sorted.begin(), this->sorted.end(), key, keyLess);
+    if (it != this->sorted.end() and it->key() == key) {
+        const uint32_t idx = it - this->sorted.begin();
+        if (not this->erased[idx]) {
+            this->erased[idx] = true;
+            this->erased_count ++;
+            if (this->erased_count > this->sorted.size() / 2)
+                this->compact();
+        }
+        return;
+    }
+    it = std::lower_bound(this->pending.begin(), this->pending.end(), key, keyLess);
+    if (it != this->pending.end() and it->key() == key)
+        this->pending.erase(it);
+}
+
+template <typename T>
+void
+FlatIndex<T>::collect(uint64_t lo, uint64_t hi, std::vector<T> &out) const
+{
+    const uint32_t first_out = out.size();
+    typename std::vector<T>::const_iterator it =
+        std::lower_bound(this->sorted.begin(), this->sorted.end(), lo, keyLess);
+    for (; it != this->sorted.end() and it->key() <= hi; ++ it) {
+        if (not this->erased[it - this->sorted.begin()])
+            out.push_back(*it);
+    }
+    const uint32_t from_pending = out.size();
+    it = std::lower_bound(this->pending.begin(), this->pending.end(), lo, keyLess);
+    for (; it != this->pending.end() and it->key() <= hi; ++ it)
+        out.push_back(*it);
+    std::inplace_merge(out.begin() + first_out, out.begin() + from_pending, out.end(),
+                       entryLess);
+}
+
+template <typename T>
+const std::vector<T> &
+FlatIndex<T>::items() const
+{
+    this->compact();
+    return this->sorted;
+}
+
+template <typename T>
+uint64_t
+FlatIndex<T>::memoryUsage() const
+{
+    return (this->sorted.capacity() + this->pending.capacity()) * sizeof(T)
+        + this->erased.capacity() / 8;
+}
+
+template <typename T>
+void
+FlatIndex<T>::compact() const
+{
+    if (this->pending.empty() and 0 == this->erased_count)
+        return;
+    std::vector<T> merged;
+    merged.reserve(this->size());
+    typename std::vector<T>::iterator p_it = this->pending.begin();
+    for (uint32_t k = 0; k < this->sorted.size(); k ++) {
+        if (this->erased[k])
+            continue;
+        // keys of live entries never repeat between two parts
+        while (p_it != this->pending.end() and p_it->key() < this->sorted[k].key())
+            merged.push_back(*p_it ++);
+        merged.push_back(this->sorted[k]);
+    }
+    merged.insert(merged.end(), p_it, this->pending.end());
+    this->sorted.swap(merged);
+    std::vector<bool>(this->sorted.size(), false).swap(this->erased);
+    std::vector<T>().swap(this->pending);
+    this->erased_count = 0;
+}
+
+class ReiserFs;
+
+/// position in the tree: path from root down to some leaf, along with delimiting keys of
+/// every node on that path.
+///
+/// Consecutive lookups with nearby keys climb only as high as needed instead of descending
+/// from root each time. Cursor keeps block numbers only, never Block objects, so it's safe
+/// to keep it across moveBlocks. When tree nodes move, tree generation changes and cursor
+/// descends from root on next use.
+class TreeCursor {
+public:
+    TreeCursor(const ReiserFs &fs);
+    /// positions cursor at leaf which covers \param key
+    void seek(const Block::key_t &key);
+    /// steps to next leaf in key order
+    ///
+    /// \return false if there is no next leaf. Cursor must be repositioned with seek then
+    bool nextLeaf();
+    /// block number of current leaf
+    uint32_t leaf() const;
+    /// delimiting keys of current leaf. All its items are in [leftKey(), rightKey())
+    const Block::key_t &leftKey() const;
+    const Block::key_t &rightKey() const;
+
+private:
+    struct path_element {
+        uint32_t block;
+        uint32_t level;
+        uint32_t slot;          //< child on the path, internal nodes only
+        uint32_t ptr_count;     //< child count, internal nodes only
+        Block::key_t left;
+        Block::key_t right;
+    };
+    const ReiserFs &fs;
+    std::vector<path_element> path;     //< root goes first
+    uint32_t generation;                //< tree generation path is valid for
+
+    /// goes down from the last node of the path to leaf covering \param key
+    void descend(const Block::key_t &key);
+    /// appends child \param slot of \param block_obj, which is last node of the path
+    void pushChild(const Block *block_obj, uint32_t slot);
+};
+
+/// read-only parallel traversal of tree internal nodes.
+///
+/// Tree is split at internal nodes into subtree tasks. Every worker thread keeps its own task
+/// queue, takes tasks from its back, and steals from front of other queues when own one runs
+/// dry, so large subtrees near root get spread across threads. Children of every internal
+/// node are prefetched before they are queued. Nodes are read directly from disk, block cache
+/// is not used, so all transactions must be flushed before walk.
+class TreeWalker {
+public:
+    /// tree node, as reported by walker
+    struct node {
+        uint32_t block;
+        uint32_t parent;    //< parent node, zero for root
+        uint16_t slot;      //< pointer index within parent
+        uint16_t level;     //< level of node itself
+    };
+    /// \param fd file descriptor of device
+    /// \param thread_count worker thread count
+    TreeWalker(int fd, uint32_t thread_count);
+    /// walks tree with root \param root_idx of height \param tree_height and fills \param nodes
+    /// in key order, with every node preceding its subtree. Leaves are listed, but never read
+    void walk(uint32_t root_idx, uint32_t tree_height, std::vector<node> &nodes);
+
+private:
+    int fd;
+    uint32_t thread_count;
+};
+
 class ReiserFs {
 public:
     typedef struct {
         uint32_t type;
         uint32_t idx;
     } tree_element;
+    /// location of pointer to data block
+    struct data_ref {
+        uint32_t leaf;      //< leaf block
+        uint32_t item;      //< indirect item index within leaf
+        uint32_t pos;       //< pointer index within item
+    };
+    /// consecutive data blocks referred by consecutive pointers of one indirect item
+    struct ref_run {
+        uint32_t start;     //< first data block
+        uint32_t leaf;
+        uint32_t len:11;
+        uint32_t item:10;
+        uint32_t pos:11;    //< pointer index of first block
+    };
     struct leaf_index_entry {
         leaf_index_entry() { changed = false; };
         bool changed;
-        std::set<uint32_t> leaves;
+        LeafSet leaves;
+        std::vector<ref_run> runs;  //< sorted by start, non-overlapping
+    };
+    /// position of tree node in tree
+    struct node_link {
+        uint32_t parent;    //< parent node, zero for root
+        uint16_t slot;      //< pointer index within parent
+        uint16_t level;     //< level of node itself
+    };
+    /// node index entry
+    struct node_entry {
+        uint32_t block;
+        node_link link;
+        uint64_t key() const { return this->block; }
+    };
+    /// reverse link of leaf index: leaf points to some data blocks in basket
+    struct basket_link {
+        uint32_t leaf;
+        uint32_t basket;
+        uint64_t key() const { return static_cast<uint64_t>(this->leaf) << 32 | this->basket; }
+    };
+    /// tree node move along with its position in tree
+    struct node_move {
+        uint32_t from;
+        uint32_t to;
+        node_link link;
+        bool operator<(const node_move &b) const {
+            // lower levels first, then group by parent
+            if (this->link.level != b.link.level) return this->link.level < b.link.level;
+            if (this->link.parent != b.link.parent) return this->link.parent < b.link.parent;
+            return this->link.slot < b.link.slot;
+        }
+    };
+    /// data block move along with location of pointer to it
+    struct data_move {
+        uint32_t from;
+        uint32_t to;
+        data_ref ref;
+        bool operator<(const data_move &b) const {
+            if (this->ref.leaf != b.ref.leaf) return this->ref.leaf < b.ref.leaf;
+            if (this->ref.item != b.ref.item) return this->ref.item < b.ref.item;
+            return this->ref.pos < b.ref.pos;
+        }
+    };
+    /// what is known about one object (file or directory)
+    struct catalog_entry {
+        uint64_t obj;               //< (dir_id, obj_id), as upper word of normalized key
+        uint32_t block_count;       //< blocks defrag walk returned, leaves included
+        uint32_t fragment_count;    //< breaks between extents of those blocks
+        uint32_t access_time;       //< latest of atime and mtime, zero if there is no stat
+        bool dirty;                 //< object or its leaves moved since last visit
+        bool settled;               //< last visit found nothing to do
+        Block::key_t key() const {
+            return Block::key_t(KEY_V0, this->obj >> 32, this->obj & 0xffffffffu, 0, 0);
+        }
     };
 
     ReiserFs();
     ~ReiserFs();
-    int open(const std::string &name, bool o_sync = true);
+    /// opens fs, builds leaf index. Fs is marked dirty until close() unless \param read_only
+    /// is set. Read-only fs must not be changed: nothing is written to it, not even on close
+    int open(const std::string &name, bool o_sync = true, bool read_only = false);
     void close();
     uint32_t moveBlocks(movemap_t &movemap);
+    /// while held, moveBlocks leaves free extent lists untouched, so other thread may
+    /// allocate from them meanwhile. Lists of changed AGs are rescanned on release
+    void holdFreeExtents(bool hold);
     void dumpSuperblock();
     void useDataJournaling(bool use);
     uint32_t freeBlockCount() const;
     void setCacheSize(uint32_t mib) { this->cache_size = mib; }
+    /// sets how many parallel streams copy unformatted blocks. One, which is default,
+    /// copies them sequentially
+    void setIOStreams(uint32_t count) { this->io_streams = std::max(1u, count); }
     uint32_t cacheSize() const { return this->cache_size; }
+    /// keep leaf index in file \param fname between runs. Empty name disables that
+    void setIndexCacheFile(const std::string &fname) { this->index_cache_file = fname; }
+    uint32_t rootBlock() const { return this->sb.s_root_block; }
+    uint32_t treeHeight() const { return this->sb.s_tree_height; }
+    /// changes every time tree nodes are moved
+    uint32_t treeGeneration() const { return this->tree_generation; }
+    /// number of threads reading leaves when leaf index is built. Zero selects automatically
+    void setThreadCount(uint32_t count);
+    uint32_t threadCount() const { return this->thread_count; }
+
+    /// objects of the tree in key order. Catalog is collected while leaf index is built,
+    /// or on first call if index was loaded from cache
+    uint32_t objectCount();
+    const catalog_entry &catalogEntry(uint32_t idx) const { return this->object_catalog[idx]; }
+    /// finds catalog entry of object \param key belongs to
+    ///
+    /// \return pointer to entry, NULL if there is no such object
+    const catalog_entry *findCatalogEntry(const Block::key_t &key) const;
+    /// records results of visit to object \param idx, clearing its dirty flag
+    void updateCatalogEntry(uint32_t idx, uint32_t block_count, uint32_t fragment_count,
+                            bool settled);
+    /// marks all objects dirty, so they are all visited again
+    void markAllObjectsDirty();
+    /// hands out catalog indices of objects that became dirty since previous call
+    void takeDirtiedObjects(std::vector<uint32_t> &objs);
 
     // proxies for FsJournal methods
     Block* readBlock(uint32_t block) const;
@@ -578,6 +1199,18 @@ public:
 
     Block::key_t findObject(const std::string &fname) const;
     Block::key_t findObjectAt(const std::string &fname, const Block::key_t &at) const;
+    /// directory entry, as readdir returns it
+    struct dir_entry {
+        uint32_t hash;          //< name hash, without generation bits
+        Block::key_t key;       //< object entry points to
+        std::string name;
+    };
+    /// lists visible entries of directory \param dir in readdir (hash) order
+    void readDirectory(const Block::key_t &dir, std::vector<dir_entry> &entries) const;
+    /// reads stat item of object \param obj
+    ///
+    /// \return RFSD_OK on success, RFSD_FAIL if object has no stat item
+    int getObjectStat(const Block::key_t &obj, Block::stat_info &info) const;
     uint32_t getStringHashR5(const std::string &s) const;
 
     /// walk tree, collecting leaves
@@ -608,12 +1241,35 @@ public:
     void cleanupRegionMoveDataDown(uint32_t from, uint32_t to);
 
     int squeezeDataBlocksInAG(uint32_t ag);
+
+    /// moves blocks according to \param movemap, which may contain overlapping moves
+    ///
+    /// Unlike moveBlocks, target block may be occupied, if its content is moved too by the
+    /// same map. Map decomposed into chains and cycles, which are executed by conflict-free
+    /// waves, one moveBlocks call each. Cycles and chains longer than \param max_wave_count
+    /// are cut by parking one of their blocks in spare free block, thus each block moved
+    /// once, except parked ones, which are moved twice.
+    /// \return RFSD_OK on success, RFSD_FAIL if map is malformed or there is no spare space
+    int movePermutation(const movemap_t &movemap, uint32_t max_wave_count = 64);
+
     /// print movemap contents to stdout
     void dumpMovemap(const movemap_t &movemap) const;
 
     /// moves all movable blocks outside AG
     int sweepOutAG(uint32_t ag);
 
+    /// \return count of leaves (as seen by leaf index) referring blocks in [from, to] range
+    uint32_t leafCountForBlockRange(uint32_t from, uint32_t to);
+
+    /// data blocks referred by one leaf, as seen by leaf index
+    struct leaf_data_span {
+        uint32_t leaf;
+        uint32_t first;         //< lowest data block
+        uint32_t distance;      //< from leaf to nearest data block
+    };
+    /// lists every leaf referring data blocks, sorted by leaf
+    void getLeafDataSpans(std::vector<leaf_data_span> &spans) const;
+
     /// marks AG # \param ag as unavailable for sweeping
     void sealAG(uint32_t ag);
 
@@ -635,14 +1291,42 @@ private:
     std::string fname;
     int fd;
     bool closed;
+    bool read_only;                     //< opened for reading only, see open()
     bool use_data_journaling;
     std::string err_string;
     uint32_t blocks_moved_formatted;    //< counter used for moveMultipleBlocks
     uint32_t blocks_moved_unformatted;  //< counter used for moveMultipleBlocks
     std::vector<leaf_index_entry> leaf_index;
+    /// reverse links for leaf index: baskets every leaf appears in
+    FlatIndex<basket_link> leaf_baskets;
+    /// parent and slot of every tree node, built along with leaf index
+    FlatIndex<node_entry> node_index;
+    /// filesystem state leaf index corresponds to
+    struct index_stamp {
+        uint32_t block_count;
+        uint32_t root_block;
+        uint32_t free_blocks;
+        uint32_t tree_height;
+        uint32_t mount_id;
+        uint32_t last_flush_id;
+        uint32_t granularity;
+    };
+    index_stamp open_stamp;         //< state at the moment fs was opened
+    std::string index_cache_file;
+    bool leaf_index_ready;
     uint32_t leaf_index_granularity;    //< size of each basket for leaf index
     static int interrupt_state;
     uint32_t cache_size;
+    uint32_t io_streams;                //< see setIOStreams
+    uint32_t thread_count;              //< worker threads for tree walk, leaf scan and planning
+    uint32_t tree_generation;
+    bool free_extents_held;             //< see holdFreeExtents
+    /// sorted by object, see catalog_entry
+    std::vector<catalog_entry> object_catalog;
+    bool object_catalog_ready;
+    std::vector<uint32_t> dirtied_objects;  //< entries turned dirty, see takeDirtiedObjects
+    /// tree walks start from where previous one stopped
+    mutable TreeCursor cursor;
     std::vector<bool> sealed_ags;
 
     int readSuperblock();
@@ -650,47 +1334,82 @@ private:
     void writeSuperblock();
     bool movemapConsistent(const movemap_t &movemap);
     void collectLeafNodeIndices(uint32_t block_idx, std::vector<uint32_t> &lni);
-    void recursivelyMoveInternalNodes(uint32_t block_idx, movemap_t &movemap,
-        uint32_t target_level);
-    /// traverses tree, moves unformatted blocks
-    void recursivelyMoveUnformatted(uint32_t block_idx, movemap_t &movemap);
-    uint32_t estimateTreeHeight();
-    void recursivelyEnumerateNodes(uint32_t block_idx, std::vector<ReiserFs::tree_element> &tree,
-                                   bool only_internal_nodes) const;
-    /// worker method for leaves enumeration
-    ///
-    /// \param block_idx[in]        target block
-    /// \param start_key[in]        do not process items with keys lower that \p start_key
-    /// \param soft_threshold[in/out] stop walking tree after so many blocks collected
-    /// \param left[in]             left border hint
-    /// \param right[in]            right border hint
-    /// \param leaves[out]          output vector which receives leaf list
-    /// \param last_key[out]        receives key of last processed item
-    void recursivelyEnumerateLeaves(uint32_t block_idx, const Block::key_t &start_key,
-                                    int &soft_threshold, Block::key_t left, Block::key_t right,
-                                    std::vector<uint32_t> &leaves, Block::key_t &last_key) const;
-    /// creates list of leaves that point to blocks in specific basket
+    /// moves children of node @parent_idx listed in [@first, @last)
+    void moveChildNodes(uint32_t parent_idx, std::vector<node_move>::const_iterator first,
+                        std::vector<node_move>::const_iterator last);
+    /// updates node index after node moved from \param old_idx to \param new_idx
+    ///
+    /// \param children[in]     child nodes of moved node
+    void relinkNode(uint32_t old_idx, uint32_t new_idx, const std::vector<uint32_t> &children);
+    /// appends pointers of internal node \param block_idx to \param children
+    void getChildNodes(uint32_t block_idx, std::vector<uint32_t> &children) const;
+    /// lists all tree nodes in key order with TreeWalker, flushing transactions first
+    void walkTree(std::vector<TreeWalker::node> &nodes) const;
+    /// fills \param stamp with current filesystem state
+    void getIndexStamp(index_stamp &stamp) const;
+    /// saves leaf index, node index and object catalog to index cache file
+    int saveLeafIndex();
+    /// loads leaf index, node index and object catalog from index cache file, if it matches
+    /// \param stamp
+    ///
+    /// \return RFSD_OK if index was loaded, RFSD_FAIL if it needs to be rebuilt
+    int loadLeafIndex(const index_stamp &stamp);
+    /// creates list of leaves that point to blocks in specific basket, along with exact
+    /// data block to pointer map
     ///
     /// \return RFSD_OK on success and RFSD_FAIL on failure
     int createLeafIndex();
-    /// removes obsolete entries after block movement
+    /// fills object catalog from sorted list of objects \param objs. List is left empty
+    void setObjectCatalog(std::vector<uint64_t> &objs);
+    /// sets access times of catalog entries from (object, time) pairs \param times.
+    /// List is left empty
+    void setObjectTimes(std::vector<std::pair<uint64_t, uint32_t> > &times);
+    /// collects object catalog by walking all leaves
+    void buildObjectCatalog();
+    void markObjectDirty(uint64_t obj);
+    /// marks dirty every object having items in leaf \param leaf_idx
+    void markLeafObjectsDirty(uint32_t leaf_idx);
+    /// rebuilds leaf lists of changed baskets from their pointer runs
     void updateLeafIndex();
+    /// finds pointer to data block \param block_idx
+    ///
+    /// \return true if block is referred by some indirect item, false otherwise
+    bool findDataRef(uint32_t block_idx, data_ref &ref) const;
+    /// forgets pointer to data block \param block_idx
+    void removeDataRef(uint32_t block_idx);
+    /// records that data block \param block_idx is referred from \param ref
+    void addDataRef(uint32_t block_idx, const data_ref &ref);
+    /// adds reverse link from leaf to basket, if not yet there
+    void linkLeafToBasket(uint32_t leaf_idx, uint32_t basket_id);
+    void unlinkLeafFromBasket(uint32_t leaf_idx, uint32_t basket_id);
+    /// updates leaf index after leaf moved from \param old_idx to \param new_idx
+    void renameLeafInIndex(uint32_t old_idx, uint32_t new_idx);
+    /// collects pointers to data blocks in range [\param from, \param to]
+    void getDataRefsForBlockRange(std::vector<data_move> &refs, uint32_t from, uint32_t to);
 
     /// move unformatted blocks of specific leaf
     ///
-    /// permorm move of unformatted data blocks provided in @movemap from leaf specified by
-    /// @block_idx. Takes @key_list as mandatory hint
-    void leafContentMoveUnformatted(uint32_t block_idx, movemap_t &movemap,
-                                    const std::set<Block::key_t> &key_list, bool all_keys = false);
+    /// moves data blocks listed in [@first, @last), all of which are referred from leaf
+    /// @block_idx
+    void leafContentMoveUnformatted(uint32_t block_idx,
+                                    std::vector<data_move>::const_iterator first,
+                                    std::vector<data_move>::const_iterator last);
     void getLeavesForBlockRange(std::vector<uint32_t> &leaves, uint32_t from, uint32_t to);
-    void getLeavesForMovemap(std::vector<uint32_t> &leaves, const movemap_t &movemap);
 
-    /// inner worker function for getLeavesOfObject
-    bool recursivelyGetBlocksOfObject(const uint32_t leaf_idx, const Block::key_t &start_key,
-                                      const uint32_t object_type, const Block::key_t left,
-                                      const Block::key_t right, uint32_t &start_offset,
-                                      blocklist_t &blocks, Block::key_t &next_key,
-                                      uint32_t &next_offset, uint32_t &limit) const;
+    /// collects blocks of object from leaf \param leaf_idx
+    ///
+    /// Parameters are those of getIndirectBlocksOfObject, \param object_type selects items
+    /// to take: indirect ones for file data, or directory ones for directory leaves.
+    /// \return false if \param limit was reached
+    bool collectBlocksOfObject(uint32_t leaf_idx, const Block::key_t &start_key,
+                               const uint32_t object_type, uint32_t &start_offset,
+                               blocklist_t &blocks,
+                               Block::key_t &next_key, uint32_t &next_offset,
+                               uint32_t &limit) const;
+    /// walks leaves starting from \param start_key, collecting blocks of object
+    void getBlocksOfObject(const Block::key_t &start_key, const uint32_t object_type,
+                           uint32_t &start_offset, blocklist_t &blocks, Block::key_t &next_key,
+                           uint32_t &next_offset, uint32_t &limit) const;
 
     static void interruptSignalHandler(int arg);
 };
@@ -702,17 +1421,49 @@ class Defrag {
 public:
     Defrag (ReiserFs &fs);
 
+    /// where tree leaves are placed relative to data blocks
+    enum metadata_placement {
+        METADATA_INTERLEAVED,   //< as algorithm puts them, between data in tree order
+        METADATA_ZONE,          //< grouped together with internal nodes
+        METADATA_NEAR_DATA,     //< next to data blocks they refer
+    };
+
+    /// part of object, planned as single defrag task
+    struct plan_unit {
+        std::vector<uint32_t>::const_iterator obj_it;   //< object, in list of visited ones
+        Block::key_t start_key;         //< where part begins
+        uint32_t start_offset;
+        uint32_t raw_count;             //< block count, including sparse ones
+        bool last;                      //< whether part is last one of object
+        std::vector<uint32_t> blocks;   //< data blocks, sparse ones excluded
+        movemap_t movemap;              //< planned moves
+        int outcome;                    //< one of plan_outcome values
+    };
+
     /// performs defragmentation by sorting blocks in tree order
     ///
     /// \param batch_size[in]   controls batch granularity
     /// \return RFSD_OK on success, RFSD_FAIL otherwise
     int treeThroughDefrag(uint32_t batch_size = 16000);
 
+    /// packs tree nodes only, internal nodes first, then leaves in key order, into
+    /// contiguous region. Unformatted blocks are never moved
+    ///
+    /// \return RFSD_OK on success, RFSD_FAIL otherwise
+    int metadataDefrag();
+
+    /// packs small files of every directory together, in readdir order, walking directory
+    /// tree from the root depth-first. Files are moved to the beginning of the fs
+    ///
+    /// \return RFSD_OK on success, RFSD_FAIL otherwise
+    int directoryDefrag();
+
     /// performs incremental defragmentation
     ///
     /// \param batch_size[in]               controls batch granularity
-    /// \param use_previous_estimation[in]  use previous estimation instead of doing it again
-    ///                                     have no effect on first use
+    /// \param use_previous_estimation[in]  skip objects previous passes found in order and
+    ///                                     nothing moved since. Otherwise all objects
+    ///                                     are visited
     /// \return RFSD_OK on success, RFSD_FAIL otherwise
     int incrementalDefrag(uint32_t batch_size = 8000, bool use_previous_estimation = true);
 
@@ -725,17 +1476,64 @@ public:
     /// moves files to beginning of the fs
     ///
     /// \param obj[in]          list of keys with (dir_id,obj_id) denoting a file to move
+    /// \param dry_run[in]      only print predicted cost of required AG sweeps
     /// \return RFSD_OK on success, RFSD_FAIL otherwise
-    int moveObjectsUp(const std::vector<Block::key_t> &objs);
+    int moveObjectsUp(const std::vector<Block::key_t> &objs, bool dry_run = false);
+
+    /// moves files to end of the fs, the same way moveObjectsUp moves them to beginning
+    ///
+    /// \param obj[in]          list of keys with (dir_id,obj_id) denoting a file to move
+    /// \param dry_run[in]      only print predicted cost of required AG sweeps
+    /// \return RFSD_OK on success, RFSD_FAIL otherwise
+    int moveObjectsDown(const std::vector<Block::key_t> &objs, bool dry_run = false);
+
+    /// picks regular files by access time (latest of atime and mtime) as stat items have
+    /// it, until their size reaches \param block_limit blocks
+    ///
+    /// \param hottest[in]      pick most recently used files if true, least recently otherwise
+    /// \param exclude[in]      objects not to pick
+    /// \param objs[out]        picked objects, in key order
+    void selectObjectsByAccessTime(uint64_t block_limit, bool hottest,
+                                   const std::vector<Block::key_t> &exclude,
+                                   std::vector<Block::key_t> &objs);
 
     /// prevent object in \param objs from moving
     void sealObjects(const std::vector<Block::key_t> &objs);
 
+    /// prints predicted cost of sweeping each AG, as used by freeOneAG
+    void showSweepCosts();
+
+    /// selects leaf placement policy, one of metadata_placement values
+    void setMetadataPlacement(int placement);
+
+    /// prints average distance from leaves to nearest data blocks they refer
+    void showLeafDataDistance();
+
 private:
+    /// collects blocks of all parts of object \param obj, sparse ones included
+    void getAllBlocksOfObject(const Block::key_t &obj, blocklist_t &blocks);
+    /// counts blocks of files \param objs, showing progress
+    ///
+    /// \return RFSD_OK on success, RFSD_FAIL if user asked for termination
+    int countBlocksOfObjects(const std::vector<Block::key_t> &objs, uint32_t &work_amount);
+    /// prints predicted cost of AG sweeps needed to pack \param work_amount blocks at
+    /// beginning of the fs, or at its end if \param at_end is true
+    int showPackingCost(uint32_t work_amount, bool at_end);
+
     ReiserFs &fs;
     uint32_t desired_extent_length;
-    uint32_t previous_obj_count;
+    int metadata_placement;             //< one of metadata_placement values
+    /// catalog indices of objects next incremental pass should visit
+    std::vector<uint32_t> worklist;
+    bool worklist_valid;
     std::set<Block::key_t> sealed_objs;
+    /// leaves referring blocks of AG, as sweep cost estimation counted them
+    struct ag_leaf_count {
+        uint32_t change_count;      //< AG change count at the moment of counting
+        uint32_t leaves;
+        bool valid;
+    };
+    std::vector<ag_leaf_count> leaf_count_cache;
 
     struct defrag_statistics_struct {
         uint32_t success_count;
@@ -750,15 +1548,105 @@ private:
         }
     } defrag_statistics;
 
+    /// predicted cost of sweeping out one AG
+    struct sweep_cost {
+        uint32_t ag;
+        uint32_t blocks_to_move;    //< used blocks, which will be evacuated
+        uint32_t leaves_to_rewrite; //< leaves referring blocks of AG
+        uint32_t extent_before;     //< largest free extent now
+        uint32_t extent_after;      //< largest free extent after sweep
+        uint64_t score;             //< lower is better, SWEEP_SCORE_INFEASIBLE if sweep is useless
+        bool operator < (const sweep_cost &b) const {
+            if (score != b.score) return score < b.score;
+            return ag < b.ag;
+        }
+    };
+    static const uint64_t SWEEP_SCORE_INFEASIBLE = ~0ull;
+
+    /// outcome of defrag task planning
+    enum plan_outcome {
+        PLAN_IN_ORDER,      //< blocks are in order already, nothing to do
+        PLAN_SUCCESS,       //< every misplaced part got new place
+        PLAN_PARTIAL,       //< some of them did
+        PLAN_FAILURE,       //< none of them did
+        PLAN_DEFERRED,      //< own AG has no room, task should be planned sequentially
+    };
+
     uint32_t nextTargetBlock(uint32_t previous);
+    /// makes movemap which packs \param leaves and their data blocks starting from
+    /// \param free_idx. If \param leaf_free_idx is not NULL, leaves are packed from there
+    /// instead, apart from data
     void createMovemapFromListOfLeaves(movemap_t &movemap, const std::vector<uint32_t> &leaves,
-                                       uint32_t &free_idx);
+                                       uint32_t &free_idx, uint32_t *leaf_free_idx = NULL);
+    /// \return block, which follows \param count target blocks starting from \param first
+    uint32_t skipTargetBlocks(uint32_t first, uint32_t count);
+    /// moves leaves according to metadata placement policy, after incremental defrag
+    int placeMetadata();
+    /// moves leaves, which are far from their data, to free blocks nearby
+    int placeLeavesNearData();
+    /// plans final tree-through layout of every tree node and data block at once, and
+    /// carries it out with movePermutation
+    ///
+    /// \return RFSD_OK on success, RFSD_FAIL if layout is too large to plan in memory,
+    ///         there is not enough free space, or user asked for termination
+    int treeThroughGlobalLayout();
+    /// finds \param count blocks for metadata region. Only free blocks and tree nodes from
+    /// sorted \param nodes are suitable. Narrowest set of consecutive suitable blocks is
+    /// chosen, which is contiguous run if the fs has one. Of equal ones, set holding more
+    /// tree nodes is preferred, then lower one
+    ///
+    /// \param targets[out]     suitable blocks, ascending
+    /// \return RFSD_OK on success, RFSD_FAIL if there is not enough suitable blocks
+    int findMetadataRegion(const std::vector<uint32_t> &nodes, uint32_t count,
+                           std::vector<uint32_t> &targets);
+    /// adds moves of blocks occupying targets of \param movemap, which don't move
+    /// themselves, to free blocks below \param evict_idx, but above \param region_end
+    ///
+    /// \param evict_idx[in,out]    eviction area border, lowers as blocks are evicted
+    /// \return RFSD_OK on success, RFSD_FAIL if there is no room above region
+    int evictBlocksInTheWay(movemap_t &movemap, uint32_t region_end, uint32_t &evict_idx);
     /// prepare movement map that defragments file specified by \param blocks
     ///
     /// \param  blocks[in]      block list
     /// \param  movemap[out]    resulting movement map
-    /// \return RFSD_OK on partial success and RFSD_FAIL if all attempts failed
-    int prepareDefragTask(std::vector<uint32_t> &blocks, movemap_t &movemap);
+    /// \param  own_ag_only[in] allocate in AG of first block only, which is safe to do
+    ///                         in parallel for tasks starting in different AGs
+    /// \return one of plan_outcome values
+    int planDefragTask(const std::vector<uint32_t> &blocks, movemap_t &movemap,
+                       bool own_ag_only);
+    /// plans \param units in parallel, as if they were planned one by one
+    void planDefragTasks(std::vector<plan_unit> &units);
+    static void *planWorker(void *arg);
+    /// updates defrag statistics with result of one task
+    void countPlanOutcome(int outcome);
+    /// returns targets of planned, but not executed \param movemap to free extent lists
+    void releaseMovemapTargets(const movemap_t &movemap);
+    /// splits targets of \param movemap into contiguous \param extents, one AG each
+    void getMovemapTargetExtents(const movemap_t &movemap,
+                                 std::vector<FsBitmap::extent_t> &extents);
+
+    /// position of incremental defrag in its list of objects
+    struct object_walk {
+        std::vector<uint32_t>::const_iterator first;    //< list begin, for progress display
+        std::vector<uint32_t>::const_iterator obj_it;   //< object being read
+        std::vector<uint32_t>::const_iterator last;     //< list end
+        bool obj_open;              //< whether next part continues object at obj_it
+        Block::key_t obj_key;
+        Block::key_t start_key;     //< where next part begins
+        uint32_t start_offset;
+    };
+    /// reads parts of objects starting from \param walk, about \param batch_size blocks
+    /// in total, and fills \param units with them
+    ///
+    /// \return RFSD_FAIL if user asked for termination, RFSD_OK otherwise
+    int collectPlanUnits(object_walk &walk, uint32_t batch_size, std::vector<plan_unit> &units);
+    static void *planAheadWorker(void *arg);
+    /// makes free extent lists of AGs holding targets of \param units be rebuilt on next
+    /// update, as planning took those targets out of lists
+    void requestPlannedTargetsRescan(const std::vector<plan_unit> &units);
+    /// reserves targets of \param units planned while blocks were moving, and plans again
+    /// those parts whose targets are taken
+    void confirmPlannedTargets(std::vector<plan_unit> &units);
     uint32_t getDesiredExtentLengths(const std::vector<FsBitmap::extent_t> &extents,
                                      std::vector<uint32_t> &lengths, uint32_t target_length);
     void convertBlocksToExtents(const std::vector<uint32_t> &blocks,
@@ -778,6 +1666,25 @@ private:
     /// \return RFSD_OK on success, RFSD_FAIL otherwise
     int freeOneAG();
 
+    /// predicts I/O cost and free space gain of sweeping out AG
+    ///
+    /// \param ag[in]               AG to be evaluated
+    /// \param free_elsewhere[in]   count of free blocks available outside of AG
+    /// \param cost[out]            resulting estimation
+    void estimateSweepCost(uint32_t ag, uint32_t free_elsewhere, sweep_cost &cost);
+
+    /// \return count of leaves referring blocks of \param ag. Leaf index is consulted only
+    /// if AG was changed since last call
+    uint32_t AGLeafCount(uint32_t ag);
+
+    /// estimates sweep cost for every unsealed AG
+    ///
+    /// \param costs[out]   estimations, sorted by score, best candidate first
+    void rankSweepCandidates(std::vector<sweep_cost> &costs);
+
+    /// \return total count of free blocks in all AGs
+    uint32_t totalFreeBlockCount();
+
     /// prints defrag statistics to stdout
     void showDefragStatistics();
 
@@ -0,0 +1,138 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+// tree cursor: leaves in key order with their delimiting keys, seeks, and stepping on
+// after tree nodes were moved under it
+
+#include "testfs.hpp"
+#include <set>
+#include <unistd.h>
+
+static const char *IMAGE_NAME = "cursor_test.img";
+static const uint32_t IMAGE_SIZE = 32768;
+
+/// first and last item keys of every leaf
+static void
+leaf_keys(ReiserFs &fs, const std::vector<uint32_t> &leaves, std::vector<Block::key_t> &first,
+          std::vector<Block::key_t> &last)
+{
+    first.clear();
+    last.clear();
+    for (std::vector<uint32_t>::const_iterator it = leaves.begin(); it != leaves.end(); ++ it) {
+        Block *block_obj = fs.readBlock(*it);
+        first.push_back(block_obj->itemHeader(0).key);
+        last.push_back(block_obj->itemHeader(block_obj->itemCount() - 1).key);
+        fs.releaseBlock(block_obj);
+    }
+}
+
+/// whole walk must list \param leaves in order, with adjacent delimiting keys
+static void
+test_walk(ReiserFs &fs, const std::vector<uint32_t> &leaves)
+{
+    std::vector<Block::key_t> first, last;
+    leaf_keys(fs, leaves, first, last);
+    TreeCursor cursor(fs);
+    cursor.seek(Block::zero_key);
+    CHECK (cursor.leftKey() == Block::zero_key);
+    for (uint32_t k = 0; k < leaves.size(); k ++) {
+        CHECK (cursor.leaf() == leaves[k]);
+        CHECK (not (first[k] < cursor.leftKey()));
+        CHECK (last[k] < cursor.rightKey());
+        // internal nodes keep first key of every subtree but the leftmost
+        if (k > 0)
+            CHECK (cursor.leftKey() == first[k]);
+        const Block::key_t right = cursor.rightKey();
+        if (k + 1 < leaves.size()) {
+            CHECK (cursor.nextLeaf());
+            CHECK (cursor.leftKey() == right);
+        }
+    }
+    CHECK (cursor.rightKey() == Block::largest_key);
+    CHECK (not cursor.nextLeaf());
+}
+
+/// seeks back and forth by item keys reuse the path, and must land on the same leaves
+/// as fresh cursor does
+static void
+test_seek(ReiserFs &fs, const std::vector<uint32_t> &leaves, TestRandom &rnd)
+{
+    std::vector<Block::key_t> first, last;
+    leaf_keys(fs, leaves, first, last);
+    TreeCursor cursor(fs);
+    for (uint32_t k = 0; k < 2000; k ++) {
+        const uint32_t idx = rnd.below(leaves.size());
+        cursor.seek((0 == rnd.below(2)) ? first[idx] : last[idx]);
+        CHECK (cursor.leaf() == leaves[idx]);
+        TreeCursor fresh_cursor(fs);
+        fresh_cursor.seek(last[idx]);
+        CHECK (fresh_cursor.leaf() == leaves[idx]);
+    }
+}
+
+/// moves about half of tree nodes, root included, to random free blocks and updates
+/// \param leaves
+static void
+move_tree_nodes(ReiserFs &fs, TestRandom &rnd, std::vector<uint32_t> &leaves,
+                std::vector<uint32_t> &internal_nodes)
+{
+    std::set<uint32_t> taken;
+    movemap_t movemap;
+    std::vector<uint32_t> nodes(leaves);
+    nodes.insert(nodes.end(), internal_nodes.begin(), internal_nodes.end());
+    for (std::vector<uint32_t>::iterator it = nodes.begin(); it != nodes.end(); ++ it) {
+        if (0 != rnd.below(2) and *it != fs.rootBlock())
+            continue;
+        uint32_t target;
+        do {
+            target = rnd.below(fs.sizeInBlocks());
+        } while (fs.blockUsed(target) or fs.blockReserved(target) or taken.count(target));
+        taken.insert(target);
+        movemap.insert(*it, target);
+        *it = target;
+    }
+    movemap.normalize();
+    CHECK (movemap.size() == fs.moveBlocks(movemap));
+    std::vector<uint32_t>(nodes.begin(), nodes.begin() + leaves.size()).swap(leaves);
+    std::vector<uint32_t>(nodes.begin() + leaves.size(), nodes.end()).swap(internal_nodes);
+}
+
+int
+main()
+{
+    test_image img;
+    make_test_image(IMAGE_NAME, 36, IMAGE_SIZE, img);
+    TestRandom rnd(36);
+    ReiserFs fs;
+    CHECK (RFSD_OK == fs.open(IMAGE_NAME, false));
+    CHECK (img.leaves.size() > 16);
+    test_walk(fs, img.leaves);
+    test_seek(fs, img.leaves, rnd);
+
+    // cursor is stopped in the middle of walk while nodes move, and continues with new
+    // locations of the rest of leaves
+    for (uint32_t round = 0; round < 4; round ++) {
+        TreeCursor cursor(fs);
+        const uint32_t stop_idx = rnd.below(img.leaves.size() - 1);
+        std::vector<Block::key_t> first, last;
+        leaf_keys(fs, img.leaves, first, last);
+        cursor.seek(first[stop_idx]);
+        CHECK (cursor.leaf() == img.leaves[stop_idx]);
+        move_tree_nodes(fs, rnd, img.leaves, img.internal_nodes);
+        for (uint32_t k = stop_idx + 1; k < img.leaves.size(); k ++) {
+            CHECK (cursor.nextLeaf());
+            CHECK (cursor.leaf() == img.leaves[k]);
+        }
+        CHECK (not cursor.nextLeaf());
+        test_walk(fs, img.leaves);
+    }
+    fs.close();
+
+    CHECK (0 == verify_test_image(IMAGE_NAME, img));
+    ::unlink(IMAGE_NAME);
+    return test_result();
+}
@@ -0,0 +1,193 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+// leaf index cache: hit restores index and object catalog, changed filesystem or damaged
+// cache file make it rebuild index from scratch
+
+#include "testfs.hpp"
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+static const char *IMAGE_NAME = "indexcache_test.img";
+static const char *CACHE_NAME = "indexcache_test.idx";
+static const uint32_t IMAGE_SIZE = 32768;
+
+/// catalog entry that gets visit results recorded, to tell saved catalog from rebuilt one
+static const uint32_t VISITED_OBJ = 5;
+
+struct open_result {
+    std::string output;             //< what open printed
+    uint32_t obj_count;
+    uint32_t visited_block_count;   //< of VISITED_OBJ
+    std::vector<ReiserFs::leaf_data_span> spans;
+};
+
+static bool
+same_spans(const std::vector<ReiserFs::leaf_data_span> &a,
+           const std::vector<ReiserFs::leaf_data_span> &b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (uint32_t k = 0; k < a.size(); k ++) {
+        if (a[k].leaf != b[k].leaf or a[k].first != b[k].first or a[k].distance != b[k].distance)
+            return false;
+    }
+    return true;
+}
+
+/// opens fs, with or without cache, and closes it. Visit of VISITED_OBJ is recorded, so
+/// saved catalog has it
+static void
+open_and_close(bool use_cache, open_result &res)
+{
+    ReiserFs fs;
+    if (use_cache)
+        fs.setIndexCacheFile(CACHE_NAME);
+    std::ostringstream captured;
+    std::streambuf *saved_buf = std::cout.rdbuf(captured.rdbuf());
+    const int ret = fs.open(IMAGE_NAME, false);
+    std::cout.rdbuf(saved_buf);
+    res.output = captured.str();
+    CHECK (RFSD_OK == ret);
+    res.obj_count = fs.objectCount();
+    res.visited_block_count = fs.catalogEntry(VISITED_OBJ).block_count;
+    fs.updateCatalogEntry(VISITED_OBJ, 77, 3, true);
+    fs.getLeafDataSpans(res.spans);
+    fs.close();
+}
+
+/// index as built from scratch, without touching filesystem
+static void
+fresh_spans(std::vector<ReiserFs::leaf_data_span> &spans)
+{
+    ReiserFs fs;
+    CHECK (RFSD_OK == fs.open(IMAGE_NAME, false, true));
+    fs.getLeafDataSpans(spans);
+    fs.close();
+}
+
+static bool
+loaded(const open_result &res)
+{
+    return std::string::npos != res.output.find("loaded from");
+}
+
+static bool
+printed(const open_result &res, const char *msg)
+{
+    return std::string::npos != res.output.find(msg);
+}
+
+static uint32_t
+file_size(const char *fname)
+{
+    std::ifstream fp(fname, std::ios::binary | std::ios::ate);
+    return fp.tellg();
+}
+
+/// changes byte in free space of some leaf. Filesystem stays valid and its superblock
+/// doesn't change, but leaf checksum does
+///
+/// \return false if there is no leaf with free space
+static bool
+patch_leaf(const test_image &img)
+{
+    std::fstream fp(IMAGE_NAME, std::ios::binary | std::ios::in | std::ios::out);
+    for (std::vector<uint32_t>::const_iterator it = img.leaves.begin(); it != img.leaves.end();
+         ++ it)
+    {
+        Block::blockheader bh;
+        fp.seekg(static_cast<uint64_t>(*it) * BLOCKSIZE);
+        fp.read(reinterpret_cast<char *>(&bh), sizeof(bh));
+        if (bh.bh_free_space < 2)
+            continue;
+        fp.seekp(static_cast<uint64_t>(*it) * BLOCKSIZE + 24 + 24 * bh.bh_nr_items);
+        fp.write("x", 1);
+        return true;
+    }
+    return false;
+}
+
+int
+main()
+{
+    test_image img;
+    make_test_image(IMAGE_NAME, 34, IMAGE_SIZE, img);
+    ::unlink(CACHE_NAME);
+    std::vector<ReiserFs::leaf_data_span> spans;
+    open_result res;
+
+    // no cache yet
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (img.files.size() + 1 == res.obj_count);    // root directory is object too
+    CHECK (0 == res.visited_block_count);
+    CHECK (file_size(CACHE_NAME) > 0);
+
+    // cache hit. Catalog comes from cache along with index, visit results included
+    open_and_close(true, res);
+    CHECK (loaded(res));
+    CHECK (img.files.size() + 1 == res.obj_count);
+    CHECK (77 == res.visited_block_count);
+    fresh_spans(spans);
+    CHECK (same_spans(spans, res.spans));
+
+    // leaf changed in place, superblock is the same
+    CHECK (patch_leaf(img));
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (printed(res, "leaf contents changed"));
+    CHECK (0 == res.visited_block_count);
+    CHECK (same_spans(spans, res.spans));
+
+    // filesystem was opened without cache in between
+    open_and_close(false, res);
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (printed(res, "filesystem changed"));
+    CHECK (same_spans(spans, res.spans));
+
+    // trailer is missing
+    CHECK (0 == ::truncate(CACHE_NAME, file_size(CACHE_NAME) - 8));
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (printed(res, "file truncated"));
+    CHECK (same_spans(spans, res.spans));
+
+    // cut in the middle of index. Previous run saved good cache, check it's used first
+    open_and_close(true, res);
+    CHECK (loaded(res));
+    CHECK (0 == ::truncate(CACHE_NAME, file_size(CACHE_NAME) / 2));
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (0 == res.visited_block_count);
+    CHECK (same_spans(spans, res.spans));
+
+    // catalog cut off
+    open_and_close(true, res);
+    CHECK (loaded(res));
+    CHECK (0 == ::truncate(CACHE_NAME, file_size(CACHE_NAME) - 8 - 10));
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (0 == res.visited_block_count);
+
+    // not a cache file at all
+    {
+        std::fstream fp(CACHE_NAME, std::ios::binary | std::ios::in | std::ios::out);
+        fp.write("garbage!", 8);
+    }
+    open_and_close(true, res);
+    CHECK (not loaded(res));
+    CHECK (printed(res, "unknown format"));
+    CHECK (same_spans(spans, res.spans));
+
+    CHECK (0 == verify_test_image(IMAGE_NAME, img));
+    ::unlink(IMAGE_NAME);
+    ::unlink(CACHE_NAME);
+    return test_result();
+}
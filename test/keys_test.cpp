@@ -0,0 +1,117 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+// key ordering through canonical form against field by field comparison it replaced
+
+#include "testfs.hpp"
+#include <algorithm>
+
+/// type of key, as old comparator decoded it
+static uint32_t
+old_type(const Block::key_t &key)
+{
+    if (KEY_V1 == key.guessVersion())
+        return key.type_v1();
+    switch (key.type_v0()) {
+    case 0:          return KEY_TYPE_STAT;
+    case 0xfffffffe: return KEY_TYPE_INDIRECT;
+    case 0xffffffff: return KEY_TYPE_DIRECT;
+    case 500:        return KEY_TYPE_DIRECTORY;
+    case 555:        return KEY_TYPE_ANY;
+    default:         return 16;
+    }
+}
+
+static uint64_t
+old_offset(const Block::key_t &key)
+{
+    return (KEY_V1 == key.guessVersion()) ? key.offset_v1() : key.offset_v0();
+}
+
+/// dir_id, obj_id, offset, type, with format guessed for each key separately
+static bool
+old_less(const Block::key_t &a, const Block::key_t &b)
+{
+    if (a.dir_id != b.dir_id)
+        return a.dir_id < b.dir_id;
+    if (a.obj_id != b.obj_id)
+        return a.obj_id < b.obj_id;
+    if (old_offset(a) != old_offset(b))
+        return old_offset(a) < old_offset(b);
+    return old_type(a) < old_type(b);
+}
+
+/// key of either format with known type. Narrow ranges make ties on every field likely
+static Block::key_t
+random_key(TestRandom &rnd)
+{
+    static const uint32_t v0_types[] = { 0, 0xfffffffe, 0xffffffff, 500, 555 };
+    static const uint64_t offsets[] = { 0, 1, 2, 4097, 0xfffffffeu, 0xffffffffu };
+    const uint32_t dir_id = rnd.below(3);
+    const uint32_t obj_id = rnd.below(3);
+    const uint32_t offset_idx = rnd.below(7);
+    if (0 == rnd.below(2)) {
+        const uint32_t offset = (offset_idx < 6) ? offsets[offset_idx] : rnd.next();
+        return Block::key_t(KEY_V0, dir_id, obj_id, offset, v0_types[rnd.below(5)]);
+    }
+    // v1 keys of stat type are indistinguishable from v0 ones, so only 1..3 here
+    uint64_t offset = (offset_idx < 6) ? offsets[offset_idx] : rnd.next();
+    if (0 == rnd.below(4))
+        offset |= static_cast<uint64_t>(rnd.below(1u << 28)) << 32;
+    return Block::key_t(KEY_V1, dir_id, obj_id, offset, 1 + rnd.below(3));
+}
+
+static void
+test_pairs()
+{
+    TestRandom rnd(38);
+    for (uint32_t k = 0; k < 200000; k ++) {
+        const Block::key_t a = random_key(rnd);
+        const Block::key_t b = (0 == rnd.below(8)) ? a : random_key(rnd);
+        CHECK ((a < b) == old_less(a, b));
+        CHECK ((a > b) == old_less(b, a));
+        CHECK ((a <= b) == not old_less(b, a));
+        CHECK ((a >= b) == not old_less(a, b));
+        // equal in order means the same key, unless formats differ
+        if (a.guessVersion() == b.guessVersion())
+            CHECK ((a.normalized() == b.normalized()) == (a == b));
+    }
+}
+
+static void
+test_limits()
+{
+    TestRandom rnd(380);
+    for (uint32_t k = 0; k < 10000; k ++) {
+        const Block::key_t key = random_key(rnd);
+        CHECK (not (key < Block::zero_key));
+        CHECK (not (Block::largest_key < key));
+    }
+    CHECK (Block::zero_key < Block::largest_key);
+}
+
+static void
+test_sort()
+{
+    TestRandom rnd(3800);
+    std::vector<Block::key_t> keys, old_keys;
+    for (uint32_t k = 0; k < 20000; k ++)
+        keys.push_back(random_key(rnd));
+    old_keys = keys;
+    std::stable_sort(keys.begin(), keys.end());
+    std::stable_sort(old_keys.begin(), old_keys.end(), old_less);
+    CHECK (keys == old_keys);
+}
+
+int
+main()
+{
+    test_pairs();
+    test_limits();
+    test_sort();
+    return test_result();
+}
@@ -0,0 +1,192 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+// leaf index runs, as maintained while blocks move, against index built from scratch
+
+#include "testfs.hpp"
+#include <set>
+#include <unistd.h>
+
+static const char *IMAGE_NAME = "leafindex_test.img";
+static const uint32_t IMAGE_SIZE = 32768;
+
+/// picks free block not yet taken by this batch
+static uint32_t
+pick_free_block(ReiserFs &fs, TestRandom &rnd, std::set<uint32_t> &taken)
+{
+    uint32_t block_idx;
+    do {
+        block_idx = rnd.below(fs.sizeInBlocks());
+    } while (fs.blockUsed(block_idx) or fs.blockReserved(block_idx) or taken.count(block_idx));
+    taken.insert(block_idx);
+    return block_idx;
+}
+
+/// finds free extent of \param len blocks, not overlapping ones taken by this batch
+static uint32_t
+pick_free_extent(ReiserFs &fs, TestRandom &rnd, uint32_t len, std::set<uint32_t> &taken)
+{
+    while (1) {
+        const uint32_t start = rnd.below(fs.sizeInBlocks() - len);
+        uint32_t k = 0;
+        while (k < len and not fs.blockUsed(start + k) and not fs.blockReserved(start + k)
+               and 0 == taken.count(start + k))
+        {
+            k ++;
+        }
+        if (k < len)
+            continue;
+        for (k = 0; k < len; k ++)
+            taken.insert(start + k);
+        return start;
+    }
+}
+
+/// leaf index as seen through public interface: leaf spans, and leaf count of basket of
+/// every block
+static void
+snapshot_index(ReiserFs &fs, std::vector<ReiserFs::leaf_data_span> &spans,
+               std::vector<uint32_t> &leaf_counts)
+{
+    fs.getLeafDataSpans(spans);
+    leaf_counts.resize(fs.sizeInBlocks());
+    for (uint32_t k = 0; k < fs.sizeInBlocks(); k ++)
+        leaf_counts[k] = fs.leafCountForBlockRange(k, k);
+}
+
+static bool
+same_spans(const std::vector<ReiserFs::leaf_data_span> &a,
+           const std::vector<ReiserFs::leaf_data_span> &b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (uint32_t k = 0; k < a.size(); k ++) {
+        if (a[k].leaf != b[k].leaf or a[k].first != b[k].first or a[k].distance != b[k].distance)
+            return false;
+    }
+    return true;
+}
+
+/// one batch: file pieces moved to contiguous free space, which joins runs, single blocks
+/// moved anywhere, which splits them, and some tree nodes
+static void
+make_batch(ReiserFs &fs, TestRandom &rnd, const std::vector<test_image::file> &files,
+           movemap_t &movemap)
+{
+    std::set<uint32_t> taken;
+    std::set<uint32_t> sources;
+    movemap.clear();
+    for (uint32_t k = 0; k < 10; k ++) {
+        const test_image::file &f = files[rnd.below(files.size())];
+        if (f.blocks.size() < 4)
+            continue;
+        const uint32_t len = 2 + rnd.below(std::min<uint32_t>(f.blocks.size() - 2, 40));
+        const uint32_t first = rnd.below(f.blocks.size() - len + 1);
+        const uint32_t target = pick_free_extent(fs, rnd, len, taken);
+        for (uint32_t j = 0; j < len; j ++) {
+            const uint32_t block_idx = f.blocks[first + j];
+            if (0 != block_idx and sources.insert(block_idx).second)
+                movemap.insert(block_idx, target + j);
+        }
+    }
+    for (uint32_t k = 0; k < 50; k ++) {
+        const test_image::file &f = files[rnd.below(files.size())];
+        if (f.blocks.empty())
+            continue;
+        const uint32_t block_idx = f.blocks[rnd.below(f.blocks.size())];
+        if (0 != block_idx and sources.insert(block_idx).second)
+            movemap.insert(block_idx, pick_free_block(fs, rnd, taken));
+    }
+    movemap.normalize();
+}
+
+/// moves about third of tree \param nodes, updating their positions
+static void
+move_tree_nodes(ReiserFs &fs, TestRandom &rnd, std::vector<uint32_t> &nodes)
+{
+    std::set<uint32_t> taken;
+    movemap_t movemap;
+    for (std::vector<uint32_t>::iterator it = nodes.begin(); it != nodes.end(); ++ it) {
+        if (0 != rnd.below(3))
+            continue;
+        const uint32_t target = pick_free_block(fs, rnd, taken);
+        movemap.insert(*it, target);
+        *it = target;
+    }
+    movemap.normalize();
+    CHECK (movemap.size() == fs.moveBlocks(movemap));
+}
+
+int
+main()
+{
+    test_image img;
+    make_test_image(IMAGE_NAME, 31, IMAGE_SIZE, img);
+    CHECK (0 == verify_test_image(IMAGE_NAME, img));
+
+    TestRandom rnd(31);
+    std::vector<ReiserFs::leaf_data_span> spans, fresh_spans;
+    std::vector<uint32_t> leaf_counts, fresh_leaf_counts;
+    for (uint32_t round = 0; round < 4; round ++) {
+        std::vector<test_image::file> files;
+        CHECK (0 == verify_test_image(IMAGE_NAME, img, &files));
+
+        ReiserFs fs;
+        CHECK (RFSD_OK == fs.open(IMAGE_NAME, false));
+        for (uint32_t batch = 0; batch < 5; batch ++) {
+            // moveBlocks consumes map it's given
+            movemap_t movemap, moved;
+            make_batch(fs, rnd, files, movemap);
+            moved = movemap;
+            CHECK (movemap.size() == fs.moveBlocks(movemap));
+            // later batches pick blocks from updated lists, so some blocks are moved again
+            // and index entries written by earlier batches are used
+            for (std::vector<test_image::file>::iterator f = files.begin(); f != files.end();
+                 ++ f)
+            {
+                for (std::vector<uint32_t>::iterator it = f->blocks.begin();
+                     it != f->blocks.end(); ++ it)
+                {
+                    if (0 != *it and 0 != moved.count(*it))
+                        *it = moved.at(*it);
+                }
+            }
+        }
+        // leaves and internal nodes move too, leaf index follows leaves
+        std::vector<uint32_t> nodes(img.leaves);
+        nodes.insert(nodes.end(), img.internal_nodes.begin(), img.internal_nodes.end());
+        if (1 == round % 2)
+            move_tree_nodes(fs, rnd, nodes);
+        snapshot_index(fs, spans, leaf_counts);
+        fs.close();
+
+        // every pointer was updated through index, stale run would leave it dangling
+        std::vector<test_image::file> found_files;
+        CHECK (0 == verify_test_image(IMAGE_NAME, img, &found_files));
+        CHECK (found_files.size() == files.size());
+        for (uint32_t k = 0; k < std::min(found_files.size(), files.size()); k ++)
+            CHECK (found_files[k].blocks == files[k].blocks);
+
+        // and index built from scratch is the same
+        ReiserFs fresh_fs;
+        CHECK (RFSD_OK == fresh_fs.open(IMAGE_NAME, false, true));
+        snapshot_index(fresh_fs, fresh_spans, fresh_leaf_counts);
+        fresh_fs.close();
+        CHECK (same_spans(spans, fresh_spans));
+        CHECK (leaf_counts == fresh_leaf_counts);
+
+        // next round starts from current node positions
+        if (1 == round % 2) {
+            std::vector<uint32_t>(nodes.begin(), nodes.begin() + img.leaves.size())
+                .swap(img.leaves);
+            std::vector<uint32_t>(nodes.begin() + img.leaves.size(), nodes.end())
+                .swap(img.internal_nodes);
+        }
+    }
+    ::unlink(IMAGE_NAME);
+    return test_result();
+}
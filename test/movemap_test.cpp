@@ -0,0 +1,200 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+// Movemap against std::map it replaced: normalization, erase and merge
+
+#include "testfs.hpp"
+#include <map>
+
+typedef std::map<uint32_t, uint32_t> reference_map;
+
+static bool
+same_content(const Movemap &movemap, const reference_map &ref)
+{
+    if (movemap.size() != ref.size())
+        return false;
+    Movemap::const_iterator it = movemap.begin();
+    for (reference_map::const_iterator r_it = ref.begin(); r_it != ref.end(); ++ r_it, ++ it) {
+        if (it == movemap.end() or it->first != r_it->first or it->second != r_it->second)
+            return false;
+    }
+    return it == movemap.end();
+}
+
+static void
+test_normalize()
+{
+    Movemap movemap;
+    CHECK (0 == movemap.entryCount());
+    movemap.insert(30, 1);
+    movemap.insert(10, 2);
+    movemap.insert(20, 3);
+    movemap.insert(10, 4);      // later insert wins
+    CHECK (4 == movemap.entryCount());
+    movemap.normalize();
+    CHECK (3 == movemap.size());
+    CHECK (3 == movemap.entryCount());
+    CHECK (4 == movemap.at(10));
+    CHECK (1 == movemap.count(30));
+    CHECK (0 == movemap.count(40));
+    CHECK (movemap.find(40) == movemap.end());
+    CHECK (movemap.begin()->first == 10);
+
+    // normalizing normalized map changes nothing
+    movemap.normalize();
+    CHECK (3 == movemap.size());
+
+    // appending after normalization merges into sorted part
+    movemap.insert(15, 5);
+    movemap.insert(30, 6);
+    movemap.normalize();
+    reference_map ref;
+    ref[10] = 4;
+    ref[15] = 5;
+    ref[20] = 3;
+    ref[30] = 6;
+    CHECK (same_content(movemap, ref));
+    CHECK (movemap.targetsUnique());
+    movemap.insert(40, 6);
+    movemap.normalize();
+    CHECK (not movemap.targetsUnique());
+}
+
+static void
+test_erase()
+{
+    Movemap movemap;
+    movemap.insert(1, 100);
+    movemap.insert(2, 200);
+    movemap.insert(3, 300);
+    movemap.erase(2);           // erase normalizes by itself
+    CHECK (2 == movemap.size());
+    CHECK (0 == movemap.count(2));
+    movemap.erase(2);           // erasing missing entry is no-op
+    movemap.erase(7);
+    CHECK (2 == movemap.size());
+
+    // iteration skips erased entries, including the last one
+    movemap.erase(3);
+    uint32_t visited = 0;
+    for (Movemap::const_iterator it = movemap.begin(); it != movemap.end(); ++ it)
+        visited ++;
+    CHECK (1 == visited);
+
+    // erased source can be inserted again
+    movemap.insert(3, 301);
+    movemap.normalize();
+    CHECK (2 == movemap.size());
+    CHECK (301 == movemap.at(3));
+    CHECK (movemap.entryCount() >= movemap.size());
+
+    movemap.clear();
+    CHECK (movemap.empty());
+}
+
+static void
+test_merge()
+{
+    Movemap a, b;
+    a.insert(1, 10);
+    a.insert(3, 30);
+    a.erase(3);
+    b.insert(2, 20);
+    b.insert(4, 40);
+    b.normalize();
+    CHECK (RFSD_OK == a.merge(b));
+    CHECK (3 == a.size());
+    CHECK (20 == a.at(2));
+    CHECK (0 == a.count(3));
+
+    // on collision existing entry is kept
+    Movemap c;
+    c.insert(2, 99);
+    c.insert(5, 50);
+    c.normalize();
+    CHECK (RFSD_FAIL == a.merge(c));
+    CHECK (20 == a.at(2));
+    CHECK (50 == a.at(5));
+    CHECK (4 == a.size());
+
+    // unnormalized destination is normalized first
+    a.insert(6, 60);
+    a.insert(1, 11);
+    Movemap empty;
+    CHECK (RFSD_OK == a.merge(empty));
+    CHECK (11 == a.at(1));
+    CHECK (60 == a.at(6));
+}
+
+static void
+test_random()
+{
+    TestRandom rnd(28);
+    for (uint32_t round = 0; round < 20; round ++) {
+        Movemap movemap;
+        reference_map ref;
+        const uint32_t range = 10 + rnd.below(2000);
+        const uint32_t op_count = rnd.below(4000);
+        for (uint32_t op = 0; op < op_count; op ++) {
+            const uint32_t from = rnd.below(range);
+            switch (rnd.below(8)) {
+            case 0:
+                movemap.erase(from);
+                ref.erase(from);
+                break;
+            case 1: {
+                Movemap other;
+                reference_map other_ref;
+                const uint32_t n = rnd.below(50);
+                for (uint32_t k = 0; k < n; k ++) {
+                    const uint32_t o_from = rnd.below(range);
+                    const uint32_t o_to = rnd.below(range);
+                    other.insert(o_from, o_to);
+                    other_ref[o_from] = o_to;
+                }
+                other.normalize();
+                bool overlapped = false;
+                for (reference_map::const_iterator it = other_ref.begin();
+                     it != other_ref.end(); ++ it)
+                {
+                    overlapped = overlapped or 0 != ref.count(it->first);
+                    ref.insert(*it);
+                }
+                CHECK ((overlapped ? RFSD_FAIL : RFSD_OK) == movemap.merge(other));
+                break;
+            }
+            default: {
+                const uint32_t to = rnd.below(range);
+                movemap.insert(from, to);
+                ref[from] = to;
+                break;
+            }
+            }
+            if (0 == rnd.below(1000)) {
+                movemap.normalize();
+                CHECK (same_content(movemap, ref));
+            }
+        }
+        movemap.normalize();
+        CHECK (same_content(movemap, ref));
+        for (uint32_t from = 0; from < range; from ++) {
+            CHECK (movemap.count(from) == ref.count(from));
+            if (0 != ref.count(from))
+                CHECK (movemap.at(from) == ref[from]);
+        }
+    }
+}
+
+int
+main()
+{
+    test_normalize();
+    test_erase();
+    test_merge();
+    test_random();
+    return test_result();
+}
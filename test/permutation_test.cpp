@@ -0,0 +1,193 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+// movePermutation: chains and cycles, including ones long enough to be cut by parking,
+// and maps it must refuse
+
+#include "testfs.hpp"
+#include <algorithm>
+#include <set>
+#include <unistd.h>
+
+static const char *IMAGE_NAME = "permutation_test.img";
+static const uint32_t IMAGE_SIZE = 32768;
+
+/// current state of image: tree nodes and file blocks, as they should be
+struct tracked_image {
+    test_image img;
+    std::vector<test_image::file> files;
+};
+
+/// \return \param count distinct blocks in use, data blocks and tree nodes mixed
+static std::vector<uint32_t>
+pick_used_blocks(const tracked_image &ti, TestRandom &rnd, uint32_t count)
+{
+    std::vector<uint32_t> pool(ti.img.leaves);
+    pool.insert(pool.end(), ti.img.internal_nodes.begin(), ti.img.internal_nodes.end());
+    for (std::vector<test_image::file>::const_iterator f = ti.files.begin();
+         f != ti.files.end(); ++ f)
+    {
+        for (std::vector<uint32_t>::const_iterator it = f->blocks.begin();
+             it != f->blocks.end(); ++ it)
+        {
+            if (0 != *it)
+                pool.push_back(*it);
+        }
+    }
+    assert1 (count <= pool.size());
+    for (uint32_t k = 0; k < count; k ++)
+        std::swap(pool[k], pool[k + rnd.below(pool.size() - k)]);
+    pool.resize(count);
+    return pool;
+}
+
+static uint32_t
+pick_free_block(ReiserFs &fs, TestRandom &rnd, std::set<uint32_t> &taken)
+{
+    uint32_t block_idx;
+    do {
+        block_idx = rnd.below(fs.sizeInBlocks());
+    } while (fs.blockUsed(block_idx) or fs.blockReserved(block_idx) or taken.count(block_idx));
+    taken.insert(block_idx);
+    return block_idx;
+}
+
+/// adds cycle over \param blocks: each one goes to position of the next
+static void
+add_cycle(movemap_t &movemap, const std::vector<uint32_t> &blocks)
+{
+    for (uint32_t k = 0; k < blocks.size(); k ++)
+        movemap.insert(blocks[k], blocks[(k + 1) % blocks.size()]);
+}
+
+/// adds chain over \param blocks, last one goes to \param free_block
+static void
+add_chain(movemap_t &movemap, const std::vector<uint32_t> &blocks, uint32_t free_block)
+{
+    for (uint32_t k = 0; k + 1 < blocks.size(); k ++)
+        movemap.insert(blocks[k], blocks[k + 1]);
+    movemap.insert(blocks.back(), free_block);
+}
+
+static void
+apply_moves(std::vector<uint32_t> &blocks, const movemap_t &movemap)
+{
+    for (std::vector<uint32_t>::iterator it = blocks.begin(); it != blocks.end(); ++ it) {
+        if (0 != *it and 0 != movemap.count(*it))
+            *it = movemap.at(*it);
+    }
+}
+
+/// runs movePermutation on fresh ReiserFs instance and checks image afterwards. Parked
+/// blocks must be freed, so leak check in verify_test_image covers them
+static void
+run_permutation(tracked_image &ti, movemap_t &movemap, uint32_t max_wave_count)
+{
+    movemap.normalize();
+    ReiserFs fs;
+    CHECK (RFSD_OK == fs.open(IMAGE_NAME, false));
+    const uint32_t free_before = fs.freeBlockCount();
+    CHECK (RFSD_OK == fs.movePermutation(movemap, max_wave_count));
+    CHECK (free_before == fs.freeBlockCount());
+    fs.close();
+
+    apply_moves(ti.img.leaves, movemap);
+    apply_moves(ti.img.internal_nodes, movemap);
+    for (std::vector<test_image::file>::iterator f = ti.files.begin(); f != ti.files.end(); ++ f)
+        apply_moves(f->blocks, movemap);
+
+    std::vector<test_image::file> found_files;
+    CHECK (0 == verify_test_image(IMAGE_NAME, ti.img, &found_files));
+    CHECK (found_files.size() == ti.files.size());
+    for (uint32_t k = 0; k < std::min(found_files.size(), ti.files.size()); k ++)
+        CHECK (found_files[k].blocks == ti.files[k].blocks);
+}
+
+/// maps movePermutation must refuse without moving anything
+static void
+test_malformed(tracked_image &ti, TestRandom &rnd)
+{
+    ReiserFs fs;
+    CHECK (RFSD_OK == fs.open(IMAGE_NAME, false));
+    std::set<uint32_t> taken;
+    const std::vector<uint32_t> blocks = pick_used_blocks(ti, rnd, 3);
+
+    // two blocks to the same place
+    movemap_t movemap;
+    const uint32_t free_block = pick_free_block(fs, rnd, taken);
+    movemap.insert(blocks[0], free_block);
+    movemap.insert(blocks[1], free_block);
+    movemap.normalize();
+    CHECK (RFSD_FAIL == fs.movePermutation(movemap));
+
+    // target is occupied by block which stays
+    movemap.clear();
+    movemap.insert(blocks[0], blocks[1]);
+    movemap.insert(blocks[1], blocks[2]);
+    movemap.normalize();
+    CHECK (RFSD_FAIL == fs.movePermutation(movemap));
+    fs.close();
+
+    CHECK (0 == verify_test_image(IMAGE_NAME, ti.img));
+}
+
+int
+main()
+{
+    tracked_image ti;
+    make_test_image(IMAGE_NAME, 36, IMAGE_SIZE, ti.img);
+    CHECK (0 == verify_test_image(IMAGE_NAME, ti.img, &ti.files));
+    TestRandom rnd(36);
+
+    // swap and short cycle fit in waves, nothing parked
+    {
+        movemap_t movemap;
+        const std::vector<uint32_t> blocks = pick_used_blocks(ti, rnd, 5);
+        add_cycle(movemap, std::vector<uint32_t>(blocks.begin(), blocks.begin() + 2));
+        add_cycle(movemap, std::vector<uint32_t>(blocks.begin() + 2, blocks.end()));
+        run_permutation(ti, movemap, 64);
+    }
+
+    // long cycles and chains with few waves allowed, several blocks of each parked
+    for (uint32_t max_wave_count = 1; max_wave_count <= 3; max_wave_count ++) {
+        movemap_t movemap;
+        std::set<uint32_t> taken;
+        const std::vector<uint32_t> blocks = pick_used_blocks(ti, rnd, 60);
+        add_cycle(movemap, std::vector<uint32_t>(blocks.begin(), blocks.begin() + 30));
+        ReiserFs fs;
+        CHECK (RFSD_OK == fs.open(IMAGE_NAME, false, true));
+        add_chain(movemap, std::vector<uint32_t>(blocks.begin() + 30, blocks.end()),
+                  pick_free_block(fs, rnd, taken));
+        fs.close();
+        run_permutation(ti, movemap, max_wave_count);
+    }
+
+    // many cycles and chains of random lengths
+    for (uint32_t round = 0; round < 3; round ++) {
+        movemap_t movemap;
+        std::set<uint32_t> taken;
+        const std::vector<uint32_t> blocks = pick_used_blocks(ti, rnd, 2000);
+        ReiserFs fs;
+        CHECK (RFSD_OK == fs.open(IMAGE_NAME, false, true));
+        uint32_t pos = 0;
+        while (pos < blocks.size()) {
+            const uint32_t len = std::min<uint32_t>(2 + rnd.below(100), blocks.size() - pos);
+            const std::vector<uint32_t> part(blocks.begin() + pos, blocks.begin() + pos + len);
+            if (len > 1 and 0 == rnd.below(2))
+                add_cycle(movemap, part);
+            else
+                add_chain(movemap, part, pick_free_block(fs, rnd, taken));
+            pos += len;
+        }
+        fs.close();
+        run_permutation(ti, movemap, 1 + rnd.below(20));
+    }
+
+    test_malformed(ti, rnd);
+    ::unlink(IMAGE_NAME);
+    return test_result();
+}
@@ -0,0 +1,451 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "testfs.hpp"
+#include <fstream>
+#include <set>
+#include <string.h>
+#include <unistd.h>
+
+static uint32_t failed_check_count = 0;
+
+static const uint32_t TEST_JOURNAL_START = FIRST_BITMAP_BLOCK + 1;
+static const uint32_t TEST_JOURNAL_SIZE = 1024;
+/// internal nodes are kept small, so even tiny tree has several levels
+static const uint32_t TEST_MAX_PTRS = 4;
+static const uint32_t TEST_DATA_MAGIC = 0x41544144;     // "DATA"
+
+void
+test_failed(const char *cond, const char *file, int line)
+{
+    std::cout << "error: check failed at " << file << ":" << line << ": " << cond << std::endl;
+    failed_check_count ++;
+}
+
+int
+test_result()
+{
+    if (0 == failed_check_count)
+        return 0;
+    std::cout << failed_check_count << " check(s) failed" << std::endl;
+    return 1;
+}
+
+uint32_t
+TestRandom::next()
+{
+    this->state = this->state * 6364136223846793005ull + 1442695040888963407ull;
+    return this->state >> 33;
+}
+
+namespace {
+
+/// blocks of image being built, sparse
+class ImageWriter {
+public:
+    ImageWriter(uint32_t block_count) : used(block_count, false) {}
+    char *block(uint32_t block_idx) {
+        std::vector<char> &buf = this->blocks[block_idx];
+        buf.resize(BLOCKSIZE, 0);
+        this->used[block_idx] = true;
+        return &buf[0];
+    }
+    void markUsed(uint32_t block_idx) { this->used[block_idx] = true; }
+    bool blockUsed(uint32_t block_idx) const { return this->used[block_idx]; }
+    uint32_t usedCount() const {
+        return std::count(this->used.begin(), this->used.end(), true);
+    }
+    void write(const std::string &fname) const;
+private:
+    std::map<uint32_t, std::vector<char> > blocks;
+    std::vector<bool> used;
+};
+
+struct test_item {
+    Block::item_header ih;
+    std::vector<char> body;
+};
+
+} // namespace
+
+void
+ImageWriter::write(const std::string &fname) const
+{
+    // only blocks with content are written, file stays sparse
+    {
+        std::ofstream fp(fname.c_str(), std::ios::binary | std::ios::trunc);
+        for (std::map<uint32_t, std::vector<char> >::const_iterator it = this->blocks.begin();
+             it != this->blocks.end(); ++ it)
+        {
+            fp.seekp(static_cast<uint64_t>(it->first) * BLOCKSIZE);
+            fp.write(&it->second[0], BLOCKSIZE);
+        }
+    }
+    assert1 (0 == ::truncate(fname.c_str(), static_cast<off_t>(this->used.size()) * BLOCKSIZE));
+}
+
+static uint32_t
+alloc_block(ImageWriter &writer, TestRandom &rnd, uint32_t after)
+{
+    // continue run if possible, pick random free block otherwise
+    if (0 != after and after + 1 < BLOCKS_PER_BITMAP and not writer.blockUsed(after + 1)
+        and rnd.below(8) != 0)
+    {
+        writer.markUsed(after + 1);
+        return after + 1;
+    }
+    uint32_t block_idx;
+    do {
+        block_idx = rnd.below(BLOCKS_PER_BITMAP);
+    } while (writer.blockUsed(block_idx));
+    writer.markUsed(block_idx);
+    return block_idx;
+}
+
+static test_item
+make_item(const Block::key_t &key, uint16_t count, const void *body, uint32_t length)
+{
+    test_item item;
+    item.ih.key = key;
+    item.ih.count = count;
+    item.ih.length = length;
+    item.ih.offset = 0;
+    item.ih.version = KEY_V1;
+    item.body.assign(static_cast<const char *>(body), static_cast<const char *>(body) + length);
+    return item;
+}
+
+static test_item
+make_stat_item(uint32_t dir_id, uint32_t obj_id, uint16_t mode, uint64_t size, uint32_t time)
+{
+    struct {
+        uint16_t mode;
+        uint16_t attrs;
+        uint32_t nlink;
+        uint64_t size;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t atime;
+        uint32_t mtime;
+        uint32_t ctime;
+        uint32_t blocks;
+        uint32_t rdev;
+    } __attribute__ ((__packed__)) sd;
+    ::memset(&sd, 0, sizeof(sd));
+    sd.mode = mode;
+    sd.nlink = 1;
+    sd.size = size;
+    sd.atime = sd.mtime = sd.ctime = time;
+    sd.blocks = size / 512;
+    return make_item(Block::key_t(KEY_V1, dir_id, obj_id, 0, KEY_TYPE_STAT), 0xffff, &sd,
+                     sizeof(sd));
+}
+
+/// root directory with "." and ".." only. Files are not linked anywhere, defragmenter
+/// doesn't care
+static void
+add_root_directory(std::vector<test_item> &items)
+{
+    items.push_back(make_stat_item(1, 2, 040755, 0, 1000000000));
+    std::vector<char> body(2 * sizeof(Block::de_header) + 8, 0);
+    Block::de_header *deh = reinterpret_cast<Block::de_header *>(&body[0]);
+    deh[0].hash_gen = 1;
+    deh[0].dir_id = 1;
+    deh[0].obj_id = 2;
+    deh[0].location = 2 * sizeof(Block::de_header) + 4;
+    deh[0].state = 4;
+    deh[1].hash_gen = 2;
+    deh[1].dir_id = 0;
+    deh[1].obj_id = 1;
+    deh[1].location = 2 * sizeof(Block::de_header);
+    deh[1].state = 4;
+    ::memcpy(&body[deh[1].location], "..", 2);
+    ::memcpy(&body[deh[0].location], ".", 1);
+    items.push_back(make_item(Block::key_t(KEY_V1, 1, 2, 1, KEY_TYPE_DIRECTORY), 2, &body[0],
+                              body.size()));
+}
+
+void
+make_test_image(const std::string &fname, uint32_t seed, uint32_t block_count, test_image &img)
+{
+    assert2 ("test image must fit one bitmap block", block_count <= BLOCKS_PER_BITMAP);
+    TestRandom rnd(seed);
+    ImageWriter writer(block_count);
+    img.block_count = block_count;
+    img.leaves.clear();
+    img.internal_nodes.clear();
+    img.files.clear();
+
+    // everything up to journal header is reserved. Blocks beyond fs end are marked too,
+    // so allocator never picks them
+    for (uint32_t k = 0; k <= TEST_JOURNAL_START + TEST_JOURNAL_SIZE; k ++)
+        writer.markUsed(k);
+    ImageWriter alloc_map(BLOCKS_PER_BITMAP);
+    for (uint32_t k = 0; k < BLOCKS_PER_BITMAP; k ++) {
+        if (k >= block_count or writer.blockUsed(k))
+            alloc_map.markUsed(k);
+    }
+
+    // files: about third of free space, sizes vary from empty to several indirect items
+    std::vector<test_item> items;
+    add_root_directory(items);
+    static const uint32_t sizes[] = { 0, 1, 2, 5, 20, 100, 500, 1500 };
+    const uint32_t budget = (block_count - alloc_map.usedCount()) / 3;
+    uint32_t allocated = 0;
+    for (uint32_t k = 0; k < 200; k ++) {
+        test_image::file f;
+        f.obj_id = 100 + k;
+        uint32_t sz = sizes[rnd.below(sizeof(sizes) / sizeof(sizes[0]))];
+        if (allocated + sz > budget)
+            sz = 0;
+        allocated += sz;
+        uint32_t prev = 0;
+        for (uint32_t j = 0; j < sz; j ++) {
+            if (rnd.below(100) == 0) {
+                f.blocks.push_back(0);      // sparse file hole
+                continue;
+            }
+            const uint32_t block_idx = alloc_block(alloc_map, rnd, prev);
+            prev = block_idx;
+            f.blocks.push_back(block_idx);
+            uint32_t *tag = reinterpret_cast<uint32_t *>(writer.block(block_idx));
+            tag[0] = TEST_DATA_MAGIC;
+            tag[1] = f.obj_id;
+            tag[2] = j;
+        }
+        items.push_back(make_stat_item(2, f.obj_id, 0100644,
+                                       static_cast<uint64_t>(sz) * BLOCKSIZE,
+                                       1000000000 + rnd.below(700000000)));
+        static const uint32_t ptrs_per_item = 1012;
+        for (uint32_t s = 0; s < f.blocks.size(); s += ptrs_per_item) {
+            const uint32_t n = std::min<uint32_t>(ptrs_per_item, f.blocks.size() - s);
+            items.push_back(make_item(Block::key_t(KEY_V1, 2, f.obj_id,
+                                                   1 + static_cast<uint64_t>(s) * BLOCKSIZE,
+                                                   KEY_TYPE_INDIRECT),
+                                      0, &f.blocks[s], n * sizeof(uint32_t)));
+        }
+        img.files.push_back(f);
+    }
+
+    // pack items into leaves
+    std::vector<std::pair<uint32_t, Block::key_t> > level_nodes;
+    std::vector<test_item>::const_iterator item = items.begin();
+    while (item != items.end()) {
+        const uint32_t block_idx = alloc_block(alloc_map, rnd, 0);
+        char *buf = writer.block(block_idx);
+        Block::blockheader *bh = reinterpret_cast<Block::blockheader *>(buf);
+        uint32_t body_end = BLOCKSIZE;
+        uint32_t count = 0;
+        level_nodes.push_back(std::make_pair(block_idx, item->ih.key));
+        while (item != items.end()
+               and 24 + 24 * (count + 1) + item->body.size() <= body_end)
+        {
+            body_end -= item->body.size();
+            ::memcpy(buf + body_end, &item->body[0], item->body.size());
+            Block::item_header ih = item->ih;
+            ih.offset = body_end;
+            ::memcpy(buf + 24 + 24 * count, &ih, sizeof(ih));
+            count ++;
+            ++ item;
+        }
+        bh->bh_level = TREE_LEVEL_LEAF;
+        bh->bh_nr_items = count;
+        bh->bh_free_space = body_end - 24 - 24 * count;
+        img.leaves.push_back(block_idx);
+    }
+
+    // internal levels, until single root is left
+    uint32_t level = TREE_LEVEL_LEAF;
+    do {
+        level ++;
+        std::vector<std::pair<uint32_t, Block::key_t> > upper_nodes;
+        uint32_t n;
+        for (uint32_t s = 0; s < level_nodes.size(); s += n) {
+            // internal node always has at least one key
+            n = std::min<uint32_t>(TEST_MAX_PTRS, level_nodes.size() - s);
+            if (level_nodes.size() - s - n == 1)
+                n --;
+            const uint32_t block_idx = alloc_block(alloc_map, rnd, 0);
+            char *buf = writer.block(block_idx);
+            Block::blockheader *bh = reinterpret_cast<Block::blockheader *>(buf);
+            bh->bh_level = level;
+            bh->bh_nr_items = n - 1;
+            bh->bh_free_space = BLOCKSIZE - 24 - 16 * (n - 1) - 8 * n;
+            for (uint32_t k = 1; k < n; k ++)
+                ::memcpy(buf + 24 + 16 * (k - 1), &level_nodes[s + k].second, 16);
+            for (uint32_t k = 0; k < n; k ++) {
+                Block::tree_ptr ptr;
+                ptr.block = level_nodes[s + k].first;
+                ptr.size = BLOCKSIZE - 24;
+                ptr.reserved = 0;
+                ::memcpy(buf + 24 + 16 * (n - 1) + 8 * k, &ptr, sizeof(ptr));
+            }
+            upper_nodes.push_back(std::make_pair(block_idx, level_nodes[s].second));
+            img.internal_nodes.push_back(block_idx);
+        }
+        level_nodes.swap(upper_nodes);
+    } while (level_nodes.size() > 1);
+
+    for (uint32_t k = 0; k < block_count; k ++) {
+        if (alloc_map.blockUsed(k))
+            writer.markUsed(k);
+    }
+
+    // bitmap covers whole block, bits beyond fs end are set
+    char *bitmap = writer.block(FIRST_BITMAP_BLOCK);
+    for (uint32_t k = 0; k < BLOCKS_PER_BITMAP; k ++) {
+        if (k >= block_count or writer.blockUsed(k))
+            bitmap[k / 8] |= 1 << (k % 8);
+    }
+
+    // empty journal
+    uint32_t *jh = reinterpret_cast<uint32_t *>(writer.block(TEST_JOURNAL_START
+                                                             + TEST_JOURNAL_SIZE));
+    jh[0] = 0;      // last flushed transaction
+    jh[1] = 0;      // unflushed offset
+    jh[2] = 1;      // mount id
+
+    FsSuperblock *sb = reinterpret_cast<FsSuperblock *>(writer.block(SUPERBLOCK_BLOCK));
+    sb->s_block_count = block_count;
+    sb->s_free_blocks = block_count - writer.usedCount();
+    sb->s_root_block = level_nodes[0].first;
+    sb->jp_journal_1st_block = TEST_JOURNAL_START;
+    sb->jp_journal_dev = 0;
+    sb->jp_journal_size = TEST_JOURNAL_SIZE;
+    sb->jp_journal_trans_max = 256;
+    sb->jp_journal_magic = 0x12345;
+    sb->jp_journal_max_batch = 900;
+    sb->jp_journal_max_commit_age = 30;
+    sb->jp_journal_max_trans_age = 30;
+    sb->s_blocksize = BLOCKSIZE;
+    sb->s_oid_maxsize = 972;
+    sb->s_oid_cursize = 2;
+    sb->s_umount_state = 1;
+    ::memcpy(sb->s_magic, "ReIsEr2Fs", 10);
+    sb->s_hash_function_code = 3;   // r5
+    sb->s_tree_height = level;
+    sb->s_bmap_nr = 1;
+    sb->s_version = 2;
+    writer.write(fname);
+}
+
+static void
+read_image_block(std::ifstream &fp, uint32_t block_idx, std::vector<char> &buf)
+{
+    buf.resize(BLOCKSIZE);
+    fp.seekg(static_cast<uint64_t>(block_idx) * BLOCKSIZE);
+    fp.read(&buf[0], BLOCKSIZE);
+}
+
+uint32_t
+verify_test_image(const std::string &fname, const test_image &img,
+                  std::vector<test_image::file> *obj_blocks)
+{
+    std::ifstream fp(fname.c_str(), std::ios::binary);
+    std::vector<char> buf;
+    uint32_t errors = 0;
+
+    read_image_block(fp, SUPERBLOCK_BLOCK, buf);
+    FsSuperblock sb;
+    ::memcpy(&sb, &buf[0], sizeof(sb));
+    read_image_block(fp, FIRST_BITMAP_BLOCK, buf);
+    const std::vector<char> bitmap(buf);
+    uint32_t used_count = 0;
+    for (uint32_t k = 0; k < img.block_count; k ++)
+        used_count += (bitmap[k / 8] >> (k % 8)) & 1;
+    if (sb.s_free_blocks != img.block_count - used_count) {
+        std::cout << "error: free block count " << sb.s_free_blocks << " doesn't match bitmap"
+            << std::endl;
+        errors ++;
+    }
+
+    std::map<uint32_t, test_image::file> found;
+    std::set<uint32_t> seen;
+    std::vector<uint32_t> queue(1, sb.s_root_block);
+    while (not queue.empty()) {
+        const uint32_t node = queue.back();
+        queue.pop_back();
+        if (not seen.insert(node).second or 0 == ((bitmap[node / 8] >> (node % 8)) & 1)) {
+            std::cout << "error: node " << node << " is referred twice or is free" << std::endl;
+            errors ++;
+            continue;
+        }
+        read_image_block(fp, node, buf);
+        const Block::blockheader *bh = reinterpret_cast<const Block::blockheader *>(&buf[0]);
+        if (TREE_LEVEL_LEAF != bh->bh_level) {
+            for (uint32_t k = 0; k <= bh->bh_nr_items; k ++) {
+                const Block::tree_ptr *ptr = reinterpret_cast<const Block::tree_ptr *>(
+                    &buf[24 + 16 * bh->bh_nr_items + 8 * k]);
+                queue.push_back(ptr->block);
+            }
+            continue;
+        }
+        for (uint32_t k = 0; k < bh->bh_nr_items; k ++) {
+            const Block::item_header *ih =
+                reinterpret_cast<const Block::item_header *>(&buf[24 + 24 * k]);
+            if (KEY_TYPE_INDIRECT != ih->type())
+                continue;
+            const uint32_t *ptrs = reinterpret_cast<const uint32_t *>(&buf[ih->offset]);
+            const uint32_t first_pos = (ih->key.offset_v1() - 1) / BLOCKSIZE;
+            test_image::file &f = found[ih->key.obj_id];
+            f.obj_id = ih->key.obj_id;
+            if (f.blocks.size() < first_pos + ih->length / 4)
+                f.blocks.resize(first_pos + ih->length / 4, 0);
+            for (uint32_t idx = 0; idx < ih->length / 4u; idx ++)
+                f.blocks[first_pos + idx] = ptrs[idx];
+        }
+    }
+
+    // contents of every data block must follow its pointer
+    std::vector<char> data;
+    for (std::vector<test_image::file>::const_iterator it = img.files.begin();
+         it != img.files.end(); ++ it)
+    {
+        const std::vector<uint32_t> &blocks = found[it->obj_id].blocks;
+        if (blocks.size() != it->blocks.size()) {
+            std::cout << "error: file " << it->obj_id << " has " << blocks.size()
+                << " blocks instead of " << it->blocks.size() << std::endl;
+            errors ++;
+            continue;
+        }
+        for (uint32_t j = 0; j < blocks.size(); j ++) {
+            if ((0 == blocks[j]) != (0 == it->blocks[j])) {
+                std::cout << "error: hole of file " << it->obj_id << " changed" << std::endl;
+                errors ++;
+                continue;
+            }
+            if (0 == blocks[j])
+                continue;
+            read_image_block(fp, blocks[j], data);
+            const uint32_t *tag = reinterpret_cast<const uint32_t *>(&data[0]);
+            const bool used = (bitmap[blocks[j] / 8] >> (blocks[j] % 8)) & 1;
+            if (TEST_DATA_MAGIC != tag[0] or it->obj_id != tag[1] or j != tag[2] or not used
+                or not seen.insert(blocks[j]).second)
+            {
+                std::cout << "error: block " << j << " of file " << it->obj_id << " at "
+                    << blocks[j] << " is wrong" << std::endl;
+                errors ++;
+            }
+        }
+    }
+    // and nothing else is in use
+    for (uint32_t k = TEST_JOURNAL_START + TEST_JOURNAL_SIZE + 1; k < img.block_count; k ++) {
+        if (((bitmap[k / 8] >> (k % 8)) & 1) and 0 == seen.count(k)) {
+            std::cout << "error: block " << k << " is leaked" << std::endl;
+            errors ++;
+        }
+    }
+    if (NULL != obj_blocks) {
+        obj_blocks->clear();
+        for (std::map<uint32_t, test_image::file>::const_iterator it = found.begin();
+             it != found.end(); ++ it)
+        {
+            obj_blocks->push_back(it->second);
+        }
+    }
+    return errors;
+}
@@ -0,0 +1,63 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#pragma once
+#include "../reiserfs.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+/// reports failed check and counts it, but lets test go on
+#define CHECK(cond) \
+    do { if (not (cond)) test_failed(#cond, __FILE__, __LINE__); } while (0)
+
+void
+test_failed(const char *cond, const char *file, int line);
+
+/// \return zero if all checks passed, for use as exit code
+int
+test_result();
+
+/// deterministic pseudo-random numbers, the same on every platform
+class TestRandom {
+public:
+    TestRandom(uint32_t seed) : state(seed * 2654435761u + 1) {}
+    uint32_t next();
+    /// \return number in [0, \param n)
+    uint32_t below(uint32_t n) { return this->next() % n; }
+private:
+    uint64_t state;
+};
+
+/// small reiserfs 3.6 filesystem, as created by make_test_image
+struct test_image {
+    /// regular file. Every data block starts with object id and position in file
+    struct file {
+        uint32_t obj_id;
+        std::vector<uint32_t> blocks;   //< zero for holes
+    };
+    uint32_t block_count;
+    std::vector<uint32_t> leaves;
+    std::vector<uint32_t> internal_nodes;
+    std::vector<file> files;
+};
+
+/// writes filesystem of \param block_count blocks to \param fname. Files have both
+/// contiguous and scattered blocks, tree has at least three levels
+void
+make_test_image(const std::string &fname, uint32_t seed, uint32_t block_count,
+                test_image &img);
+
+/// reads filesystem back and checks it: every data block is found by its pointer, all
+/// tree nodes and data blocks are marked in bitmap and nothing else is, free block count
+/// matches bitmap
+///
+/// \param obj_blocks[out]  if not NULL, receives current data blocks of every file
+/// \return number of errors found
+uint32_t
+verify_test_image(const std::string &fname, const test_image &img,
+                  std::vector<test_image::file> *obj_blocks = NULL);
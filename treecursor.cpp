@@ -0,0 +1,110 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+
+TreeCursor::TreeCursor(const ReiserFs &fs) : fs(fs)
+{
+    this->generation = 0;
+}
+
+void
+TreeCursor::seek(const Block::key_t &key)
+{
+    if (this->path.empty() or this->generation != this->fs.treeGeneration()) {
+        // tree nodes were moved, block numbers on the path are stale
+        this->path.clear();
+        this->generation = this->fs.treeGeneration();
+        path_element root;
+        root.block = this->fs.rootBlock();
+        root.level = this->fs.treeHeight();
+        root.left = Block::zero_key;
+        root.right = Block::largest_key;
+        this->path.push_back(root);
+    } else {
+        // climb up to the lowest node covering key. Root covers everything
+        while (this->path.size() > 1 and (key < this->path.back().left
+                                          or this->path.back().right <= key))
+        {
+            this->path.pop_back();
+        }
+    }
+    this->descend(key);
+}
+
+bool
+TreeCursor::nextLeaf()
+{
+    assert2 ("cursor is not positioned", not this->path.empty());
+    if (this->generation != this->fs.treeGeneration())
+        this->seek(this->path.back().left);
+
+    // climb up to the nearest node having children to the right of the path
+    this->path.pop_back();
+    while (not this->path.empty()) {
+        const path_element &parent = this->path.back();
+        if (parent.slot + 1 < parent.ptr_count) {
+            Block *block_obj = this->fs.readBlock(parent.block);
+            this->pushChild(block_obj, parent.slot + 1);
+            this->fs.releaseBlock(block_obj);
+            // left delimiting key of subtree is less than any key inside, so descending by it
+            // leads to the leftmost leaf
+            this->descend(this->path.back().left);
+            return true;
+        }
+        this->path.pop_back();
+    }
+    return false;
+}
+
+uint32_t
+TreeCursor::leaf() const
+{
+    assert2 ("cursor is not positioned", not this->path.empty());
+    return this->path.back().block;
+}
+
+const Block::key_t &
+TreeCursor::leftKey() const
+{
+    assert2 ("cursor is not positioned", not this->path.empty());
+    return this->path.back().left;
+}
+
+const Block::key_t &
+TreeCursor::rightKey() const
+{
+    assert2 ("cursor is not positioned", not this->path.empty());
+    return this->path.back().right;
+}
+
+void
+TreeCursor::descend(const Block::key_t &key)
+{
+    while (this->path.back().level > TREE_LEVEL_LEAF) {
+        Block *block_obj = this->fs.readBlock(this->path.back().block);
+        block_obj->checkInternalNode();
+        this->pushChild(block_obj, block_obj->childIndexForKey(key));
+        this->fs.releaseBlock(block_obj);
+    }
+}
+
+void
+TreeCursor::pushChild(const Block *block_obj, uint32_t slot)
+{
+    path_element &parent = this->path.back();
+    assert2 ("tree node level mismatch", block_obj->level() == parent.level);
+    parent.slot = slot;
+    parent.ptr_count = block_obj->ptrCount();
+    path_element child;
+    child.block = block_obj->ptr(slot).block;
+    child.level = parent.level - 1;
+    child.left = (slot > 0) ? block_obj->key(slot - 1) : parent.left;
+    child.right = (slot < block_obj->keyCount()) ? block_obj->key(slot) : parent.right;
+    // don't hold reference to parent past this point, push_back may reallocate
+    this->path.push_back(child);
+}
@@ -0,0 +1,291 @@
+/*
+ *  reiserfs-defrag, offline defragmentation utility for reiserfs
+ *  Copyright (C) 2012  Rinat Ibragimov
+ *
+ *  Licensed under terms of GPL version 3. See COPYING.GPLv3 for full text.
+ */
+
+#include "reiserfs.hpp"
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <fcntl.h>
+#include <pthread.h>
+
+/// subtree to be walked
+struct walk_task {
+    TreeWalker::node node;
+    std::vector<uint16_t> path;     //< slots from root down to the node, key order of tasks
+};
+
+/// walk results of one task: internal node itself, followed by its children if they are leaves
+struct walk_chunk {
+    std::vector<uint16_t> path;
+    std::vector<TreeWalker::node> nodes;
+};
+
+struct walk_queue {
+    pthread_mutex_t lock;
+    std::deque<walk_task> tasks;
+};
+
+struct walk_state;
+
+struct walk_worker {
+    walk_state *state;
+    uint32_t id;
+    pthread_t thread;
+    bool started;
+    std::vector<walk_chunk> chunks;
+    std::string error;
+};
+
+struct walk_state {
+    int fd;
+    std::vector<walk_queue> queues;     //< one for every worker
+    uint32_t pending;                   //< tasks queued or being processed, updated atomically
+    uint32_t failed;                    //< nonzero if some worker got an error
+    pthread_mutex_t idle_lock;          //< guards wake_count
+    pthread_cond_t idle_cond;           //< idle workers wait on it for wake_count change
+    uint32_t wake_count;                //< bumped when there is something new for idle workers
+};
+
+/// wakes idle workers: new tasks were queued, or walk is over
+static void
+wake_workers(walk_state *state)
+{
+    pthread_mutex_lock(&state->idle_lock);
+    state->wake_count ++;
+    pthread_cond_broadcast(&state->idle_cond);
+    pthread_mutex_unlock(&state->idle_lock);
+}
+
+static bool
+chunk_path_less(const walk_chunk *a, const walk_chunk *b)
+{
+    // parent's path is prefix of child's one, so parent goes first
+    return std::lexicographical_compare(a->path.begin(), a->path.end(), b->path.begin(),
+                                        b->path.end());
+}
+
+/// takes task from back of own queue or, if it's empty, from front of some other queue
+static bool
+take_task(walk_state *state, uint32_t id, walk_task &task)
+{
+    const uint32_t queue_count = state->queues.size();
+    for (uint32_t k = 0; k < queue_count; k ++) {
+        walk_queue &queue = state->queues[(id + k) % queue_count];
+        bool found = false;
+        pthread_mutex_lock(&queue.lock);
+        if (not queue.tasks.empty()) {
+            if (0 == k) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            found = true;
+        }
+        pthread_mutex_unlock(&queue.lock);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+/// asks kernel to start reading children of internal node, merging adjacent blocks into
+/// single request
+static void
+prefetch_children(int fd, std::vector<uint32_t> &children)
+{
+    std::sort(children.begin(), children.end());
+    std::vector<uint32_t>::const_iterator it = children.begin();
+    while (it != children.end()) {
+        std::vector<uint32_t>::const_iterator run_end = it + 1;
+        while (run_end != children.end() and *run_end == *(run_end - 1) + 1)
+            ++ run_end;
+        ::posix_fadvise(fd, static_cast<off_t>(*it) * BLOCKSIZE,
+                        static_cast<off_t>(run_end - it) * BLOCKSIZE, POSIX_FADV_WILLNEED);
+        it = run_end;
+    }
+}
+
+static void
+walk_internal_node(walk_worker *worker, Block *block_obj, const walk_task &task)
+{
+    walk_state *state = worker->state;
+    block_obj->block = task.node.block;
+    readBufAt(state->fd, task.node.block, block_obj->buf, BLOCKSIZE);
+    assert2 ("unexpected tree node level", block_obj->level() == task.node.level);
+    block_obj->checkInternalNode();
+
+    worker->chunks.push_back(walk_chunk());
+    walk_chunk &chunk = worker->chunks.back();
+    chunk.path = task.path;
+    chunk.nodes.push_back(task.node);
+
+    TreeWalker::node child;
+    child.parent = task.node.block;
+    child.level = task.node.level - 1;
+    const uint32_t ptr_count = block_obj->ptrCount();
+    if (TREE_LEVEL_LEAF == child.level) {
+        // children are leaves, there is no need to read them
+        for (uint32_t k = 0; k < ptr_count; k ++) {
+            child.block = block_obj->ptr(k).block;
+            child.slot = k;
+            chunk.nodes.push_back(child);
+        }
+        return;
+    }
+
+    std::vector<uint32_t> children;
+    for (uint32_t k = 0; k < ptr_count; k ++)
+        children.push_back(block_obj->ptr(k).block);
+    prefetch_children(state->fd, children);
+
+    walk_task child_task;
+    child_task.path = task.path;
+    child_task.path.push_back(0);
+    __sync_fetch_and_add(&state->pending, ptr_count);
+    walk_queue &queue = state->queues[worker->id];
+    pthread_mutex_lock(&queue.lock);
+    // owner takes tasks from back, so push in reverse to walk first child first
+    for (uint32_t k = ptr_count; k > 0; k --) {
+        child.block = block_obj->ptr(k - 1).block;
+        child.slot = k - 1;
+        child_task.node = child;
+        child_task.path.back() = k - 1;
+        queue.tasks.push_back(child_task);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    wake_workers(state);
+}
+
+static void *
+walk_worker_func(void *arg)
+{
+    walk_worker *worker = static_cast<walk_worker *>(arg);
+    walk_state *state = worker->state;
+    Block *block_obj = new Block();
+    walk_task task;
+
+    while (0 == __sync_fetch_and_add(&state->failed, 0)) {
+        // remember wake count before looking into queues, so tasks queued after that
+        // don't go unnoticed
+        pthread_mutex_lock(&state->idle_lock);
+        const uint32_t seen_wake_count = state->wake_count;
+        pthread_mutex_unlock(&state->idle_lock);
+
+        if (not take_task(state, worker->id, task)) {
+            // other workers may still produce tasks, wait for them
+            pthread_mutex_lock(&state->idle_lock);
+            while (seen_wake_count == state->wake_count
+                   and 0 != __sync_fetch_and_add(&state->pending, 0))
+            {
+                pthread_cond_wait(&state->idle_cond, &state->idle_lock);
+            }
+            pthread_mutex_unlock(&state->idle_lock);
+            if (0 == __sync_fetch_and_add(&state->pending, 0))
+                break;
+            continue;
+        }
+        try {
+            walk_internal_node(worker, block_obj, task);
+        } catch (std::logic_error &e) {
+            worker->error = e.what();
+            __sync_fetch_and_add(&state->failed, 1);
+            wake_workers(state);
+        }
+        // the last task done ends the walk
+        if (1 == __sync_fetch_and_sub(&state->pending, 1))
+            wake_workers(state);
+    }
+    delete block_obj;
+    return NULL;
+}
+
+TreeWalker::TreeWalker(int fd, uint32_t thread_count)
+{
+    this->fd = fd;
+    this->thread_count = std::max(1u, thread_count);
+}
+
+void
+TreeWalker::walk(uint32_t root_idx, uint32_t tree_height, std::vector<node> &nodes)
+{
+    nodes.clear();
+    node root;
+    root.block = root_idx;
+    root.parent = 0;
+    root.slot = 0;
+    root.level = tree_height;
+    if (TREE_LEVEL_LEAF == tree_height) {
+        // root is the only leaf
+        nodes.push_back(root);
+        return;
+    }
+
+    // tree of height two is just one internal node, no need for threads
+    const uint32_t worker_count = (tree_height > TREE_LEVEL_LEAF + 1) ? this->thread_count : 1;
+    walk_state state;
+    state.fd = this->fd;
+    state.queues.resize(worker_count);
+    for (uint32_t k = 0; k < worker_count; k ++)
+        pthread_mutex_init(&state.queues[k].lock, NULL);
+    walk_task root_task;
+    root_task.node = root;
+    state.queues[0].tasks.push_back(root_task);
+    state.pending = 1;
+    state.failed = 0;
+    pthread_mutex_init(&state.idle_lock, NULL);
+    pthread_cond_init(&state.idle_cond, NULL);
+    state.wake_count = 0;
+
+    // first worker runs in current thread. If some thread can't be created, its queue just
+    // stays empty, as only owner adds tasks to a queue
+    std::vector<walk_worker> workers(worker_count);
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        workers[k].state = &state;
+        workers[k].id = k;
+        workers[k].started = false;
+    }
+    for (uint32_t k = 1; k < worker_count; k ++) {
+        workers[k].started =
+            (0 == pthread_create(&workers[k].thread, NULL, walk_worker_func, &workers[k]));
+    }
+    walk_worker_func(&workers[0]);
+    for (uint32_t k = 1; k < worker_count; k ++) {
+        if (workers[k].started)
+            pthread_join(workers[k].thread, NULL);
+    }
+    for (uint32_t k = 0; k < worker_count; k ++)
+        pthread_mutex_destroy(&state.queues[k].lock);
+    pthread_cond_destroy(&state.idle_cond);
+    pthread_mutex_destroy(&state.idle_lock);
+    for (uint32_t k = 0; k < worker_count; k ++) {
+        if (not workers[k].error.empty())
+            throw std::logic_error(workers[k].error);
+    }
+
+    // merge results in key order
+    std::vector<const walk_chunk *> chunks;
+    uint32_t node_count = 0;
+    for (std::vector<walk_worker>::const_iterator worker = workers.begin();
+         worker != workers.end(); ++ worker)
+    {
+        for (std::vector<walk_chunk>::const_iterator it = worker->chunks.begin();
+             it != worker->chunks.end(); ++ it)
+        {
+            chunks.push_back(&*it);
+            node_count += it->nodes.size();
+        }
+    }
+    std::sort(chunks.begin(), chunks.end(), chunk_path_less);
+    nodes.reserve(node_count);
+    for (std::vector<const walk_chunk *>::const_iterator it = chunks.begin();
+         it != chunks.end(); ++ it)
+    {
+        nodes.insert(nodes.end(), (*it)->nodes.begin(), (*it)->nodes.end());
+    }
+}